@@ -0,0 +1,66 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+
+#ifndef POPEN_NOSHELL_BENCH_ARGS_H
+#define POPEN_NOSHELL_BENCH_ARGS_H
+
+/*
+ * The parsing of the numeric command-line options, shared by the performance tests.
+ * Each of them is a single file, so the functions are static inline here.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline int safe_atoi(const char *s) {
+	size_t i, len = strlen(s);
+
+	if (len == 0) {
+		errx(EXIT_FAILURE, "safe_atoi(): String is empty");
+	}
+
+	for (i = 0; i < len; ++i) {
+		if (!isdigit((unsigned char)s[i])) {
+			errx(EXIT_FAILURE, "safe_atoi(): Non-numeric characters found in string '%s'", s);
+		}
+	}
+
+	return atoi(s);
+}
+
+// a comma-separated list of numbers into "list"; returns their count, which is at least 1
+static inline int parse_list(char *s, int *list, int max) {
+	char *tok, *saveptr;
+	int n = 0;
+
+	for (tok = strtok_r(s, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (n == max) {
+			errx(EXIT_FAILURE, "Too many values in the list, at most %d are allowed", max);
+		}
+		list[n++] = safe_atoi(tok);
+	}
+	if (n == 0) {
+		errx(EXIT_FAILURE, "The list is empty");
+	}
+	return n;
+}
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include "popen_noshell.h"
+#include "bench_args.h"
+
+/*
+ * This is a performance test program.
+ * The parent holds many open fds without O_CLOEXEC and spawns "./tiny2", which must not inherit any of them.
+ *
+ * The ways to get rid of the fds in the child are compared:
+ *	none: the fds leak into the child; this is the baseline
+ *	naive: close() every possible fd up to RLIMIT_NOFILE, what most programs do
+ *	proc: walk /proc/self/fd, the fallback of popen_noshell for kernels before 5.9
+ *	close_range: what "popen_noshell_options.close_fds" does
+ *
+ * Compile and run via:
+ *	gcc -Wall -O2 close-fds.c popen_noshell.c -o close-fds && ./close-fds --count=2000 --max-fds=200000
+ */
+
+#define METHOD_NONE 0
+#define METHOD_NAIVE 1
+#define METHOD_PROC 2
+#define METHOD_CLOSE_RANGE 3
+
+// internals of popen_noshell.c, in order to measure each method alone
+int _popen_noshell_cloexec_fds_slow(const int *keep_fds, int keep_fds_count);
+int _popen_noshell_child_close_fds(const int *keep_fds, int keep_fds_count);
+
+int method;
+int dev_null_fd;
+int open_max;
+
+int child(void *raw_arg) {
+	char *argv[] = {(char *)"./tiny2", NULL};
+	int fd;
+
+	(void) raw_arg;
+
+	if (dup2(dev_null_fd, STDOUT_FILENO) == -1) _exit(255);
+
+	switch (method) {
+		case METHOD_NAIVE:
+			for (fd = STDERR_FILENO + 1; fd < open_max; ++fd) {
+				close(fd);
+			}
+			break;
+		case METHOD_PROC:
+			if (_popen_noshell_cloexec_fds_slow(NULL, 0) != 0) _exit(255);
+			break;
+		case METHOD_CLOSE_RANGE:
+			if (_popen_noshell_child_close_fds(NULL, 0) != 0) _exit(255);
+			break;
+	}
+
+	execv(argv[0], argv);
+	_exit(255);
+}
+
+double now_sec() {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		err(EXIT_FAILURE, "clock_gettime()");
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// returns the spawns per second
+double run_method(int test_method, int count) {
+	void *stack;
+	double start;
+	pid_t pid;
+	int i, status;
+
+	method = test_method;
+	start = now_sec();
+	for (i = 0; i < count; ++i) {
+		pid = popen_noshell_vmfork(&child, NULL, &stack);
+		if (pid == -1) {
+			err(EXIT_FAILURE, "popen_noshell_vmfork()");
+		}
+		if (waitpid(pid, &status, 0) != pid) {
+			err(EXIT_FAILURE, "waitpid()");
+		}
+		free(stack);
+		if (status != 0) {
+			errx(EXIT_FAILURE, "./tiny2 failed with status %d", status);
+		}
+	}
+	return count / (now_sec() - start);
+}
+
+// opens more fds until there are "fds" of them above STDERR; all of them lack O_CLOEXEC
+void open_fds(int fds) {
+	static int opened = 0;
+
+	for (; opened < fds; ++opened) {
+		if (dup(dev_null_fd) == -1) {
+			err(EXIT_FAILURE, "dup()");
+		}
+	}
+}
+
+void parse_argv(int argc, char **argv, int *count, int *max_fds) {
+	const struct option long_options[] = {
+		{"count", 1, 0, 1},
+		{"max-fds", 1, 0, 2},
+		{0, 0, 0, 0}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "", &long_options[0], NULL)) != -1) {
+		switch (c) {
+			case 1:
+				*count = safe_atoi(optarg);
+				break;
+			case 2:
+				*max_fds = safe_atoi(optarg);
+				break;
+			default:
+				warnx("Usage: %s [--count=spawns] [--max-fds=N]", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (*count < 1 || *max_fds < 10) {
+		errx(EXIT_FAILURE, "--count must be positive and --max-fds at least 10");
+	}
+}
+
+int main(int argc, char **argv) {
+	int count = 1000;
+	int max_fds = 200000;
+	int fds;
+	struct rlimit rl;
+
+	parse_argv(argc, argv, &count, &max_fds);
+
+	rl.rlim_cur = rl.rlim_max = max_fds + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0) { // only root may raise the hard limit
+		if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+			err(EXIT_FAILURE, "getrlimit(RLIMIT_NOFILE)");
+		}
+		if (rl.rlim_max < 74) {
+			errx(EXIT_FAILURE, "RLIMIT_NOFILE is too low");
+		}
+		warnx("Cannot raise RLIMIT_NOFILE to %d, using --max-fds=%d", max_fds + 64, (int)rl.rlim_max - 64);
+		max_fds = rl.rlim_max - 64;
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+			err(EXIT_FAILURE, "setrlimit(RLIMIT_NOFILE)");
+		}
+	}
+	open_max = max_fds + 64;
+
+	dev_null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (dev_null_fd < 0) {
+		err(EXIT_FAILURE, "open(/dev/null)");
+	}
+
+	warnx("Test options: count=%d, max-fds=%d, RLIMIT_NOFILE=%d", count, max_fds, open_max);
+	printf("%8s %12s %12s %12s %12s   (spawns/s)\n", "fds", "none", "naive", "proc", "close_range");
+	fds = 10;
+	while (1) {
+		open_fds(fds);
+		printf("%8d %12.0f %12.0f %12.0f %12.0f\n", fds,
+			run_method(METHOD_NONE, count), run_method(METHOD_NAIVE, count),
+			run_method(METHOD_PROC, count), run_method(METHOD_CLOSE_RANGE, count));
+		fflush(stdout);
+
+		if (fds == max_fds) break;
+		fds = (fds * 10 < max_fds ? fds * 10 : max_fds);
+	}
+
+	return 0;
+}
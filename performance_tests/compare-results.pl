@@ -0,0 +1,164 @@
+#!/usr/bin/perl
+# popen_noshell: A faster implementation of popen() and system() for Linux.
+# Copyright (c) 2009 Ivan Zahariev (famzah)
+# Version: 1.0
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; under version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses>.
+
+# Compares the JSON of "fork-performance --json=FILE" with older results, in order to catch regressions.
+#
+# The baselines are either the reports of the old run-tests.pl in results/*.txt, or older JSON files.
+# They come from other machines, so the absolute times cannot be compared. Instead, the CPU time of each mode
+# is divided by the one of "vfork() + exec()" on the same machine, and these ratios are compared.
+#
+# Usage: ./compare-results.pl [--tolerance=PERCENT] [--baseline=FILE ...] new.json
+# Without --baseline, all results/*.txt are used. The exit code is 1 if any mode got slower than the tolerance.
+
+use strict;
+use warnings;
+
+use Getopt::Long;
+use JSON::PP;
+use File::Basename;
+
+my $reference = 'vfork() + exec(), standard Libc';
+my $tolerance = 20; # percent
+my @baselines = ();
+
+sub usage() {
+	die("Usage: $0 [--tolerance=PERCENT] [--baseline=FILE ...] new.json\n");
+}
+
+sub read_file($) {
+	my ($file) = @_;
+	my $fh;
+
+	open($fh, '<', $file) or die("open($file): $!");
+	local $/;
+	my $data = <$fh>;
+	close($fh);
+
+	return $data;
+}
+
+# returns ({caption => cpu_seconds_per_spawn}, memsize, ratio) of a report of the old run-tests.pl
+sub parse_txt($) {
+	my ($file) = @_;
+	my %cpu = ();
+	my ($count, $memsize, $ratio, $in_sheet);
+
+	foreach my $line (split(/\n/, read_file($file))) {
+		if ($line =~ /^\s+\|\s+count=(\d+), memsize=(\d+), ratio=(\d+)$/) {
+			($count, $memsize, $ratio) = ($1, $2, $3);
+		} elsif ($line =~ /^Here is the data for the graphs:/) {
+			$in_sheet = 1;
+		} elsif ($in_sheet && $line =~ /^\s+\|\s+(.+?) \| avg_user_t \| [\d.]+ \| avg_sys_t \| [\d.]+ \| total_t \| ([\d.]+)$/) {
+			$cpu{$1} = $2;
+		}
+	}
+	if (!defined($count) || !%cpu) {
+		die("$file: Not a report of run-tests.pl");
+	}
+	foreach (keys %cpu) {
+		$cpu{$_} /= $count;
+	}
+
+	return (\%cpu, $memsize, $ratio);
+}
+
+# the same as parse_txt() but for a JSON of fork-performance; "memsize" and "ratio" select the results if given
+# Only the "plain" profile of the parent memory is compared, as this is the only one of the older results.
+sub parse_json($$$) {
+	my ($file, $memsize, $ratio) = @_;
+	my $json = decode_json(read_file($file));
+	my %cpu = ();
+	my $r;
+
+	$json->{'results'} = [grep { ($_->{'profile'} // 'plain') eq 'plain' } @{$json->{'results'}}];
+	if (!defined($memsize)) { # the biggest memory, as this is where the modes differ the most
+		foreach $r (@{$json->{'results'}}) {
+			if (!defined($memsize) || $r->{'memsize'} > $memsize || ($r->{'memsize'} == $memsize && $r->{'ratio'} > $ratio)) {
+				($memsize, $ratio) = ($r->{'memsize'}, $r->{'ratio'});
+			}
+		}
+	}
+	foreach $r (@{$json->{'results'}}) {
+		next if ($r->{'memsize'} != $memsize || $r->{'ratio'} != $ratio);
+		$cpu{$r->{'caption'}} = ($r->{'user_s'} + $r->{'sys_s'}) / $r->{'count'};
+	}
+
+	return (\%cpu, $memsize, $ratio);
+}
+
+sub compare($$) {
+	my ($baseline, $new_file) = @_;
+	my ($base, $memsize, $ratio, $new, $new_memsize, $new_ratio);
+	my ($caption, $base_rel, $new_rel, $change);
+	my $ok = 1;
+
+	if ($baseline =~ /\.json$/) {
+		($base, $memsize, $ratio) = parse_json($baseline, undef, undef);
+	} else {
+		($base, $memsize, $ratio) = parse_txt($baseline);
+	}
+	($new, $new_memsize, $new_ratio) = parse_json($new_file, $memsize, $ratio);
+	if (!%$new) {
+		($new, $new_memsize, $new_ratio) = parse_json($new_file, undef, undef);
+		print "WARNING: No results for memsize=$memsize, ratio=$ratio; using memsize=$new_memsize, ratio=$new_ratio\n";
+	}
+
+	printf("Baseline %s (memsize=%d, ratio=%d), CPU time relative to \"%s\":\n", basename($baseline), $memsize, $ratio, $reference);
+	if (!$base->{$reference} || !$new->{$reference}) {
+		print "\tSKIPPED: The reference mode is missing\n\n";
+		return 1;
+	}
+
+	printf("\t%-56s %8s %8s %8s\n", 'mode', 'before', 'now', 'change');
+	foreach $caption (sort keys %$new) {
+		if (!exists($base->{$caption})) {
+			printf("\t%-56s %8s %8.2f\n", $caption, '-', $new->{$caption} / $new->{$reference});
+			next;
+		}
+		$base_rel = $base->{$caption} / $base->{$reference};
+		$new_rel = $new->{$caption} / $new->{$reference};
+		$change = ($new_rel / $base_rel - 1) * 100;
+		printf("\t%-56s %8.2f %8.2f %7.0f%%%s\n", $caption, $base_rel, $new_rel, $change,
+			($change > $tolerance ? ' REGRESSION' : ''));
+		$ok = 0 if ($change > $tolerance);
+	}
+	print "\n";
+
+	return $ok;
+}
+
+GetOptions(
+	'tolerance=i' => \$tolerance,
+	'baseline=s' => \@baselines,
+) or usage();
+usage() if (@ARGV != 1);
+
+if (!@baselines) {
+	@baselines = glob(dirname($0).'/results/*.txt');
+	die('No baselines found in results/') if (!@baselines);
+}
+
+my $success = 1;
+foreach (@baselines) {
+	$success &= compare($_, $ARGV[0]);
+}
+if (!$success) {
+	print "Some modes got more than $tolerance% slower compared to \"$reference\".\n";
+	exit(1);
+}
+print "OK, no regressions beyond $tolerance%.\n";
+exit(0);
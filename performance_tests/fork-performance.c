@@ -16,16 +16,32 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses>.
  */
 
+// _GNU_SOURCE must be defined as early as possible, for memfd_create()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <unistd.h>
 #include <err.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <gnu/libc-version.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "popen_noshell.h"
+#include "bench_args.h"
 #include <spawn.h>
 
 extern char **environ;
@@ -35,13 +51,42 @@ extern char **environ;
  * It invokes the extremely light, statically build binary "./tiny2" which outputs "Hello, world!" and exits.
  *
  * Different approaches for calling "./tiny2" are tried, in order to compare their performance results.
+ * Each spawn is timed alone, from the start until the child is reaped, so that latency percentiles can be given
+ * along with the throughput and the CPU time of the parent and its children.
+ *
+ * All modes run in one process, and a whole matrix of memory sizes and ratios can be swept; the parent allocates
+ * that much memory before spawning, because fork() gets slower as the parent uses more memory.
+ *
+ * Not only the size of the memory matters, but also its shape, so the memory of the parent can follow a profile:
+ *	plain: malloc(), as in the older results
+ *	thp: transparent huge pages, madvise(MADV_HUGEPAGE) on 2 MB aligned memory
+ *	hugetlb: MAP_HUGETLB; needs reserved huge pages in /proc/sys/vm/nr_hugepages
+ *	mlock: mlock()'ed memory, which is all resident; needs a big enough RLIMIT_MEMLOCK
+ *	vmas: --vmas one-page private mappings of a file, so that the memory map has that many VMAs; ignores --memsize
+ *	shm: a shared memory segment, like the ones of databases and of multi-process servers
+ * The "ratio" applies to all of them except "mlock" and "vmas", which are always fully resident.
  *
+ * Besides the time, the cost of a spawn is broken down into the minor page faults and the kernel time (by getrusage()),
+ * and into the number of system calls (by a perf counter of the "raw_syscalls:sys_enter" tracepoint), all of them
+ * per spawn, separately for the parent and for the child. The child includes the startup of "./tiny2" after exec(),
+ * which is the same for all modes. Counting the system calls needs tracefs, e.g. "mount -t tracefs nodev
+ * /sys/kernel/tracing", and a low enough /proc/sys/kernel/perf_event_paranoid; otherwise they are reported as -1.
+ *
+ * Compile and run via:
+ *	gcc -Wall -O2 -static popen_noshell_trampoline.c -o popen_noshell_trampoline # for the trampoline mode
+ *	gcc -Wall -O2 fork-performance.c popen_noshell.c -o fork-performance
+ *	./fork-performance --count=10000 --memsize=20,200 --ratio=0,2 --mode=all --json=results.json
+ *	./fork-performance --count=2000 --memsize=1000 --profile=plain,thp,mlock,vmas,shm --mode=0,1,5,8
+ *
+ * Compare the JSON with the older results by "./compare-results.pl results.json".
  */
 
 #define USE_LIBC_POPEN 0
 #define USE_NOSHELL_POPEN 1
 
 int use_noshell_compat = 0;
+int use_no_signal_mask = 0; /* measures what the signal blocking around clone() costs */
+FILE *report; /* our STDOUT; the real one goes to /dev/null, because some modes don't read the output of "./tiny2" */
 
 void popen_test(int type) {
 	char *exec_file = "./tiny2";
@@ -49,12 +94,15 @@ void popen_test(int type) {
 	char *argv[] = {exec_file, arg1};
 	FILE *fp;
 	struct popen_noshell_pass_to_pclose pclose_arg;
+	struct popen_noshell_options opts;
 	int status;
 	char buf[64];
 
 	if (type) {
 		if (!use_noshell_compat) {
-			fp = popen_noshell(exec_file, (const char * const *)argv, "r", &pclose_arg, 0);
+			popen_noshell_options_init(&opts);
+			opts.no_signal_mask = use_no_signal_mask;
+			fp = popen_noshell_ex(exec_file, (const char * const *)argv, "r", &pclose_arg, &opts);
 		} else {
 			fp = popen_noshell_compat(exec_file, "r", &pclose_arg);
 			argv[0] = NULL; // satisfy GCC warnings
@@ -107,6 +155,17 @@ void posix_spawn_test() {
 	parent_waitpid(pid);
 }
 
+// returns as soon as "./tiny2" runs; init reaps it, so the times of the child are not counted here
+void detached_test() {
+	char * const argv[] = { "./tiny2" , NULL };
+	struct popen_noshell_options opts;
+
+	popen_noshell_options_init(&opts);
+	if (popen_noshell_spawn_detached(argv[0], (const char * const *)argv, &opts, NULL) != 0) {
+		err(EXIT_FAILURE, "popen_noshell_spawn_detached()");
+	}
+}
+
 void fork_test(int type) {
 	pid_t pid;
 
@@ -128,7 +187,7 @@ void fork_test(int type) {
 	parent_waitpid(pid);
 }
 
-char *allocate_memory(int size_in_mb, int ratio) {
+char *allocate_memory(int size_in_mb, int ratio) { // free() the result
 	char *m;
 	int size;
 	int i;
@@ -149,179 +208,636 @@ char *allocate_memory(int size_in_mb, int ratio) {
 	return m;
 }
 
-int safe_atoi(char *s) {
-	int i;
+#define PROFILES 6
 
-	if (strlen(s) == 0) {
-		errx(EXIT_FAILURE, "safe_atoi(): String is empty");
-	}
+const char *profile_names[PROFILES] = {"plain", "thp", "hugetlb", "mlock", "vmas", "shm"};
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+struct parent_memory {
+	char *malloced; /* "plain" */
+	void *mapped; /* all other profiles */
+	size_t mapped_size;
+	void **vmas; /* "vmas" */
+	int vmas_n;
+};
 
-	for (i = 0; i < strlen(s); ++i) {
-		if (!isdigit(s[i])) {
-			errx(EXIT_FAILURE, "safe_atoi(): Non-numeric characters found in string '%s'", s);
+void touch_memory(char *m, size_t size, int ratio) {
+	size_t i;
+
+	if (ratio != 0) {
+		for (i = 0; i < size/ratio; i += 512) { // a few bytes per page are enough, but let's be sure with bigger pages too
+			*(m + i) = 'z';
 		}
 	}
-
-	return atoi(s);
 }
 
-void parse_argv(int argc, char **argv, int *count, int *allocated_memory_size_in_mb, int *allocated_memory_usage_ratio, int *test_mode) {
-	const struct option long_options[] = {
-		{"count", 1, 0, 1},
-		{"memsize", 1, 0, 2},
-		{"ratio", 1, 0, 3},
-		{"mode", 1, 0, 4},
-		{0, 0, 0, 0}
-	};
-	int c;
-	int usage = 0;
-	int got[4];
-	int optarg_int;
-
-	memset(&got, 0, sizeof(got));
-	while (1) {
-		c = getopt_long(argc, argv, "", &long_options[0], NULL);
-		if (c == -1) { // no more arguments
+// returns 0 if the profile is not supported here; the reason is printed
+int shape_memory(struct parent_memory *pm, int profile, int size_in_mb, int ratio, int vmas) {
+	size_t size = (size_t)size_in_mb * 1024 * 1024;
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *aligned;
+	int i, fd;
+
+	memset(pm, 0, sizeof(*pm));
+	switch (profile) {
+		case 0: // plain
+			pm->malloced = allocate_memory(size_in_mb, ratio);
+			break;
+		case 1: // thp
+			pm->mapped_size = size + HUGE_PAGE_SIZE;
+			pm->mapped = mmap(NULL, pm->mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (pm->mapped == MAP_FAILED) err(EXIT_FAILURE, "mmap()");
+			aligned = (char *)(((uintptr_t)pm->mapped + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+			if (madvise(aligned, size, MADV_HUGEPAGE) != 0) {
+				warn("thp: madvise(MADV_HUGEPAGE)");
+				return 0;
+			}
+			touch_memory(aligned, size, ratio);
+			break;
+		case 2: // hugetlb
+			pm->mapped_size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+			pm->mapped = mmap(NULL, pm->mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (pm->mapped == MAP_FAILED) {
+				pm->mapped = NULL;
+				warn("hugetlb: mmap(MAP_HUGETLB) of %d MB; reserve huge pages by /proc/sys/vm/nr_hugepages", size_in_mb);
+				return 0;
+			}
+			touch_memory((char *)pm->mapped, pm->mapped_size, ratio);
+			break;
+		case 3: // mlock
+			pm->mapped_size = size;
+			pm->mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (pm->mapped == MAP_FAILED) err(EXIT_FAILURE, "mmap()");
+			if (mlock(pm->mapped, size) != 0) {
+				warn("mlock: mlock() of %d MB; raise RLIMIT_MEMLOCK", size_in_mb);
+				return 0;
+			}
+			touch_memory((char *)pm->mapped, size, 1); // make the pages private copies, mlock() only faulted them in
+			break;
+		case 4: // vmas
+			fd = memfd_create("fork-performance", MFD_CLOEXEC);
+			if (fd < 0 || ftruncate(fd, (off_t)vmas * page_size) != 0) err(EXIT_FAILURE, "memfd_create()");
+			pm->vmas = (void **)calloc(vmas, sizeof(void *));
+			if (!pm->vmas) err(EXIT_FAILURE, "calloc()");
+			for (i = 0; i < vmas; ++i) {
+				// the protection alternates, so that the kernel cannot merge the neighbours into one VMA
+				pm->vmas[i] = mmap(NULL, page_size, (i % 2 ? PROT_READ : PROT_READ | PROT_WRITE), MAP_PRIVATE, fd, (off_t)i * page_size);
+				if (pm->vmas[i] == MAP_FAILED) {
+					warn("vmas: mmap() #%d; raise /proc/sys/vm/max_map_count", i);
+					pm->vmas_n = i;
+					close(fd);
+					return 0;
+				}
+				pm->vmas_n = i + 1;
+				if (i % 2) {
+					(void) *(volatile char *)pm->vmas[i]; // a page of the page cache
+				} else {
+					*(char *)pm->vmas[i] = 'z'; // an anonymous copy-on-write page
+				}
+			}
+			close(fd);
+			break;
+		case 5: // shm
+			fd = memfd_create("fork-performance", MFD_CLOEXEC);
+			if (fd < 0 || ftruncate(fd, size) != 0) err(EXIT_FAILURE, "memfd_create()");
+			pm->mapped_size = size;
+			pm->mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (pm->mapped == MAP_FAILED) err(EXIT_FAILURE, "mmap()");
+			close(fd);
+			touch_memory((char *)pm->mapped, size, ratio);
 			break;
+	}
+
+	return 1;
+}
+
+void release_memory(struct parent_memory *pm) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	int i;
+
+	free(pm->malloced);
+	if (pm->mapped && munmap(pm->mapped, pm->mapped_size) != 0) {
+		err(EXIT_FAILURE, "munmap()");
+	}
+	for (i = 0; i < pm->vmas_n; ++i) {
+		if (munmap(pm->vmas[i], page_size) != 0) {
+			err(EXIT_FAILURE, "munmap()");
 		}
+	}
+	free(pm->vmas);
+}
+
+// the RSS and the number of VMAs of the parent, to check that a profile took effect
+void describe_memory(long *rss_mb, long *thp_mb, int *vmas) {
+	char line[512];
+	long kb;
+	FILE *fp;
+
+	*rss_mb = *thp_mb = 0;
+	*vmas = 0;
 
-		if (c >= 1 && c <= sizeof(got)/sizeof(int)) {
-			got[c-1] = 1;
+	fp = fopen("/proc/self/smaps_rollup", "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "Rss: %ld kB", &kb) == 1) *rss_mb = kb / 1024;
+			if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) *thp_mb = kb / 1024;
+		}
+		fclose(fp);
+	}
+	fp = fopen("/proc/self/maps", "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			if (strchr(line, '\n')) ++*vmas;
 		}
+		fclose(fp);
+	}
+}
+
+void run_mode(int test_mode) {
+	switch (test_mode) {
+		/* the following fork + exec calls do not return the output of their commands */
+		case 0:
+			fork_test(1);
+			break;
+		case 1:
+			fork_test(0);
+			break;
+		case 2:
+			if (system("./tiny2 >/dev/null") != 0) {
+				err(EXIT_FAILURE, "system()");
+			}
+			break;
+
+		/* all the below popen() use-cases are tested if they return the correct string in *fp */
+		case 3:
+			popen_test(USE_LIBC_POPEN);
+			break;
+		case 4:
+		case 5:
+		case 6:
+		case 7:
+		case 8:
+		case 9:
+		case 11:
+		case 13:
+		case 14:
+			popen_test(USE_NOSHELL_POPEN);
+			break;
+		case 10:
+			posix_spawn_test();
+			break;
+		case 12:
+			detached_test();
+			break;
+		default:
+			errx(EXIT_FAILURE, "Bad mode");
+			break;
+	}
+}
+
+#define MODES 15
+
+/* the captions are the same as in the older results, see compare-results.pl */
+const char *mode_captions[MODES] = {
+	"fork() + exec(), standard Libc",
+	"vfork() + exec(), standard Libc",
+	"system(), standard Libc",
+	"popen(), standard Libc",
+	"the new noshell, debug fork(), compat=0",
+	"the new noshell, default clone(), compat=0",
+	"the new noshell, debug fork(), compat=1",
+	"the new noshell, default clone(), compat=1",
+	"the new noshell, posix_spawn(), compat=0",
+	"the new noshell, posix_spawn(), compat=1",
+	"posix_spawn() + exec() no pipes, standard Libc",
+	"the new noshell, clone() without signal mask, compat=0",
+	"the new noshell, detached clone(), no wait",
+	"the new noshell, vfork(), compat=0",
+	"the new noshell, trampoline posix_spawn(), compat=0",
+};
+
+void setup_mode(int test_mode) {
+	int fork_modes[MODES] = {0, 0, 0, 0,
+		POPEN_NOSHELL_MODE_FORK, POPEN_NOSHELL_MODE_CLONE, POPEN_NOSHELL_MODE_FORK, POPEN_NOSHELL_MODE_CLONE,
+		POPEN_NOSHELL_MODE_POSIX_SPAWN, POPEN_NOSHELL_MODE_POSIX_SPAWN, 0, POPEN_NOSHELL_MODE_CLONE, POPEN_NOSHELL_MODE_CLONE,
+		POPEN_NOSHELL_MODE_VFORK, POPEN_NOSHELL_MODE_TRAMPOLINE};
+
+	use_noshell_compat = (test_mode == 6 || test_mode == 7 || test_mode == 9);
+	use_no_signal_mask = (test_mode == 11);
+	popen_noshell_set_fork_mode(fork_modes[test_mode]);
+	popen_noshell_set_trampoline("./popen_noshell_trampoline");
+}
+
+struct result {
+	const char *profile;
+	int memsize;
+	int ratio;
+	int mode;
+	int count;
+	double wall_s;
+	double user_s; /* of the parent and the children together, like time(1) reports */
+	double sys_s;
+	double spawns_per_s;
+	double lat_min_us, lat_mean_us, lat_p50_us, lat_p99_us, lat_p999_us, lat_max_us;
+	/* per spawn; the "child" values include the program after exec() */
+	double minflt_parent, minflt_child;
+	double sys_us_parent, sys_us_child;
+	double syscalls_parent, syscalls_child; /* -1 if they cannot be counted */
+};
+
+// the counters of a measure(): [0] is of the parent alone, [1] is inherited by the children and sums them all
+struct counters {
+	struct rusage self, children;
+	int syscall_fds[2]; /* -1 if not available */
+};
+
+// the ID of the "raw_syscalls:sys_enter" tracepoint, or -1 if tracefs is not mounted
+long syscall_tracepoint_id() {
+	const char *paths[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+	long id = -1;
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < 2 && id == -1; ++i) {
+		fp = fopen(paths[i], "r");
+		if (!fp) continue;
+		if (fscanf(fp, "%ld", &id) != 1) id = -1;
+		fclose(fp);
+	}
+	return id;
+}
 
-		if (!optarg) {
-			warnx("You provided no value");
-			usage = 1;
+void counters_start(struct counters *c) {
+	static int warned = 0;
+	struct perf_event_attr attr;
+	long id = syscall_tracepoint_id();
+	int i;
+
+	c->syscall_fds[0] = c->syscall_fds[1] = -1;
+	for (i = 0; i < 2 && id != -1; ++i) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_TRACEPOINT;
+		attr.config = id;
+		attr.disabled = 1;
+		attr.inherit = i;
+		c->syscall_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (c->syscall_fds[i] == -1) {
+			if (!warned) warn("perf_event_open(raw_syscalls:sys_enter)");
+			if (i == 1) close(c->syscall_fds[0]);
+			c->syscall_fds[0] = -1;
 			break;
 		}
-		optarg_int = safe_atoi(optarg);
+	}
+	if (c->syscall_fds[0] == -1 && !warned) {
+		warnx("The system calls cannot be counted; see the comments in %s", __FILE__);
+	}
+	warned = 1;
 
-		switch (c) {
-			case 1:
-				*count = optarg_int;
-				break;
-			case 2:
-				*allocated_memory_size_in_mb = optarg_int;
-				break;
-			case 3:
-				*allocated_memory_usage_ratio = optarg_int;
-				break;
-			case 4:
-				*test_mode = optarg_int;
-				break;
-			default:
-				warnx("Bad option");
-				usage = 1;
-				break;
+	for (i = 0; i < 2 && c->syscall_fds[0] != -1; ++i) {
+		if (ioctl(c->syscall_fds[i], PERF_EVENT_IOC_ENABLE, 0) != 0) {
+			err(EXIT_FAILURE, "ioctl(PERF_EVENT_IOC_ENABLE)");
 		}
+	}
+	if (getrusage(RUSAGE_SELF, &c->self) != 0 || getrusage(RUSAGE_CHILDREN, &c->children) != 0) {
+		err(EXIT_FAILURE, "getrusage()");
+	}
+}
 
-		if (usage) {
-			break;
+double tv_us(const struct timeval *tv) {
+	return tv->tv_sec * 1e6 + tv->tv_usec;
+}
+
+void counters_stop(struct counters *c, struct result *r) {
+	struct rusage self, children;
+	uint64_t value[2];
+	int i;
+
+	for (i = 0; i < 2 && c->syscall_fds[0] != -1; ++i) {
+		if (ioctl(c->syscall_fds[i], PERF_EVENT_IOC_DISABLE, 0) != 0) {
+			err(EXIT_FAILURE, "ioctl(PERF_EVENT_IOC_DISABLE)");
 		}
 	}
+	if (getrusage(RUSAGE_SELF, &self) != 0 || getrusage(RUSAGE_CHILDREN, &children) != 0) {
+		err(EXIT_FAILURE, "getrusage()");
+	}
 
-	for (c = 0; c < sizeof(got)/sizeof(int); ++c) {
-		if (!got[c]) {
-			warnx("Option #%d not specified", c);
-			usage = 1;
+	r->minflt_parent = (double)(self.ru_minflt - c->self.ru_minflt) / r->count;
+	r->minflt_child = (double)(children.ru_minflt - c->children.ru_minflt) / r->count;
+	r->sys_us_parent = (tv_us(&self.ru_stime) - tv_us(&c->self.ru_stime)) / r->count;
+	r->sys_us_child = (tv_us(&children.ru_stime) - tv_us(&c->children.ru_stime)) / r->count;
+
+	r->syscalls_parent = r->syscalls_child = -1;
+	if (c->syscall_fds[0] == -1) return;
+	for (i = 0; i < 2; ++i) {
+		if (read(c->syscall_fds[i], &value[i], sizeof(value[i])) != sizeof(value[i])) {
+			err(EXIT_FAILURE, "read(perf counter)");
 		}
+		close(c->syscall_fds[i]);
 	}
+	// the ioctl(PERF_EVENT_IOC_DISABLE) of the parent counter is counted only by the inherited one
+	r->syscalls_parent = (double)value[0] / r->count;
+	r->syscalls_child = (double)(value[1] - value[0]) / r->count;
+}
 
-	if (usage) {
-		warnx("Usage: %s ...options - all are required...\n", argv[0]);
-		warnx("\t--count\n\t--memsize [MBytes]\n\t--ratio [0..N, 0=no_usage_of_memory]\n\t--mode [0..7]\n");
-		exit(EXIT_FAILURE);
+int64_t now_ns() {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		err(EXIT_FAILURE, "clock_gettime()");
 	}
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int main(int argc, char **argv) {
-	int count;
-	int allocated_memory_size_in_mb;
-	int allocated_memory_usage_ratio;
-	int test_mode;
-	int wrote = 0;
+double cpu_time(int user) {
+	struct rusage self, children;
+
+	if (getrusage(RUSAGE_SELF, &self) != 0 || getrusage(RUSAGE_CHILDREN, &children) != 0) {
+		err(EXIT_FAILURE, "getrusage()");
+	}
+	if (user) {
+		return self.ru_utime.tv_sec + children.ru_utime.tv_sec + (self.ru_utime.tv_usec + children.ru_utime.tv_usec) / 1e6;
+	}
+	return self.ru_stime.tv_sec + children.ru_stime.tv_sec + (self.ru_stime.tv_usec + children.ru_stime.tv_usec) / 1e6;
+}
 
-	count = 30000;
-	allocated_memory_size_in_mb = 20;
-	allocated_memory_usage_ratio = 2; /* the memory usage is 1 divided by the "allocated_memory_usage_ratio", use 0 for "no usage" at all */
-	test_mode = 5;
+int cmp_int64(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
 
-	parse_argv(argc, argv, &count, &allocated_memory_size_in_mb, &allocated_memory_usage_ratio, &test_mode);
+	return (x > y) - (x < y);
+}
 
-	allocate_memory(allocated_memory_size_in_mb, allocated_memory_usage_ratio);
+// the nearest-rank percentile of the sorted "lat"
+double percentile_us(const int64_t *lat, int count, double p) {
+	int i = (int)(p / 100 * count + 0.999999) - 1;
 
-	warnx("Test options: count=%d, memsize=%d, ratio=%d, mode=%d", count, allocated_memory_size_in_mb, allocated_memory_usage_ratio, test_mode);
+	if (i < 0) i = 0;
+	if (i >= count) i = count - 1;
+	return lat[i] / 1e3;
+}
 
-	while (count--) {
-		switch (test_mode) {
-			/* the following fork + exec calls do not return the output of their commands */
-			case 0:
-				if (!wrote) warnx("fork() + exec(), standard Libc");
-				fork_test(1);
-				break;
+void measure(struct result *r, int64_t *lat, int warmup) {
+	struct counters counters;
+	double user_t, sys_t;
+	int64_t start, t, sum = 0;
+	int i;
+
+	setup_mode(r->mode);
+	for (i = 0; i < warmup; ++i) {
+		run_mode(r->mode);
+	}
+
+	counters_start(&counters);
+	user_t = cpu_time(1);
+	sys_t = cpu_time(0);
+	start = now_ns();
+	for (i = 0; i < r->count; ++i) {
+		t = now_ns();
+		run_mode(r->mode);
+		lat[i] = now_ns() - t;
+		sum += lat[i];
+	}
+	r->wall_s = (now_ns() - start) / 1e9;
+	counters_stop(&counters, r);
+	r->user_s = cpu_time(1) - user_t;
+	r->sys_s = cpu_time(0) - sys_t;
+	r->spawns_per_s = r->count / r->wall_s;
+
+	qsort(lat, r->count, sizeof(int64_t), cmp_int64);
+	r->lat_min_us = lat[0] / 1e3;
+	r->lat_mean_us = sum / 1e3 / r->count;
+	r->lat_p50_us = percentile_us(lat, r->count, 50);
+	r->lat_p99_us = percentile_us(lat, r->count, 99);
+	r->lat_p999_us = percentile_us(lat, r->count, 99.9);
+	r->lat_max_us = lat[r->count - 1] / 1e3;
+}
+
+void print_result(const struct result *r) {
+	fprintf(report, "%-8s %7d %5d %4d %10.0f %8.2f %8.2f %9.1f %9.1f %9.1f %9.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f  %s\n",
+		r->profile, r->memsize, r->ratio, r->mode,
+		r->spawns_per_s, r->user_s, r->sys_s, r->lat_p50_us, r->lat_p99_us, r->lat_p999_us, r->lat_max_us,
+		r->minflt_parent, r->minflt_child, r->sys_us_parent, r->sys_us_child, r->syscalls_parent, r->syscalls_child,
+		mode_captions[r->mode]);
+	fflush(report);
+}
+
+void write_json(const char *path, const struct result *results, int n, int count) {
+	struct utsname un;
+	FILE *fp;
+	int i;
+
+	if (uname(&un) != 0) {
+		err(EXIT_FAILURE, "uname()");
+	}
+	fp = (strcmp(path, "-") == 0 ? report : fopen(path, "w"));
+	if (!fp) {
+		err(EXIT_FAILURE, "fopen(%s)", path);
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"version\": 1,\n");
+	fprintf(fp, "  \"system\": {\"sysname\": \"%s\", \"release\": \"%s\", \"machine\": \"%s\", \"libc\": \"glibc %s\", \"cpus\": %ld},\n",
+		un.sysname, un.release, un.machine, gnu_get_libc_version(), sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(fp, "  \"count\": %d,\n", count);
+	fprintf(fp, "  \"results\": [\n");
+	for (i = 0; i < n; ++i) {
+		const struct result *r = &results[i];
+
+		fprintf(fp, "    {\"profile\": \"%s\", \"memsize\": %d, \"ratio\": %d, \"mode\": %d, \"caption\": \"%s\", \"count\": %d, "
+			"\"wall_s\": %.3f, \"user_s\": %.3f, \"sys_s\": %.3f, \"spawns_per_s\": %.1f, "
+			"\"latency_us\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}, "
+			"\"per_spawn\": {\"minflt_parent\": %.2f, \"minflt_child\": %.2f, \"sys_us_parent\": %.2f, \"sys_us_child\": %.2f, "
+			"\"syscalls_parent\": %.2f, \"syscalls_child\": %.2f}}%s\n",
+			r->profile, r->memsize, r->ratio, r->mode, mode_captions[r->mode], r->count,
+			r->wall_s, r->user_s, r->sys_s, r->spawns_per_s,
+			r->lat_min_us, r->lat_mean_us, r->lat_p50_us, r->lat_p99_us, r->lat_p999_us, r->lat_max_us,
+			r->minflt_parent, r->minflt_child, r->sys_us_parent, r->sys_us_child, r->syscalls_parent, r->syscalls_child,
+			(i + 1 < n ? "," : ""));
+	}
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+
+	if (fp != report && fclose(fp) != 0) {
+		err(EXIT_FAILURE, "fclose(%s)", path);
+	}
+}
+
+// parses a comma-separated list of numbers into "list"; returns how many there were
+
+#define MAX_SWEEP 16
+
+struct config {
+	int count;
+	int warmup;
+	int memsizes[MAX_SWEEP];
+	int memsizes_n;
+	int ratios[MAX_SWEEP];
+	int ratios_n;
+	int modes[MODES];
+	int modes_n;
+	int profiles[PROFILES];
+	int profiles_n;
+	int vmas;
+	const char *json_path;
+};
+
+void usage(const char *prog) {
+	warnx("Usage: %s [options]", prog);
+	warnx("\t--count=N            spawns per mode (default 10000)");
+	warnx("\t--warmup=N           untimed spawns before each mode (default 100)");
+	warnx("\t--memsize=MB[,MB..]  memory allocated by the parent (default 20)");
+	warnx("\t--ratio=N[,N..]      1/N of the memory is used, 0=no_usage_of_memory (default 2)");
+	warnx("\t--mode=all|N[,N..]   0..%d, see the captions in the output (default all)", MODES - 1);
+	warnx("\t--profile=NAME[,..]  the shape of the memory: plain, thp, hugetlb, mlock, vmas, shm (default plain)");
+	warnx("\t--vmas=N             the number of mappings of the \"vmas\" profile (default 50000)");
+	warnx("\t--json=FILE          also write the results as JSON, \"-\" for STDOUT");
+	exit(EXIT_FAILURE);
+}
+
+void parse_argv(int argc, char **argv, struct config *cfg) {
+	const struct option long_options[] = {
+		{"count", 1, 0, 1},
+		{"memsize", 1, 0, 2},
+		{"ratio", 1, 0, 3},
+		{"mode", 1, 0, 4},
+		{"json", 1, 0, 5},
+		{"warmup", 1, 0, 6},
+		{"profile", 1, 0, 7},
+		{"vmas", 1, 0, 8},
+		{0, 0, 0, 0}
+	};
+	char *tok, *saveptr;
+	int c, i;
+
+	while ((c = getopt_long(argc, argv, "", &long_options[0], NULL)) != -1) {
+		switch (c) {
 			case 1:
-				if (!wrote) warnx("vfork() + exec(), standard Libc");
-				fork_test(0);
+				cfg->count = safe_atoi(optarg);
 				break;
 			case 2:
-				if (!wrote) warnx("system(), standard Libc");
-				if (system("./tiny2 >/dev/null") != 0) {
-					err(EXIT_FAILURE, "system()");
-				}
+				cfg->memsizes_n = parse_list(optarg, cfg->memsizes, MAX_SWEEP);
 				break;
-
-			/* all the below popen() use-cases are tested if they return the correct string in *fp */
 			case 3:
-				if (!wrote) warnx("popen(), standard Libc");
-				popen_test(USE_LIBC_POPEN);
+				cfg->ratios_n = parse_list(optarg, cfg->ratios, MAX_SWEEP);
 				break;
 			case 4:
-				use_noshell_compat = 0;
-				if (!wrote) warnx("the new noshell, debug fork(), compat=%d", use_noshell_compat);
-				popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_FORK);
-				popen_test(USE_NOSHELL_POPEN);
+				if (strcmp(optarg, "all") == 0) {
+					cfg->modes_n = 0;
+				} else {
+					cfg->modes_n = parse_list(optarg, cfg->modes, MODES);
+				}
 				break;
 			case 5:
-				use_noshell_compat = 0;
-				if (!wrote) warnx("the new noshell, default clone(), compat=%d", use_noshell_compat);
-				popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_CLONE);
-				popen_test(USE_NOSHELL_POPEN);
+				cfg->json_path = optarg;
 				break;
 			case 6:
-				use_noshell_compat = 1;
-				if (!wrote) warnx("the new noshell, debug fork(), compat=%d", use_noshell_compat);
-				popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_FORK);
-				popen_test(USE_NOSHELL_POPEN);
+				cfg->warmup = safe_atoi(optarg);
 				break;
 			case 7:
-				use_noshell_compat = 1;
-				if (!wrote) warnx("the new noshell, default clone(), compat=%d", use_noshell_compat);
-				popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_CLONE);
-				popen_test(USE_NOSHELL_POPEN);
+				cfg->profiles_n = 0;
+				for (tok = strtok_r(optarg, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+					for (i = 0; i < PROFILES && strcmp(tok, profile_names[i]) != 0; ++i);
+					if (i == PROFILES || cfg->profiles_n == PROFILES) {
+						errx(EXIT_FAILURE, "Bad profile '%s'", tok);
+					}
+					cfg->profiles[cfg->profiles_n++] = i;
+				}
 				break;
 			case 8:
-				use_noshell_compat = 0;
-				if (!wrote) warnx("the new noshell, posix_spawn(), compat=%d", use_noshell_compat);
-				popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_POSIX_SPAWN);
-				popen_test(USE_NOSHELL_POPEN);
-				break;
-			case 9:
-				use_noshell_compat = 1;
-				if (!wrote) warnx("the new noshell, posix_spawn(), compat=%d", use_noshell_compat);
-				popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_POSIX_SPAWN);
-				popen_test(USE_NOSHELL_POPEN);
-				break;
-			case 10:
-				use_noshell_compat = 1;
-				if (!wrote) warnx("posix_spawn() + exec() no pipes, standard Libc");
-				posix_spawn_test();
+				cfg->vmas = safe_atoi(optarg);
 				break;
 			default:
-				errx(EXIT_FAILURE, "Bad mode");
-				break;
+				usage(argv[0]);
 		}
-		wrote = 1;
+	}
+	if (optind < argc || cfg->count < 1 || cfg->profiles_n < 1) {
+		usage(argv[0]);
+	}
+
+	if (cfg->modes_n == 0) {
+		for (i = 0; i < MODES; ++i) {
+			cfg->modes[i] = i;
+		}
+		cfg->modes_n = MODES;
+	}
+	for (i = 0; i < cfg->modes_n; ++i) {
+		if (cfg->modes[i] >= MODES) {
+			errx(EXIT_FAILURE, "Bad mode %d", cfg->modes[i]);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	struct config cfg;
+	struct result *results;
+	struct parent_memory pm;
+	int64_t *lat;
+	long rss_mb, thp_mb;
+	int p, m, r, i, fd, vmas, n = 0;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.count = 10000;
+	cfg.warmup = 100;
+	cfg.memsizes[0] = 20;
+	cfg.memsizes_n = 1;
+	cfg.ratios[0] = 2; /* the memory usage is 1 divided by the "ratio", use 0 for "no usage" at all */
+	cfg.ratios_n = 1;
+	cfg.profiles[0] = 0;
+	cfg.profiles_n = 1;
+	cfg.vmas = 50000; /* a bit less than the default /proc/sys/vm/max_map_count */
+
+	parse_argv(argc, argv, &cfg);
+
+	results = (struct result *)calloc(cfg.profiles_n * cfg.memsizes_n * cfg.ratios_n * cfg.modes_n, sizeof(struct result));
+	lat = (int64_t *)malloc(cfg.count * sizeof(int64_t));
+	if (!results || !lat) {
+		err(EXIT_FAILURE, "malloc()");
+	}
+
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	fd = open("/dev/null", O_WRONLY);
+	if (!report || fd < 0 || dup2(fd, STDOUT_FILENO) == -1 || close(fd) != 0) {
+		err(EXIT_FAILURE, "redirect STDOUT to /dev/null");
+	}
+
+	fprintf(report, "%-8s %7s %5s %4s %10s %8s %8s %9s %9s %9s %9s %7s %7s %7s %7s %7s %7s  %s\n", "profile", "memsize", "ratio", "mode",
+		"spawns/s", "user_s", "sys_s", "p50_us", "p99_us", "p99.9_us", "max_us",
+		"p_flt", "c_flt", "p_sysus", "c_sysus", "p_calls", "c_calls", "caption");
+	fprintf(report, "(the last six columns are per spawn: minor faults, kernel microseconds and system calls of the parent and of the child)\n");
+	for (p = 0; p < cfg.profiles_n; ++p) {
+		for (m = 0; m < cfg.memsizes_n; ++m) {
+			for (r = 0; r < cfg.ratios_n; ++r) {
+				if (!shape_memory(&pm, cfg.profiles[p], cfg.memsizes[m], cfg.ratios[r], cfg.vmas)) {
+					warnx("Skipping the \"%s\" profile", profile_names[cfg.profiles[p]]);
+					release_memory(&pm);
+					continue;
+				}
+				describe_memory(&rss_mb, &thp_mb, &vmas);
+				warnx("Test options: count=%d, profile=%s, memsize=%d, ratio=%d (rss=%ld MB, thp=%ld MB, vmas=%d)", cfg.count,
+					profile_names[cfg.profiles[p]], cfg.memsizes[m], cfg.ratios[r], rss_mb, thp_mb, vmas);
+				for (i = 0; i < cfg.modes_n; ++i) {
+					results[n].profile = profile_names[cfg.profiles[p]];
+					results[n].memsize = cfg.memsizes[m];
+					results[n].ratio = cfg.ratios[r];
+					results[n].mode = cfg.modes[i];
+					results[n].count = cfg.count;
+					measure(&results[n], lat, cfg.warmup);
+					print_result(&results[n]);
+					++n;
+				}
+				release_memory(&pm);
+			}
+		}
+	}
+
+	if (cfg.json_path) {
+		write_json(cfg.json_path, results, n, cfg.count);
 	}
 
+	free(lat);
+	free(results);
+	fclose(report);
 	return 0;
 }
@@ -0,0 +1 @@
+../popen_noshell_trampoline.c
\ No newline at end of file
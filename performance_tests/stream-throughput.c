@@ -0,0 +1,392 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+// _GNU_SOURCE must be defined as early as possible, for splice() and vmsplice()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include "popen_noshell.h"
+#include "bench_args.h"
+
+/*
+ * This is a performance test program.
+ * The other tests spawn a child which prints one line, so they measure only the cost of the spawn. Here the child
+ * streams a lot of data to its STDOUT ("r" mode), or consumes a lot of data from its STDIN ("w" mode), in order to
+ * measure the I/O path through the pipe of popen_noshell().
+ *
+ * The ways to read the output of the child are compared:
+ *	fgets: line by line from the FILE of popen_noshell(), whose buffer has the "buffer" size
+ *	fread: the same FILE, in chunks of the "buffer" size
+ *	read: popen_noshell_read() into a buffer of the "buffer" size, bypassing the FILE
+ *	splice: splice() from the pipe to /dev/null, so that the data is never copied to user space
+ *	records: line by line through popen_noshell_reader_next(), with a reader buffer of the "buffer" size, and the SIMD search
+ *	records-scalar: the same, with the byte by byte search
+ * ...and the ways to feed the child with data:
+ *	fwrite: to the FILE of popen_noshell(), whose buffer has the "buffer" size
+ *	write: popen_noshell_write() of "buffer" bytes at a time, bypassing the FILE
+ *	vmsplice: vmsplice() of the "buffer" into the pipe, so that the pages are not copied into the pipe buffer
+ * Each method runs with every pipe size, set by "popen_noshell_options.pipe_size", and every buffer size.
+ *
+ * The child is this same program, started with a hidden "--child" option, so that its side costs the same for
+ * all methods. The CPU time is reported per MB, separately for the parent and for the child.
+ *
+ * Compile and run via:
+ *	gcc -Wall -O2 stream-throughput.c popen_noshell.c -o stream-throughput && ./stream-throughput --size=1024
+ *	./stream-throughput --size=4096 --pipe-size=65536,1048576 --buffer=4096,65536,1048576 --method=read,splice
+ */
+
+#define METHODS 9
+#define MAX_LIST 16
+#define LINE_LEN 64 /* the length of the lines which the child writes, including the newline */
+
+const char *method_names[METHODS] = {"fgets", "fread", "read", "splice", "fwrite", "write", "vmsplice", "records", "records-scalar"};
+const char *method_types[METHODS] = {"r", "r", "r", "r", "w", "w", "w", "r", "r"};
+
+struct config {
+	long long size_mb;
+	int pipe_sizes[MAX_LIST];
+	int pipe_sizes_n;
+	int buffers[MAX_LIST];
+	int buffers_n;
+	int methods[METHODS];
+	int methods_n;
+};
+
+int dev_null_fd;
+
+double now_sec() {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		err(EXIT_FAILURE, "clock_gettime()");
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_sec(int who) {
+	struct rusage ru;
+
+	if (getrusage(who, &ru) != 0) {
+		err(EXIT_FAILURE, "getrusage()");
+	}
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+char *alloc_buffer(size_t size) { // free() the result; filled with lines of LINE_LEN bytes
+	char *buf;
+	size_t i;
+
+	if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), size) != 0) {
+		errx(EXIT_FAILURE, "posix_memalign()");
+	}
+	for (i = 0; i < size; ++i) {
+		buf[i] = ((i + 1) % LINE_LEN == 0 ? '\n' : 'a' + i % 26);
+	}
+	return buf;
+}
+
+// the child side: "write" streams "bytes" to STDOUT, "read" consumes STDIN until EOF
+int run_child(const char *what, long long bytes, int bufsize) {
+	char *buf = alloc_buffer(bufsize);
+	ssize_t ret;
+	long long done = 0;
+
+	if (strcmp(what, "write") == 0) {
+		while (done < bytes) {
+			ret = write(STDOUT_FILENO, buf, (bytes - done < bufsize ? bytes - done : bufsize));
+			if (ret < 0) {
+				if (errno == EINTR) continue;
+				err(EXIT_FAILURE, "child: write()");
+			}
+			done += ret;
+		}
+	} else {
+		while ((ret = read(STDIN_FILENO, buf, bufsize)) != 0) {
+			if (ret < 0) {
+				if (errno == EINTR) continue;
+				err(EXIT_FAILURE, "child: read()");
+			}
+			done += ret;
+		}
+		if (done != bytes) {
+			errx(EXIT_FAILURE, "child: Got %lld bytes instead of %lld", done, bytes);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+// the parent side; returns the number of bytes which went through the pipe
+long long transfer(int method, struct popen_noshell_pass_to_pclose *pclose_arg, long long bytes, char *buf, int bufsize) {
+	FILE *fp = pclose_arg->fp;
+	int fd = fileno(fp);
+	struct popen_noshell_reader reader;
+	const char *record;
+	struct iovec iov;
+	long long done = 0;
+	ssize_t ret;
+	size_t chunk, len;
+
+	switch (method) {
+		case 0: // fgets
+			while (fgets(buf, bufsize, fp)) {
+				done += strlen(buf);
+			}
+			if (ferror(fp)) err(EXIT_FAILURE, "fgets()");
+			break;
+		case 1: // fread
+			while ((chunk = fread(buf, 1, bufsize, fp)) > 0) {
+				done += chunk;
+			}
+			if (ferror(fp)) err(EXIT_FAILURE, "fread()");
+			break;
+		case 2: // read
+			while ((ret = popen_noshell_read(pclose_arg, buf, bufsize)) != 0) {
+				if (ret < 0) err(EXIT_FAILURE, "popen_noshell_read()");
+				done += ret;
+			}
+			break;
+		case 3: // splice
+			while ((ret = splice(fd, NULL, dev_null_fd, NULL, bufsize, SPLICE_F_MOVE)) != 0) {
+				if (ret < 0) {
+					if (errno == EINTR) continue;
+					err(EXIT_FAILURE, "splice()");
+				}
+				done += ret;
+			}
+			break;
+		case 4: // fwrite
+			while (done < bytes) {
+				chunk = (bytes - done < bufsize ? bytes - done : bufsize);
+				if (fwrite(buf, 1, chunk, fp) != chunk) err(EXIT_FAILURE, "fwrite()");
+				done += chunk;
+			}
+			break;
+		case 5: // write
+			while (done < bytes) {
+				ret = popen_noshell_write(pclose_arg, buf, (bytes - done < bufsize ? bytes - done : bufsize));
+				if (ret < 0) err(EXIT_FAILURE, "popen_noshell_write()");
+				done += ret;
+			}
+			break;
+		case 6: // vmsplice
+			while (done < bytes) {
+				// the buffer never changes, so it is safe to give its pages to the pipe again and again
+				iov.iov_base = buf;
+				iov.iov_len = (bytes - done < bufsize ? bytes - done : bufsize);
+				ret = vmsplice(fd, &iov, 1, 0);
+				if (ret < 0) {
+					if (errno == EINTR) continue;
+					err(EXIT_FAILURE, "vmsplice()");
+				}
+				done += ret;
+			}
+			break;
+		case 7: // records
+		case 8: // records-scalar
+			if (popen_noshell_reader_init(&reader, pclose_arg, bufsize, '\n') != 0) {
+				err(EXIT_FAILURE, "popen_noshell_reader_init()");
+			}
+			if (method == 8) reader.simd = POPEN_NOSHELL_SIMD_SCALAR;
+			while ((ret = popen_noshell_reader_next(&reader, &record, &len)) != 0) {
+				if (ret < 0) err(EXIT_FAILURE, "popen_noshell_reader_next()");
+				done += len + 1;
+			}
+			popen_noshell_reader_destroy(&reader);
+			break;
+	}
+
+	return done;
+}
+
+// returns 0 if the pipe size is not allowed; the reason is printed
+int run_method(int method, long long bytes, int pipe_size, int bufsize) {
+	struct popen_noshell_pass_to_pclose pclose_arg;
+	struct popen_noshell_options opts;
+	char bytes_str[32], bufsize_str[32];
+	const char *argv[] = {"stream-throughput", "--child", NULL, bytes_str, bufsize_str, NULL};
+	double start, wall, parent_cpu, child_cpu;
+	long long done;
+	char *buf;
+	int status;
+
+	argv[2] = (strcmp(method_types[method], "r") == 0 ? "write" : "read");
+	snprintf(bytes_str, sizeof(bytes_str), "%lld", bytes);
+	snprintf(bufsize_str, sizeof(bufsize_str), "%d", 1024 * 1024); // the child must not be the bottleneck
+	buf = alloc_buffer(bufsize);
+
+	popen_noshell_options_init(&opts);
+	opts.pipe_size = pipe_size;
+
+	start = now_sec();
+	parent_cpu = cpu_sec(RUSAGE_SELF);
+	child_cpu = cpu_sec(RUSAGE_CHILDREN);
+
+	pclose_arg.fp = popen_noshell_ex("/proc/self/exe", argv, method_types[method], &pclose_arg, &opts);
+	if (!pclose_arg.fp) {
+		if (errno == EPERM) { // F_SETPIPE_SZ above /proc/sys/fs/pipe-max-size
+			warn("Pipe size %d", pipe_size);
+			free(buf);
+			return 0;
+		}
+		err(EXIT_FAILURE, "popen_noshell_ex()");
+	}
+	if (method == 0 || method == 1 || method == 4) {
+		if (setvbuf(pclose_arg.fp, NULL, _IOFBF, bufsize) != 0) {
+			errx(EXIT_FAILURE, "setvbuf()");
+		}
+	}
+
+	done = transfer(method, &pclose_arg, bytes, buf, bufsize);
+	status = pclose_noshell(&pclose_arg);
+
+	wall = now_sec() - start;
+	parent_cpu = cpu_sec(RUSAGE_SELF) - parent_cpu;
+	child_cpu = cpu_sec(RUSAGE_CHILDREN) - child_cpu;
+
+	if (status != 0) {
+		errx(EXIT_FAILURE, "%s: The child failed with status %d", method_names[method], status);
+	}
+	if (done != bytes) {
+		errx(EXIT_FAILURE, "%s: %lld bytes were transferred instead of %lld", method_names[method], done, bytes);
+	}
+
+	printf("%-14s %9d %9d %10.1f %12.3f %12.3f\n", method_names[method], pipe_size, bufsize,
+		bytes / 1048576.0 / wall, parent_cpu * 1000 / (bytes / 1048576.0), child_cpu * 1000 / (bytes / 1048576.0));
+	fflush(stdout);
+
+	free(buf);
+	return 1;
+}
+
+// parses "N[,N..]" into "list"; returns the number of values
+
+void usage(const char *prog) {
+	warnx("Usage: %s [options]", prog);
+	warnx("\t--size=MB              data streamed through the pipe by each test (default 1024)");
+	warnx("\t--pipe-size=N[,N..]    bytes, F_SETPIPE_SZ of the pipe; 0=system default (default 0,1048576)");
+	warnx("\t--buffer=N[,N..]       bytes, the buffer of the parent (default 4096,65536,1048576)");
+	warnx("\t--method=NAME[,NAME..] fgets, fread, read, splice, fwrite, write, vmsplice, records, records-scalar");
+	warnx("\t                       (default all)");
+	exit(EXIT_FAILURE);
+}
+
+void parse_argv(int argc, char **argv, struct config *cfg) {
+	const struct option long_options[] = {
+		{"size", 1, 0, 1},
+		{"pipe-size", 1, 0, 2},
+		{"buffer", 1, 0, 3},
+		{"method", 1, 0, 4},
+		{0, 0, 0, 0}
+	};
+	char *tok, *saveptr;
+	int c, i;
+
+	while ((c = getopt_long(argc, argv, "", &long_options[0], NULL)) != -1) {
+		switch (c) {
+			case 1:
+				cfg->size_mb = safe_atoi(optarg);
+				break;
+			case 2:
+				cfg->pipe_sizes_n = parse_list(optarg, cfg->pipe_sizes, MAX_LIST);
+				break;
+			case 3:
+				cfg->buffers_n = parse_list(optarg, cfg->buffers, MAX_LIST);
+				break;
+			case 4:
+				cfg->methods_n = 0;
+				for (tok = strtok_r(optarg, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+					for (i = 0; i < METHODS && strcmp(tok, method_names[i]) != 0; ++i);
+					if (i == METHODS || cfg->methods_n == METHODS) {
+						errx(EXIT_FAILURE, "Bad method '%s'", tok);
+					}
+					cfg->methods[cfg->methods_n++] = i;
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind < argc || cfg->size_mb < 1 || cfg->pipe_sizes_n < 1 || cfg->buffers_n < 1 || cfg->methods_n < 1) {
+		usage(argv[0]);
+	}
+	for (i = 0; i < cfg->buffers_n; ++i) {
+		if (cfg->buffers[i] < LINE_LEN + 1) { // fgets() needs room for a whole line and the NUL
+			errx(EXIT_FAILURE, "The buffer must be at least %d bytes", LINE_LEN + 1);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	struct config cfg;
+	int m, p, b;
+
+	if (argc == 5 && strcmp(argv[1], "--child") == 0) {
+		return run_child(argv[2], atoll(argv[3]), atoi(argv[4]));
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.size_mb = 1024;
+	cfg.pipe_sizes[0] = 0;
+	cfg.pipe_sizes[1] = 1048576;
+	cfg.pipe_sizes_n = 2;
+	cfg.buffers[0] = 4096;
+	cfg.buffers[1] = 65536;
+	cfg.buffers[2] = 1048576;
+	cfg.buffers_n = 3;
+	for (m = 0; m < METHODS; ++m) {
+		cfg.methods[m] = m;
+	}
+	cfg.methods_n = METHODS;
+
+	parse_argv(argc, argv, &cfg);
+
+	dev_null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (dev_null_fd < 0) {
+		err(EXIT_FAILURE, "open(/dev/null)");
+	}
+
+	warnx("Test options: size=%lld MB, line length=%d", cfg.size_mb, LINE_LEN);
+	printf("%-14s %9s %9s %10s %12s %12s\n", "method", "pipe_size", "buffer", "MB/s", "parent_ms/MB", "child_ms/MB");
+	for (m = 0; m < cfg.methods_n; ++m) {
+		for (p = 0; p < cfg.pipe_sizes_n; ++p) {
+			for (b = 0; b < cfg.buffers_n; ++b) {
+				if (!run_method(cfg.methods[m], cfg.size_mb * 1024 * 1024, cfg.pipe_sizes[p], cfg.buffers[b])) {
+					break; // the other buffers would fail the same way
+				}
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,365 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "popen_noshell.h"
+#include "bench_args.h"
+
+/*
+ * This is a performance test program.
+ * Several threads invoke "./tiny2" concurrently, in order to see how the spawn rate scales with the thread count
+ * and with the memory of the parent. All spawn methods contend on the memory map of the parent, fork() the most.
+ *
+ * The spawn methods are:
+ *	clone: popen_noshell_ex() in POPEN_NOSHELL_MODE_CLONE, which malloc()'s a stack and copies argv for each spawn
+ *	ctx: the same through a per-thread spawn context, which reuses all of these
+ *	fork: popen_noshell_ex() in POPEN_NOSHELL_MODE_FORK
+ *	posix_spawn: popen_noshell_ex() in POPEN_NOSHELL_MODE_POSIX_SPAWN
+ *	vfork_thread: the prototype in "threads/", a helper thread calls vfork() so that only it gets suspended
+ *
+ * For each memory size, thread count and method, the total spawns per second of all threads, the latency
+ * percentiles of a single spawn, and the RSS of the parent are reported.
+ *
+ * Compile and run via:
+ *	gcc -Wall -O2 -pthread thread-scaling.c popen_noshell.c -o thread-scaling
+ *	./thread-scaling --count=2000 --max-threads=64 --memsize=0,200,1000
+ */
+
+#define VARIANT_CLONE 0
+#define VARIANT_CTX 1
+#define VARIANT_FORK 2
+#define VARIANT_POSIX_SPAWN 3
+#define VARIANT_VFORK_THREAD 4
+#define VARIANTS 5
+
+const char *variant_names[VARIANTS] = {"clone", "ctx", "fork", "posix_spawn", "vfork_thread"};
+
+struct thread_arg {
+	pthread_t thread;
+	int count;
+	int variant;
+	int64_t *lat; /* the latency of each spawn, in ns */
+};
+
+pthread_barrier_t start_barrier;
+
+int64_t now_ns() {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		err(EXIT_FAILURE, "clock_gettime()");
+	}
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void spawn_tiny2(struct popen_noshell_options *opts) {
+	const char *argv[] = {"./tiny2", NULL};
+	struct popen_noshell_pass_to_pclose pclose_arg;
+	char buf[64];
+	FILE *fp;
+
+	fp = popen_noshell_ex(argv[0], argv, "r", &pclose_arg, opts);
+	if (!fp) {
+		err(EXIT_FAILURE, "popen_noshell_ex()");
+	}
+	while (fgets(buf, sizeof(buf)-1, fp)) {
+		if (strcmp(buf, "Hello, world!\n") != 0) {
+			errx(EXIT_FAILURE, "bad response: %s", buf);
+		}
+	}
+	if (pclose_noshell(&pclose_arg) != 0) {
+		errx(EXIT_FAILURE, "pclose_noshell(): status code is non-zero");
+	}
+}
+
+/* the prototype from "threads/simple-test.c", but the child is reaped by waitpid() instead of SIGCHLD=SIG_IGN */
+void *vfork_thread(void *arg) {
+	pid_t *pid = (pid_t *)arg;
+	char *const eargs[] = {(char *)"./tiny2", NULL};
+	char *const eenv[] = {NULL};
+
+	*pid = vfork();
+	if (*pid == 0) { // child process; only the helper thread is suspended now
+		execve(eargs[0], eargs, eenv);
+		_exit(255);
+	}
+	return NULL;
+}
+
+void spawn_tiny2_vfork_thread() {
+	pthread_t thread;
+	pid_t pid = -1;
+	int thr_errno, status;
+
+	thr_errno = pthread_create(&thread, NULL, vfork_thread, &pid);
+	if (thr_errno != 0) {
+		errx(EXIT_FAILURE, "pthread_create(): %s", strerror(thr_errno));
+	}
+	thr_errno = pthread_join(thread, NULL);
+	if (thr_errno != 0) {
+		errx(EXIT_FAILURE, "pthread_join(): %s", strerror(thr_errno));
+	}
+	if (pid == -1) {
+		errx(EXIT_FAILURE, "vfork() failed");
+	}
+	if (waitpid(pid, &status, 0) != pid) {
+		err(EXIT_FAILURE, "waitpid()");
+	}
+	if (status != 0) {
+		errx(EXIT_FAILURE, "./tiny2: status code is non-zero");
+	}
+}
+
+void *spawn_thread(void *raw_arg) {
+	struct thread_arg *arg = (struct thread_arg *)raw_arg;
+	struct popen_noshell_options opts;
+	struct popen_noshell_ctx ctx;
+	int64_t t;
+	int i;
+
+	popen_noshell_options_init(&opts);
+	switch (arg->variant) {
+		case VARIANT_CLONE:
+			opts.mode = POPEN_NOSHELL_MODE_CLONE;
+			break;
+		case VARIANT_CTX:
+			opts.mode = POPEN_NOSHELL_MODE_CLONE;
+			if (popen_noshell_ctx_init(&ctx) != 0) {
+				err(EXIT_FAILURE, "popen_noshell_ctx_init()");
+			}
+			opts.ctx = &ctx;
+			break;
+		case VARIANT_FORK:
+			opts.mode = POPEN_NOSHELL_MODE_FORK;
+			break;
+		case VARIANT_POSIX_SPAWN:
+			opts.mode = POPEN_NOSHELL_MODE_POSIX_SPAWN;
+			break;
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < arg->count; ++i) {
+		t = now_ns();
+		if (arg->variant == VARIANT_VFORK_THREAD) {
+			spawn_tiny2_vfork_thread();
+		} else {
+			spawn_tiny2(&opts);
+		}
+		arg->lat[i] = now_ns() - t;
+	}
+
+	if (arg->variant == VARIANT_CTX) {
+		popen_noshell_ctx_destroy(&ctx);
+	}
+	return NULL;
+}
+
+int cmp_int64(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+// the nearest-rank percentile of the sorted "lat"
+double percentile_us(const int64_t *lat, int count, double p) {
+	int i = (int)(p / 100 * count + 0.999999) - 1;
+
+	if (i < 0) i = 0;
+	if (i >= count) i = count - 1;
+	return lat[i] / 1e3;
+}
+
+long rss_kb() {
+	long pages_total, pages_rss;
+	FILE *fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp || fscanf(fp, "%ld %ld", &pages_total, &pages_rss) != 2) {
+		err(EXIT_FAILURE, "/proc/self/statm");
+	}
+	fclose(fp);
+	return pages_rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void run_threads(FILE *report, int memsize, int threads, int count, int variant) {
+	struct thread_arg *args;
+	int64_t *lat, start, elapsed;
+	int i, thr_errno;
+
+	args = (struct thread_arg *)calloc(threads, sizeof(struct thread_arg));
+	lat = (int64_t *)malloc((size_t)threads * count * sizeof(int64_t));
+	if (!args || !lat) {
+		err(EXIT_FAILURE, "malloc()");
+	}
+	if (pthread_barrier_init(&start_barrier, NULL, threads + 1) != 0) {
+		errx(EXIT_FAILURE, "pthread_barrier_init()");
+	}
+
+	for (i = 0; i < threads; ++i) {
+		args[i].count = count;
+		args[i].variant = variant;
+		args[i].lat = lat + (size_t)i * count;
+		thr_errno = pthread_create(&args[i].thread, NULL, spawn_thread, &args[i]);
+		if (thr_errno != 0) {
+			errx(EXIT_FAILURE, "pthread_create(): %s", strerror(thr_errno));
+		}
+	}
+	pthread_barrier_wait(&start_barrier); // all threads are created, so their creation is not measured
+	start = now_ns();
+	for (i = 0; i < threads; ++i) {
+		thr_errno = pthread_join(args[i].thread, NULL);
+		if (thr_errno != 0) {
+			errx(EXIT_FAILURE, "pthread_join(): %s", strerror(thr_errno));
+		}
+	}
+	elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	qsort(lat, (size_t)threads * count, sizeof(int64_t), cmp_int64);
+	fprintf(report, "%7d %8ld %7d %-12s %10.0f %9.1f %9.1f %9.1f\n", memsize, rss_kb() / 1024, threads, variant_names[variant],
+		(double)threads * count * 1e9 / elapsed,
+		percentile_us(lat, threads * count, 50), percentile_us(lat, threads * count, 99),
+		percentile_us(lat, threads * count, 99.9));
+	fflush(report);
+
+	free(lat);
+	free(args);
+}
+
+// all of it is touched, so that it is in the RSS of the parent; free() the result
+char *allocate_memory(int size_in_mb) {
+	size_t size = (size_t)size_in_mb * 1024 * 1024;
+	char *m;
+
+	if (!size) return NULL;
+	m = (char *)malloc(size);
+	if (!m) {
+		err(EXIT_FAILURE, "malloc()");
+	}
+	memset(m, 'z', size);
+	return m;
+}
+
+// parses a comma-separated list of numbers into "list"; returns how many there were
+
+#define MAX_SWEEP 16
+
+struct config {
+	int count;
+	int max_threads;
+	int memsizes[MAX_SWEEP];
+	int memsizes_n;
+	int variants[VARIANTS];
+	int variants_n;
+};
+
+void parse_argv(int argc, char **argv, struct config *cfg) {
+	const struct option long_options[] = {
+		{"count", 1, 0, 1},
+		{"max-threads", 1, 0, 2},
+		{"memsize", 1, 0, 3},
+		{"variant", 1, 0, 4},
+		{0, 0, 0, 0}
+	};
+	int c, i;
+
+	while ((c = getopt_long(argc, argv, "", &long_options[0], NULL)) != -1) {
+		switch (c) {
+			case 1:
+				cfg->count = safe_atoi(optarg);
+				break;
+			case 2:
+				cfg->max_threads = safe_atoi(optarg);
+				break;
+			case 3:
+				cfg->memsizes_n = parse_list(optarg, cfg->memsizes, MAX_SWEEP);
+				break;
+			case 4:
+				cfg->variants_n = parse_list(optarg, cfg->variants, VARIANTS);
+				break;
+			default:
+				warnx("Usage: %s [--count=spawns_per_thread] [--max-threads=N] [--memsize=MB[,MB..]] [--variant=N[,N..]]", argv[0]);
+				warnx("The variants are 0=clone, 1=ctx, 2=fork, 3=posix_spawn, 4=vfork_thread; all by default");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (cfg->count < 1 || cfg->max_threads < 1) {
+		errx(EXIT_FAILURE, "--count and --max-threads must be positive");
+	}
+	if (cfg->variants_n == 0) {
+		for (i = 0; i < VARIANTS; ++i) {
+			cfg->variants[i] = i;
+		}
+		cfg->variants_n = VARIANTS;
+	}
+	for (i = 0; i < cfg->variants_n; ++i) {
+		if (cfg->variants[i] >= VARIANTS) {
+			errx(EXIT_FAILURE, "Bad variant %d", cfg->variants[i]);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	struct config cfg;
+	FILE *report;
+	char *mem;
+	int m, v, threads, fd;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.count = 2000;
+	cfg.max_threads = 64;
+	cfg.memsizes[0] = 0;
+	cfg.memsizes_n = 1;
+
+	parse_argv(argc, argv, &cfg);
+
+	// vfork_thread does not read the output of "./tiny2"
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	fd = open("/dev/null", O_WRONLY);
+	if (!report || fd < 0 || dup2(fd, STDOUT_FILENO) == -1 || close(fd) != 0) {
+		err(EXIT_FAILURE, "redirect STDOUT to /dev/null");
+	}
+
+	warnx("Test options: count=%d per thread, max-threads=%d", cfg.count, cfg.max_threads);
+	fprintf(report, "%7s %8s %7s %-12s %10s %9s %9s %9s\n", "memsize", "rss_mb", "threads", "variant", "spawns/s",
+		"p50_us", "p99_us", "p99.9_us");
+	for (m = 0; m < cfg.memsizes_n; ++m) {
+		mem = allocate_memory(cfg.memsizes[m]);
+		for (threads = 1; threads <= cfg.max_threads; threads *= 2) {
+			for (v = 0; v < cfg.variants_n; ++v) {
+				run_threads(report, cfg.memsizes[m], threads, cfg.count, cfg.variants[v]);
+			}
+		}
+		free(mem);
+	}
+
+	fclose(report);
+	return 0;
+}
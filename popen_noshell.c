@@ -34,10 +34,37 @@
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 
 #include <spawn.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 extern char **environ;
 
+// USDT probes for perf, bpftrace and SystemTap; they cost a single NOP when nobody is attached
+#if defined(__has_include) && !defined(POPEN_NOSHELL_NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define POPEN_NOSHELL_HAVE_SDT
+#endif
+#endif
+
 /*
  * Wish-list:
  *	*) Code a faster system(): system_noshell(), system_noshell_compat()
@@ -45,6 +72,19 @@ extern char **environ;
 
 //#define POPEN_NOSHELL_DEBUG
 
+#ifdef POPEN_NOSHELL_HAVE_SDT
+#define _POPEN_NOSHELL_PROBE(name, pid, ptr) STAP_PROBE2(popen_noshell, name, pid, ptr)
+#else
+#define _POPEN_NOSHELL_PROBE(name, pid, ptr) do {} while (0)
+#endif
+
+// fires the USDT probe "name" and calls the hook of the tracer, if any, for "pclose_arg"
+#define _POPEN_NOSHELL_TRACE(name, phase, pclose_arg) \
+	do { \
+		_POPEN_NOSHELL_PROBE(name, (pclose_arg)->pid, (pclose_arg)); \
+		if ((pclose_arg)->tracer) _popen_noshell_trace((pclose_arg), (phase), _popen_noshell_now_ns()); \
+	} while (0)
+
 // because of C++, we can't call err() or errx() within the child, because they call exit(), and _exit() is what must be called; so we wrap
 #define _ERR(EVAL, FMT, ...) \
 	{ \
@@ -56,26 +96,241 @@ extern char **environ;
 		warnx(FMT, ##__VA_ARGS__); \
 		_exit(EVAL); \
 	}
+// the modes in which _popen_noshell_child_process() runs in the parent, and queues the work of the child for posix_spawn()
+#define _POPEN_NOSHELL_BY_POSIX_SPAWN(mode) ((mode) == POPEN_NOSHELL_MODE_POSIX_SPAWN || (mode) == POPEN_NOSHELL_MODE_TRAMPOLINE)
+
+// the modes in which the child shares our memory until its exec(); it must not touch stdio then, not even by warn():
+// a fflush() there would write out and drop the buffers of the parent
+#ifndef POPEN_NOSHELL_VALGRIND_DEBUG
+#define _POPEN_NOSHELL_SHARES_MEMORY(mode) ((mode) == POPEN_NOSHELL_MODE_CLONE || (mode) == POPEN_NOSHELL_MODE_VFORK)
+#else
+#define _POPEN_NOSHELL_SHARES_MEMORY(mode) ((mode) == POPEN_NOSHELL_MODE_VFORK) // clone() is fork() here; vfork() is one only under Valgrind
+#endif
+
+// warn() in the child, unless it shares our memory; then the parent warns for it, see _popen_noshell_warn_child_error()
+#define _CHILD_WARN(ARG, FMT, ...) \
+	{ \
+		if (!_POPEN_NOSHELL_SHARES_MEMORY((ARG)->mode)) warn(FMT, ##__VA_ARGS__); \
+	}
 
+// the same as _ERR() but the parent learns the POPEN_NOSHELL_CHILD_* "STAGE" and "errno" first; see _popen_noshell_child_report()
+// In POPEN_NOSHELL_MODE_POSIX_SPAWN and _TRAMPOLINE we are still the parent, so this jumps to the "spawn_fail" label of _popen_noshell_child_process().
+#define _CHILD_ERR(ARG_PTR, ARG, STAGE, FMT, ...) \
+	{ \
+		if (_POPEN_NOSHELL_BY_POSIX_SPAWN((ARG)->mode)) goto spawn_fail; \
+		_popen_noshell_child_report((ARG_PTR), (ARG), (STAGE), errno); \
+		_CHILD_WARN((ARG), FMT, ##__VA_ARGS__); \
+		_exit(255); \
+	}
+
+// only the default for popen_noshell() and popen_noshell_options_init(); the spawns never read it directly
 int _popen_noshell_fork_mode = POPEN_NOSHELL_MODE_CLONE;
 //int _popen_noshell_fork_mode = POPEN_NOSHELL_MODE_POSIX_SPAWN; // use with glibc 2.24+; see issue #11
+//int _popen_noshell_fork_mode = POPEN_NOSHELL_MODE_AUTO; // or let the library choose, see popen_noshell_auto_decision()
 
 void popen_noshell_set_fork_mode(int mode) { // see "popen_noshell.h" POPEN_NOSHELL_MODE_* constants
-	_popen_noshell_fork_mode = mode;
+	__atomic_store_n(&_popen_noshell_fork_mode, mode, __ATOMIC_RELAXED);
 }
 
 int popen_noshell_get_fork_mode() { // see "popen_noshell.h" POPEN_NOSHELL_MODE_* constants
-	return _popen_noshell_fork_mode;
+	return __atomic_load_n(&_popen_noshell_fork_mode, __ATOMIC_RELAXED);
+}
+
+const char *_popen_noshell_trampoline = POPEN_NOSHELL_TRAMPOLINE_PATH;
+
+/*
+ * POPEN_NOSHELL_MODE_TRAMPOLINE posix_spawn()'s the program "path" instead of the command, and it does what posix_spawn()
+ * cannot: "new_session", "cwd", "rlimits", "cpu_affinity", and "close_fds" with any glibc. Then it exec()'s the command.
+ * Build it from "popen_noshell_trampoline.c"; it is static, so its own exec() is about as cheap as an exec() can be.
+ *
+ * The "path" is not copied, so it must stay valid. It applies to the spawns which start after this call.
+ */
+void popen_noshell_set_trampoline(const char *path) {
+	__atomic_store_n(&_popen_noshell_trampoline, (path ? path : POPEN_NOSHELL_TRAMPOLINE_PATH), __ATOMIC_RELEASE);
+}
+
+const char *popen_noshell_get_trampoline() {
+	return __atomic_load_n(&_popen_noshell_trampoline, __ATOMIC_ACQUIRE);
+}
+
+int64_t _popen_noshell_now_ns() {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		err(EXIT_FAILURE, "clock_gettime(CLOCK_MONOTONIC)"); // never happens on Linux
+	}
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const struct popen_noshell_tracer *_popen_noshell_tracer = NULL;
+
+/*
+ * Reports the phases of each spawn to "tracer->hook", in order to find out which of them is slow.
+ * The same phases are also available as USDT probes in the "popen_noshell" provider, named like the POPEN_NOSHELL_PHASE_*
+ * constants in lower case: "start", "pipe", "stack", "child_start", "child_fds", "child_exec", "spawned", "return",
+ * "first_byte" and "exit". Their arguments are the PID of the child (0 until it is known) and the
+ * "struct popen_noshell_pass_to_pclose" pointer, which ties the phases of a spawn together. For example:
+ *	bpftrace -e 'usdt:./prog:popen_noshell:* { @[probe] = hist(nsecs - @t[arg1]); @t[arg1] = nsecs; }'
+ * The "child_*" probes fire in the child process, and in POPEN_NOSHELL_MODE_FORK too, unlike the hook.
+ *
+ * The tracer applies to the spawns which start after this call, and is used until their pclose_noshell().
+ * It must stay valid until then. Pass NULL to stop tracing; the cost is a single atomic load per spawn then.
+ */
+void popen_noshell_set_tracer(const struct popen_noshell_tracer *tracer) {
+	__atomic_store_n(&_popen_noshell_tracer, tracer, __ATOMIC_RELEASE);
+}
+
+void _popen_noshell_trace(const struct popen_noshell_pass_to_pclose *pclose_arg, int phase, int64_t ns) {
+	pclose_arg->tracer->hook(pclose_arg->tracer, phase, pclose_arg, ns);
+}
+
+struct popen_noshell_stats _popen_noshell_stats_local; // only the counters are used here, see popen_noshell_stats_snapshot()
+struct popen_noshell_stats *_popen_noshell_stats = &_popen_noshell_stats_local; // or the shared memory segment
+char *_popen_noshell_stats_path = NULL; // of the shared memory segment
+pthread_mutex_t _popen_noshell_stats_mutex = PTHREAD_MUTEX_INITIALIZER; // serializes publish and unpublish
+
+// adds "n" to the counter "field" of "mode"; the counters are shared by all threads, but they are never read back by us
+#define _POPEN_NOSHELL_STAT_ADD(mode, field, n) \
+	__atomic_fetch_add(&__atomic_load_n(&_popen_noshell_stats, __ATOMIC_RELAXED)->modes[mode].field, (n), __ATOMIC_RELAXED)
+
+/*
+ * Copies the library-wide counters of all spawns into "stats". Each counter is read atomically, but they are not
+ * a consistent snapshot all together: a spawn which runs meanwhile may be counted only partially.
+ *
+ * The counters of POPEN_NOSHELL_MODE_* are in stats->modes[POPEN_NOSHELL_MODE_*]. Unlike the counters of a spawn
+ * context, these are always on, and they cover every popen_noshell(), popen_noshell_compat() and popen_noshell_ex().
+ * The bytes are counted only by popen_noshell_read() and popen_noshell_write(), the FILE functions cannot be seen.
+ */
+void popen_noshell_stats_snapshot(struct popen_noshell_stats *stats) {
+	struct popen_noshell_stats *src = __atomic_load_n(&_popen_noshell_stats, __ATOMIC_ACQUIRE);
+	int mode, stage;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->magic = POPEN_NOSHELL_STATS_MAGIC;
+	stats->version = POPEN_NOSHELL_STATS_VERSION;
+	stats->pid = getpid();
+	for (mode = 0; mode < POPEN_NOSHELL_MODES; ++mode) {
+		stats->modes[mode].spawns = __atomic_load_n(&src->modes[mode].spawns, __ATOMIC_RELAXED);
+		for (stage = 0; stage < POPEN_NOSHELL_STAGES; ++stage) {
+			stats->modes[mode].failures[stage] = __atomic_load_n(&src->modes[mode].failures[stage], __ATOMIC_RELAXED);
+		}
+		stats->modes[mode].exec_failures = __atomic_load_n(&src->modes[mode].exec_failures, __ATOMIC_RELAXED);
+		stats->modes[mode].spawn_ns = __atomic_load_n(&src->modes[mode].spawn_ns, __ATOMIC_RELAXED);
+		stats->modes[mode].bytes_read = __atomic_load_n(&src->modes[mode].bytes_read, __ATOMIC_RELAXED);
+		stats->modes[mode].bytes_written = __atomic_load_n(&src->modes[mode].bytes_written, __ATOMIC_RELAXED);
+		stats->modes[mode].live_children = __atomic_load_n(&src->modes[mode].live_children, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Moves the library-wide counters into the shared memory segment "name", which is created in /dev/shm like
+ * shm_open() does. Other processes, like the included "popen_noshell_stat" tool, can then read the counters
+ * without attaching to this process. The segment is a "struct popen_noshell_stats" which is updated live.
+ *
+ * Call this early, before other threads spawn. Spawns which run during the move may lose some counts.
+ *
+ * Returns -1 on any error, "errno" is set appropriately.
+ */
+int popen_noshell_stats_publish(const char *name) {
+	struct popen_noshell_stats *shm;
+	char *path;
+	int fd, saved_errno;
+
+	if (!name || !*name || strchr(name, '/')) {
+		errno = EINVAL;
+		return -1;
+	}
+	path = (char *)malloc(strlen("/dev/shm/") + strlen(name) + 1);
+	if (!path) return -1;
+	strcpy(path, "/dev/shm/");
+	strcat(path, name);
+
+	pthread_mutex_lock(&_popen_noshell_stats_mutex);
+
+	// no shm_open(), because glibc before 2.34 needs -lrt for it
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd < 0) goto fail;
+	if (ftruncate(fd, sizeof(struct popen_noshell_stats)) != 0) goto fail_close;
+	shm = (struct popen_noshell_stats *)mmap(NULL, sizeof(struct popen_noshell_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) goto fail_close;
+	close(fd);
+
+	popen_noshell_stats_snapshot(shm);
+	__atomic_store_n(&_popen_noshell_stats, shm, __ATOMIC_RELEASE);
+	if (_popen_noshell_stats_path) { // published before under another name; the old mapping stays, see below
+		unlink(_popen_noshell_stats_path);
+		free(_popen_noshell_stats_path);
+	}
+	_popen_noshell_stats_path = path;
+
+	pthread_mutex_unlock(&_popen_noshell_stats_mutex);
+	return 0;
+
+fail_close:
+	saved_errno = errno;
+	close(fd);
+	unlink(path);
+	errno = saved_errno;
+fail:
+	saved_errno = errno;
+	pthread_mutex_unlock(&_popen_noshell_stats_mutex);
+	free(path);
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * Moves the counters back into private memory and removes the shared memory segment.
+ * The segment is not unmapped, because another thread may still be updating a counter there.
+ */
+int popen_noshell_stats_unpublish() {
+	int ret = 0;
+
+	pthread_mutex_lock(&_popen_noshell_stats_mutex);
+	if (_popen_noshell_stats_path) {
+		popen_noshell_stats_snapshot(&_popen_noshell_stats_local);
+		__atomic_store_n(&_popen_noshell_stats, &_popen_noshell_stats_local, __ATOMIC_RELEASE);
+		ret = unlink(_popen_noshell_stats_path);
+		free(_popen_noshell_stats_path);
+		_popen_noshell_stats_path = NULL;
+	}
+	pthread_mutex_unlock(&_popen_noshell_stats_mutex);
+
+	return ret;
+}
+
+// called in the child; clock_gettime() is async-signal-safe
+void _popen_noshell_child_trace(const struct popen_noshell_clone_arg *arg, int phase) {
+	if (arg->trace_ns) {
+		arg->trace_ns[phase - POPEN_NOSHELL_PHASE_CHILD_START] = _popen_noshell_now_ns();
+	}
 }
 
-int popen_noshell_reopen_fd_to_dev_null(int fd, posix_spawn_file_actions_t *file_actions) {
+// the posix_spawn_file_actions_*() return the error number instead of setting "errno"; this makes them like the other calls
+int _popen_noshell_fa_result(int ret) {
+	if (ret == 0) return 0;
+	errno = ret;
+	return -1;
+}
+
+// "file_actions" is not NULL only in POPEN_NOSHELL_MODE_POSIX_SPAWN and _TRAMPOLINE; then the actions are queued instead of done
+// "shared_dev_null_fd" is an already opened /dev/null of a spawn context, or -1
+int popen_noshell_reopen_fd_to_dev_null(int fd, int shared_dev_null_fd, posix_spawn_file_actions_t *file_actions) {
 	int dev_null_fd;
 
-	if (_popen_noshell_fork_mode == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
-		if (posix_spawn_file_actions_addclose(file_actions, fd) != 0) {
+	if (file_actions) {
+		if (shared_dev_null_fd >= 0) {
+			return _popen_noshell_fa_result(posix_spawn_file_actions_adddup2(file_actions, shared_dev_null_fd, fd));
+		}
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_addclose(file_actions, fd)) != 0) {
+			return -1;
+		}
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_addopen(file_actions, fd, "/dev/null", O_RDWR, 0600)) < 0) {
 			return -1;
 		}
-		if (posix_spawn_file_actions_addopen(file_actions, fd, "/dev/null", O_RDWR, 0600) < 0) {
+	} else if (shared_dev_null_fd >= 0) {
+		// dup2() closes "fd" and clears FD_CLOEXEC on it; the shared fd stays open for the next spawns
+		if (dup2(shared_dev_null_fd, fd) == -1) {
 			return -1;
 		}
 	} else {
@@ -105,17 +360,17 @@ int _popen_noshell_close_and_dup(int pipefd[2], int closed_pipefd, int target_fd
 
 	dupped_pipefd = (closed_pipefd == 0 ? 1 : 0); // get the FD of the other end of the pipe
 
-	if (_popen_noshell_fork_mode == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
-		if (posix_spawn_file_actions_addclose(file_actions, pipefd[closed_pipefd]) != 0) {
+	if (file_actions) {
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_addclose(file_actions, pipefd[closed_pipefd])) != 0) {
 			return -1;
 		}
-		if (posix_spawn_file_actions_addclose(file_actions, target_fd) != 0) {
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_addclose(file_actions, target_fd)) != 0) {
 			return -1;
 		}
-		if (posix_spawn_file_actions_adddup2(file_actions, pipefd[dupped_pipefd], target_fd) < 0) {
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_adddup2(file_actions, pipefd[dupped_pipefd], target_fd)) < 0) {
 			return -1;
 		}
-		if (posix_spawn_file_actions_addclose(file_actions, pipefd[dupped_pipefd]) != 0) {
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_addclose(file_actions, pipefd[dupped_pipefd])) != 0) {
 			return -1;
 		}
 	} else {
@@ -138,19 +393,21 @@ int _popen_noshell_close_and_dup(int pipefd[2], int closed_pipefd, int target_fd
 }
 
 int _popen_noshell_dup2(int oldfd, int newfd, posix_spawn_file_actions_t *file_actions) {
-	if (_popen_noshell_fork_mode == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
-		return posix_spawn_file_actions_adddup2(file_actions, oldfd, newfd);
+	if (file_actions) {
+		return _popen_noshell_fa_result(posix_spawn_file_actions_adddup2(file_actions, oldfd, newfd));
 	} else {
 		return dup2(oldfd, newfd);
 	}
 }
 
+// "file" and "argv" may be NULL, if popen_noshell_ex() failed while copying them; "func_args" is NULL with "argv_stable"
 void _pclose_noshell_free_clone_arg_memory(struct popen_noshell_clone_arg *func_args) {
 	char **cmd_argv;
 
+	if (!func_args) return;
 	free((char *)func_args->file);
 	cmd_argv = (char **)func_args->argv;
-	while (*cmd_argv) {
+	while (cmd_argv && *cmd_argv) {
 		free(*cmd_argv);
 		++cmd_argv;
 	}
@@ -158,7 +415,304 @@ void _pclose_noshell_free_clone_arg_memory(struct popen_noshell_clone_arg *func_
 	free(func_args);
 }
 
-void _popen_noshell_child_process_cleanup_fail_and_exit(int exit_code, struct popen_noshell_clone_arg *arg_ptr) {
+/*
+ * Signals are blocked around the fork() / clone() and the child restores them just before exec(), like posix_spawn() does.
+ * With CLONE_VM the child shares the memory of the parent, so a signal handler of the parent which runs in the child
+ * could corrupt the state of the parent. The child also resets all caught signals to SIG_DFL before unblocking them.
+ *
+ * Querying and resetting 64 signals one by one takes as long as a quarter of a whole clone() + exec(), so in
+ * POPEN_NOSHELL_MODE_CLONE the kernel does it for us by clone3(CLONE_CLEAR_SIGHAND) when possible.
+ */
+void _popen_noshell_block_signals(sigset_t *old_mask) {
+	sigset_t all;
+
+	sigfillset(&all);
+	if (pthread_sigmask(SIG_BLOCK, &all, old_mask) != 0) {
+		err(EXIT_FAILURE, "pthread_sigmask(SIG_BLOCK)"); // never happens with valid arguments
+	}
+}
+
+void _popen_noshell_restore_signals(const sigset_t *old_mask) {
+	int saved_errno = errno; // keep the error of a failed spawn
+
+	if (pthread_sigmask(SIG_SETMASK, old_mask, NULL) != 0) {
+		err(EXIT_FAILURE, "pthread_sigmask(SIG_SETMASK)");
+	}
+	errno = saved_errno;
+}
+
+// called in the child; only async-signal-safe system calls here
+void _popen_noshell_child_reset_signals(const sigset_t *parent_mask, int handlers_cleared) {
+	struct sigaction sa;
+	int sig;
+
+	for (sig = 1; sig < _NSIG && !handlers_cleared; ++sig) {
+		if (sigaction(sig, NULL, &sa) != 0) continue; // SIGKILL, SIGSTOP and the ones reserved by libc
+		if (sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL) continue; // these survive exec() anyway
+		sa.sa_handler = SIG_DFL;
+		sa.sa_flags = 0;
+		sigemptyset(&sa.sa_mask);
+		sigaction(sig, &sa, NULL);
+	}
+	sigprocmask(SIG_SETMASK, parent_mask, NULL);
+}
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2) /* Linux 5.11+ */
+#endif
+
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 34)
+#define POPEN_NOSHELL_HAVE_ADDCLOSEFROM
+#endif
+#endif
+
+int _popen_noshell_is_kept_fd(int fd, const int *keep_fds, int keep_fds_count) {
+	int i;
+
+	for (i = 0; i < keep_fds_count; ++i) {
+		if (keep_fds[i] == fd) return 1;
+	}
+	return 0;
+}
+
+// the lowest of "keep_fds" which is >= "fd", or -1 if none
+int _popen_noshell_next_kept_fd(int fd, const int *keep_fds, int keep_fds_count) {
+	int i, next = -1;
+
+	for (i = 0; i < keep_fds_count; ++i) {
+		if (keep_fds[i] >= fd && (next == -1 || keep_fds[i] < next)) next = keep_fds[i];
+	}
+	return next;
+}
+
+// as in <linux/dirent.h>; glibc has no getdents64() wrapper before 2.30
+struct _popen_noshell_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// the fallback for kernels before 5.9: walk /proc/self/fd; without /proc, try every possible fd
+int _popen_noshell_cloexec_fds_slow(const int *keep_fds, int keep_fds_count) {
+	char buf[2048];
+	struct _popen_noshell_dirent64 *de;
+	long n, off;
+	int dir_fd, fd, max_fd;
+	char *p;
+
+	dir_fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		max_fd = sysconf(_SC_OPEN_MAX);
+		if (max_fd < 0) max_fd = 65536;
+		for (fd = STDERR_FILENO + 1; fd < max_fd; ++fd) {
+			if (!_popen_noshell_is_kept_fd(fd, keep_fds, keep_fds_count)) {
+				fcntl(fd, F_SETFD, FD_CLOEXEC); // fails with EBADF for most of them
+			}
+		}
+		return 0;
+	}
+
+	// no opendir() here, it calls malloc() which is not async-signal-safe
+	while ((n = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += de->d_reclen) {
+			de = (struct _popen_noshell_dirent64 *)(buf + off);
+			if (de->d_name[0] < '0' || de->d_name[0] > '9') continue; // "." and ".."
+			fd = 0;
+			for (p = de->d_name; *p; ++p) {
+				fd = fd * 10 + (*p - '0');
+			}
+			if (fd <= STDERR_FILENO || fd == dir_fd || _popen_noshell_is_kept_fd(fd, keep_fds, keep_fds_count)) continue;
+			if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+				close(dir_fd);
+				return -1;
+			}
+		}
+	}
+	close(dir_fd);
+
+	return (n < 0 ? -1 : 0);
+}
+
+/*
+ * Called in the child; only async-signal-safe system calls here.
+ *
+ * All fds above STDERR get FD_CLOEXEC, except the kept ones which lose it. Unless close_range() is too old for that,
+ * the fds are not closed right here but by exec() itself: in POPEN_NOSHELL_MODE_CLONE the parent resumes as soon as
+ * exec() replaced our memory, so it doesn't have to wait for the closing of thousands of fds.
+ */
+int _popen_noshell_child_close_fds(const int *keep_fds, int keep_fds_count) {
+	unsigned int flags = CLOSE_RANGE_CLOEXEC;
+	int fd, next, i;
+
+	for (i = 0; i < keep_fds_count; ++i) {
+		if (keep_fds[i] > STDERR_FILENO && fcntl(keep_fds[i], F_SETFD, 0) != 0) {
+			return -1;
+		}
+	}
+
+#ifdef SYS_close_range
+	fd = STDERR_FILENO + 1;
+	while (fd >= 0) {
+		next = _popen_noshell_next_kept_fd(fd, keep_fds, keep_fds_count);
+		if (next != fd) {
+			if (syscall(SYS_close_range, (unsigned int)fd, (next == -1 ? ~0U : (unsigned int)next - 1), flags) != 0) {
+				if (errno == EINVAL && flags) { // before Linux 5.11; close them right here
+					flags = 0;
+					continue;
+				}
+				if (errno == ENOSYS) break; // before Linux 5.9
+				return -1;
+			}
+		}
+		fd = (next == -1 ? -1 : next + 1);
+	}
+	if (fd == -1) return 0;
+#else
+	(void) flags;
+	(void) fd;
+	(void) next;
+#endif
+
+	return _popen_noshell_cloexec_fds_slow(keep_fds, keep_fds_count);
+}
+
+// queues the same as _popen_noshell_child_close_fds() for posix_spawn(); the kept fds lose FD_CLOEXEC by dup2() onto themselves
+int _popen_noshell_spawn_close_fds(posix_spawn_file_actions_t *file_actions, const int *keep_fds, int keep_fds_count) {
+#ifdef POPEN_NOSHELL_HAVE_ADDCLOSEFROM
+	int fd, max_fd;
+
+	max_fd = _popen_noshell_next_kept_fd(STDERR_FILENO + 1, keep_fds, keep_fds_count);
+	for (fd = max_fd; fd != -1; fd = _popen_noshell_next_kept_fd(fd + 1, keep_fds, keep_fds_count)) {
+		max_fd = fd;
+	}
+	for (fd = STDERR_FILENO + 1; fd <= max_fd; ++fd) {
+		if (_popen_noshell_is_kept_fd(fd, keep_fds, keep_fds_count)) {
+			if (_popen_noshell_fa_result(posix_spawn_file_actions_adddup2(file_actions, fd, fd)) != 0) return -1;
+		} else {
+			// glibc ignores the EBADF of fds which are not open
+			if (_popen_noshell_fa_result(posix_spawn_file_actions_addclose(file_actions, fd)) != 0) return -1;
+		}
+	}
+	return _popen_noshell_fa_result(posix_spawn_file_actions_addclosefrom_np(file_actions, (max_fd == -1 ? STDERR_FILENO + 1 : max_fd + 1)));
+#else
+	(void) file_actions;
+	(void) keep_fds;
+	(void) keep_fds_count;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+// called in the child; "cwd", "rlimits" and "cpu_affinity", only async-signal-safe system calls; sets "*stage" on errors
+int _popen_noshell_child_setup(const struct popen_noshell_clone_arg *arg, int *stage) {
+	int i;
+
+	if (arg->cwd && chdir(arg->cwd) != 0) {
+		*stage = POPEN_NOSHELL_CHILD_CWD;
+		return -1;
+	}
+	for (i = 0; i < arg->rlimits_count; ++i) {
+		if (setrlimit((__rlimit_resource_t)arg->rlimits[i].resource, &arg->rlimits[i].limit) != 0) {
+			*stage = POPEN_NOSHELL_CHILD_RLIMIT;
+			return -1;
+		}
+	}
+	if (arg->cpu_affinity && sched_setaffinity(0, arg->cpu_affinity_size, (const cpu_set_t *)arg->cpu_affinity) != 0) {
+		*stage = POPEN_NOSHELL_CHILD_AFFINITY;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The argv of the trampoline, in a single malloc()'ed block; see "popen_noshell_trampoline.c" for the format.
+ * Returns NULL on error, "errno" is set appropriately.
+ */
+char **_popen_noshell_trampoline_argv(const struct popen_noshell_clone_arg *arg) {
+	size_t slots, text_size, i;
+	char **argv, *text;
+	int argc, n;
+
+	for (argc = 0; arg->argv[argc]; ++argc);
+	slots = 3 + 1 + 2 + 2 * arg->rlimits_count + 2 + 1 + 2 * arg->keep_fds_count + 2 + argc + 1;
+	text_size = 16 + 64 * arg->rlimits_count + 2 * arg->cpu_affinity_size + 1 + 16 * arg->keep_fds_count;
+	argv = (char **)malloc(sizeof(char *) * slots + text_size);
+	if (!argv) return NULL;
+	text = (char *)(argv + slots);
+
+	n = 0;
+	argv[n++] = (char *)arg->trampoline;
+	argv[n++] = (char *)"-e"; // the error channel, see _popen_noshell_child_report()
+	argv[n++] = text;
+	text += sprintf(text, "%d", arg->errpipe_fd) + 1;
+	if (arg->new_session) {
+		argv[n++] = (char *)"-s";
+	}
+	if (arg->cwd) {
+		argv[n++] = (char *)"-d";
+		argv[n++] = (char *)arg->cwd;
+	}
+	for (i = 0; i < (size_t)arg->rlimits_count; ++i) {
+		argv[n++] = (char *)"-r";
+		argv[n++] = text;
+		text += sprintf(text, "%d:%llu:%llu", arg->rlimits[i].resource, (unsigned long long)arg->rlimits[i].limit.rlim_cur,
+			(unsigned long long)arg->rlimits[i].limit.rlim_max) + 1;
+	}
+	if (arg->cpu_affinity) {
+		argv[n++] = (char *)"-a";
+		argv[n++] = text;
+		for (i = 0; i < arg->cpu_affinity_size; ++i) {
+			text += sprintf(text, "%02x", ((const unsigned char *)arg->cpu_affinity)[i]);
+		}
+		++text;
+	}
+	if (arg->close_fds) {
+		argv[n++] = (char *)"-c";
+		for (i = 0; i < (size_t)arg->keep_fds_count; ++i) {
+			argv[n++] = (char *)"-k";
+			argv[n++] = text;
+			text += sprintf(text, "%d", arg->keep_fds[i]) + 1;
+		}
+	}
+	argv[n++] = (char *)"--";
+	argv[n++] = (char *)arg->file;
+	for (i = 0; i <= (size_t)argc; ++i) {
+		argv[n++] = (char *)arg->argv[i]; // with the NULL
+	}
+	return argv;
+}
+
+/*
+ * The error channel: a child which fails before its exec() completes tells the parent where and why, so that
+ * popen_noshell_ex() returns NULL with "errno" set right away, instead of a FILE which gives EOF and a child which exits with 255.
+ *
+ * A clone()'d or vfork()'d child shares our memory, and the parent sleeps until the child called exec() or exited (CLONE_VFORK),
+ * so the child simply stores the error in its "arg_ptr". A fork()'ed child writes it to "errpipe_fd", a pipe with O_CLOEXEC:
+ * the parent reads either the error, or EOF when a successful exec() closed the pipe.
+ *
+ * There is no channel if "close_fds" had to close the fds right away, on kernels before 5.11; an exec() failure is
+ * reported by the exit code 255 then, as before.
+ */
+void _popen_noshell_child_report(struct popen_noshell_clone_arg *arg_ptr, const struct popen_noshell_clone_arg *arg, int stage, int error) {
+	int msg[2] = {stage, error};
+	ssize_t ret;
+
+	if (arg->errpipe_fd >= 0) {
+		do {
+			ret = write(arg->errpipe_fd, msg, sizeof(msg)); // atomic, as this is less than PIPE_BUF
+		} while (ret < 0 && errno == EINTR);
+	} else if (arg_ptr) {
+		arg_ptr->child_stage = stage;
+		arg_ptr->child_errno = error;
+	}
+}
+
+void _popen_noshell_child_process_cleanup_fail_and_exit(int exit_code, struct popen_noshell_clone_arg *arg_ptr,
+	const struct popen_noshell_clone_arg *arg
+) {
 
 #ifdef POPEN_NOSHELL_VALGRIND_DEBUG
 	if (arg_ptr) { /* not NULL if we were called by clone() */
@@ -170,8 +724,10 @@ void _popen_noshell_child_process_cleanup_fail_and_exit(int exit_code, struct po
 	(void) arg_ptr;
 #endif
 
-	if (fflush(stdout) != 0) _ERR(255, "fflush(stdout)");
-	if (fflush(stderr) != 0) _ERR(255, "fflush(stderr)");
+	if (!_POPEN_NOSHELL_SHARES_MEMORY(arg->mode)) { // else these are the buffers of the parent
+		if (fflush(stdout) != 0) _ERR(255, "fflush(stdout)");
+		if (fflush(stderr) != 0) _ERR(255, "fflush(stderr)");
+	}
 	close(STDIN_FILENO);
 	close(STDOUT_FILENO);
 	close(STDERR_FILENO);
@@ -179,26 +735,65 @@ void _popen_noshell_child_process_cleanup_fail_and_exit(int exit_code, struct po
 	_exit(exit_code); // call _exit() and not exit(), or you'll have troubles in C++
 }
 
-// returns the new PID if called in POPEN_NOSHELL_MODE_POSIX_SPAWN
+// returns the new PID if called in POPEN_NOSHELL_MODE_POSIX_SPAWN or _TRAMPOLINE
 // otherwise returns 0
 pid_t _popen_noshell_child_process(
 	/* We need the pointer *arg_ptr only to free whatever we reference if exec() fails and we were fork()'ed (thus memory was copied),
 	 * not clone()'d */
 	struct popen_noshell_clone_arg *arg_ptr, /* NULL if we were called by pure fork() (not because of Valgrind) */
-	int pipefd_0, int pipefd_1, int read_pipe, int stderr_mode, const char *file, const char * const *argv)
+	const struct popen_noshell_clone_arg *arg) /* what to execute and how, in all modes */
 {
 
 	int closed_child_fd;
 	int closed_pipe_fd;
 	int dupped_child_fd;
-	int pipefd[2] = {pipefd_0, pipefd_1};
+	int pipefd[2] = {arg->pipefd_0, arg->pipefd_1};
+	int read_pipe = arg->read_pipe;
+	int stderr_mode = arg->stderr_mode;
+	const char *file = arg->file;
+	const char * const *argv = arg->argv;
+	char * const *envp = (arg->envp ? arg->envp : environ);
 	posix_spawn_file_actions_t file_actions_obj;
 	posix_spawn_file_actions_t *file_actions = NULL;
+	posix_spawnattr_t spawn_attr_obj;
+	posix_spawnattr_t *spawn_attr = NULL;
+	char **trampoline_argv = NULL;
+	pid_t child_pid;
+	int ret, i, stage;
+
+	if (arg->sigmask) { // first of all, before a signal handler of the parent gets the chance to run here
+		_popen_noshell_child_reset_signals(arg->sigmask, arg->sighand_cleared);
+	}
+	if (!_POPEN_NOSHELL_BY_POSIX_SPAWN(arg->mode)) { // else we are still the parent
+		_POPEN_NOSHELL_PROBE(child_start, 0, arg);
+		_popen_noshell_child_trace(arg, POPEN_NOSHELL_PHASE_CHILD_START);
+	}
 
-	if (_popen_noshell_fork_mode == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
+	if (_POPEN_NOSHELL_BY_POSIX_SPAWN(arg->mode)) {
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_init(&file_actions_obj)) != 0) {
+			return 0;
+		}
 		file_actions = &file_actions_obj;
-		if (posix_spawn_file_actions_init(file_actions) != 0) {
-			_ERR(255, "posix_spawn_file_actions_init()");
+		if (arg->new_process_group && !arg->new_session) { // setsid() of the trampoline would fail in a new process group
+			if (_popen_noshell_fa_result(posix_spawnattr_init(&spawn_attr_obj)) != 0) {
+				goto spawn_fail;
+			}
+			spawn_attr = &spawn_attr_obj;
+			if (_popen_noshell_fa_result(posix_spawnattr_setflags(spawn_attr, POSIX_SPAWN_SETPGROUP)) != 0) {
+				goto spawn_fail;
+			}
+			if (_popen_noshell_fa_result(posix_spawnattr_setpgroup(spawn_attr, 0)) != 0) {
+				goto spawn_fail;
+			}
+		}
+	} else if (arg->new_session) {
+		if (setsid() < 0) {
+			_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_PGROUP, "setsid()");
+		}
+	} else if (arg->new_process_group) {
+		// the parent does the same, whoever comes first wins; see popen_noshell_ex()
+		if (setpgid(0, 0) != 0) {
+			_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_PGROUP, "setpgid()");
 		}
 	}
 
@@ -211,71 +806,127 @@ pid_t _popen_noshell_child_process(
 		closed_pipe_fd = 1;			/* close write end of pipe */
 		dupped_child_fd = STDIN_FILENO;		/* dup the other pipe end to STDIN */
 	}
-	if (popen_noshell_reopen_fd_to_dev_null(closed_child_fd, file_actions) != 0) {
-		_ERR(255, "popen_noshell_reopen_fd_to_dev_null(%d)", closed_child_fd);
+	if (popen_noshell_reopen_fd_to_dev_null(closed_child_fd, arg->dev_null_fd, file_actions) != 0) {
+		_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_STDIO, "popen_noshell_reopen_fd_to_dev_null(%d)", closed_child_fd);
 	}
 	if (_popen_noshell_close_and_dup(pipefd, closed_pipe_fd, dupped_child_fd, file_actions) != 0) {
-		_ERR(255, "_popen_noshell_close_and_dup(%d ,%d)", closed_pipe_fd, dupped_child_fd);
+		_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_STDIO, "_popen_noshell_close_and_dup(%d ,%d)", closed_pipe_fd, dupped_child_fd);
 	}
 
 	switch (stderr_mode) {
 		case 0: /* leave attached to parent */
 			break;
 		case 1: /* ignore STDERR completely */
-			if (popen_noshell_reopen_fd_to_dev_null(STDERR_FILENO, file_actions) != 0) {
-				_ERR(255, "popen_noshell_reopen_fd_to_dev_null(%d)", STDERR_FILENO);
+			if (popen_noshell_reopen_fd_to_dev_null(STDERR_FILENO, arg->dev_null_fd, file_actions) != 0) {
+				_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_STDIO, "popen_noshell_reopen_fd_to_dev_null(%d)", STDERR_FILENO);
 			}
 			break;
 		case 2: /* redirect to STDOUT */
 			if (_popen_noshell_dup2(STDOUT_FILENO, STDERR_FILENO, file_actions) < 0) {
-				_ERR(255, "dup2(redirect STDERR to STDOUT)");
+				_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_STDIO, "dup2(redirect STDERR to STDOUT)");
+			}
+			break;
+		case 3: /* a pipe of its own; both ends have O_CLOEXEC, and dup2() clears it for STDERR only */
+			if (_popen_noshell_dup2(arg->stderr_pipefd, STDERR_FILENO, file_actions) < 0) {
+				_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_STDIO, "dup2(redirect STDERR to its pipe)");
 			}
 			break;
 		default:
 			// unlike in the previous cases, we unit-test this error,
 			// so we take special measures to clean-up well, or else Valgrind complains
-			warnx("_popen_noshell_child_process: Unknown 'stderr_mode' %d", stderr_mode);
-			if (_popen_noshell_fork_mode != POPEN_NOSHELL_MODE_POSIX_SPAWN) {
-				_popen_noshell_child_process_cleanup_fail_and_exit(254, arg_ptr);
+			if (!_POPEN_NOSHELL_SHARES_MEMORY(arg->mode)) {
+				warnx("_popen_noshell_child_process: Unknown 'stderr_mode' %d", stderr_mode);
+			}
+			if (!file_actions) {
+				_popen_noshell_child_report(arg_ptr, arg, POPEN_NOSHELL_CHILD_STDIO, EINVAL);
+				_popen_noshell_child_process_cleanup_fail_and_exit(254, arg_ptr, arg);
 			} else {
-				return 0;
+				errno = EINVAL;
+				goto spawn_fail;
 			}
 			break;
 	}
+	if (!file_actions) {
+		_POPEN_NOSHELL_PROBE(child_fds, 0, arg);
+		_popen_noshell_child_trace(arg, POPEN_NOSHELL_PHASE_CHILD_FDS);
+	}
+
+	if (arg->close_fds) {
+		if (arg->mode == POPEN_NOSHELL_MODE_TRAMPOLINE) { // the trampoline closes the rest
+			for (i = 0; i < arg->keep_fds_count; ++i) { // dup2() onto itself clears FD_CLOEXEC, as in _popen_noshell_spawn_close_fds()
+				if (_popen_noshell_fa_result(posix_spawn_file_actions_adddup2(file_actions, arg->keep_fds[i], arg->keep_fds[i])) != 0) {
+					goto spawn_fail;
+				}
+			}
+		} else if (file_actions) {
+			if (_popen_noshell_spawn_close_fds(file_actions, arg->keep_fds, arg->keep_fds_count) != 0) {
+				goto spawn_fail;
+			}
+		} else if (_popen_noshell_child_close_fds(arg->keep_fds, arg->keep_fds_count) != 0) {
+			_CHILD_ERR(arg_ptr, arg, POPEN_NOSHELL_CHILD_CLOSE_FDS, "_popen_noshell_child_close_fds()");
+		}
+	}
 
-	if (_popen_noshell_fork_mode != POPEN_NOSHELL_MODE_POSIX_SPAWN) {
+	if (!file_actions) {
 		/* we are inside a fork()'ed child process here */
 
-		execvp(file, (char * const *)argv);
+		if (_popen_noshell_child_setup(arg, &stage) != 0) {
+			_CHILD_ERR(arg_ptr, arg, stage, "_popen_noshell_child_setup()");
+		}
+		_POPEN_NOSHELL_PROBE(child_exec, 0, arg);
+		_popen_noshell_child_trace(arg, POPEN_NOSHELL_PHASE_CHILD_EXEC);
+		execvpe(file, (char * const *)argv, envp);
 
 		/* if we are here, exec() failed */
 
-		warn("exec(\"%s\") inside the child", file);
+		_popen_noshell_child_report(arg_ptr, arg, POPEN_NOSHELL_CHILD_EXEC, errno);
+		_CHILD_WARN(arg, "exec(\"%s\") inside the child", file);
 
-		_popen_noshell_child_process_cleanup_fail_and_exit(255, arg_ptr);
+		_popen_noshell_child_process_cleanup_fail_and_exit(255, arg_ptr, arg);
 
 		return 0; // never reached
-	} else {
-		pid_t child_pid;
-		if (posix_spawnp(&child_pid, file, file_actions, NULL, (char * const *)argv, environ) < 0) {
-			warn("posix_spawn(\"%s\") inside the child", file);
-			if (posix_spawn_file_actions_destroy(file_actions) != 0) {
-				warn("posix_spawn_file_actions_destroy()");
-			}
-			return 0;
-		}
-		if (posix_spawn_file_actions_destroy(file_actions) != 0) {
-			warn("posix_spawn_file_actions_destroy()");
+	}
+
+	if (arg->mode == POPEN_NOSHELL_MODE_TRAMPOLINE) {
+		// the trampoline reports by the error channel, which must survive its own exec()
+		if (_popen_noshell_fa_result(posix_spawn_file_actions_adddup2(file_actions, arg->errpipe_fd, arg->errpipe_fd)) != 0) {
+			goto spawn_fail;
 		}
-		return child_pid;
+		trampoline_argv = _popen_noshell_trampoline_argv(arg);
+		if (!trampoline_argv) goto spawn_fail;
+		ret = posix_spawn(&child_pid, arg->trampoline, file_actions, spawn_attr, trampoline_argv, envp);
+		free(trampoline_argv);
+	} else {
+		// glibc 2.24+ reports the failed exec() here too, thanks to CLONE_VFORK; older ones let the child exit with 127
+		ret = posix_spawnp(&child_pid, file, file_actions, spawn_attr, (char * const *)argv, envp);
+	}
+	if (ret != 0) { // unlike most functions, it returns the error number
+		errno = ret;
+		warn("posix_spawn(\"%s\") inside the child", (arg->mode == POPEN_NOSHELL_MODE_TRAMPOLINE ? arg->trampoline : file));
+		errno = ret;
+		goto spawn_fail;
+	}
+	if (posix_spawn_file_actions_destroy(file_actions) != 0) {
+		warn("posix_spawn_file_actions_destroy()");
 	}
+	if (spawn_attr && posix_spawnattr_destroy(spawn_attr) != 0) {
+		warn("posix_spawnattr_destroy()");
+	}
+	return child_pid;
+
+spawn_fail: // POPEN_NOSHELL_MODE_POSIX_SPAWN and _TRAMPOLINE only, where we are still the parent; "errno" is set
+	ret = errno;
+	if (file_actions) posix_spawn_file_actions_destroy(file_actions);
+	if (spawn_attr) posix_spawnattr_destroy(spawn_attr);
+	errno = ret;
+	return 0;
 }
 
 int popen_noshell_child_process_by_clone(void *raw_arg) {
 	struct popen_noshell_clone_arg *arg;
 
 	arg = (struct popen_noshell_clone_arg *)raw_arg;
-	_popen_noshell_child_process(arg, arg->pipefd_0, arg->pipefd_1, arg->read_pipe, arg->stderr_mode, arg->file, arg->argv);
+	_popen_noshell_child_process(arg, arg);
 
 	return 0;
 }
@@ -299,7 +950,11 @@ char ** popen_noshell_copy_argv(const char * const *argv_orig) {
 	n = 0;
 	while (*argv) {
 		argv_new[n] = strdup(*argv);
-		if (!argv_new[n]) return NULL;
+		if (!argv_new[n]) {
+			while (n > 0) free(argv_new[--n]);
+			free(argv_new);
+			return NULL;
+		}
 		++argv;
 		++n;
 	}
@@ -308,37 +963,100 @@ char ** popen_noshell_copy_argv(const char * const *argv_orig) {
 	return argv_new;
 }
 
+#ifndef CLONE_CLEAR_SIGHAND
+#define CLONE_CLEAR_SIGHAND 0x100000000ULL /* Linux 5.5+ */
+#endif
+
+#if defined(__x86_64__) && defined(SYS_clone3) && !defined(POPEN_NOSHELL_VALGRIND_DEBUG)
+#define POPEN_NOSHELL_HAVE_CLONE3
+
+int _popen_noshell_clone3_unsupported = 0; // set once clone3() failed because of an old kernel or a seccomp filter
+
+// the first version of "struct clone_args" from <linux/sched.h>, CLONE_ARGS_SIZE_VER0
+struct _popen_noshell_clone3_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack; /* the lowest address of the stack */
+	uint64_t stack_size;
+	uint64_t tls;
+};
+
 /*
- * Similar to vfork() and threading.
- * Starts a process which behaves like a thread (shares global variables in memory with the parent) but
- * has a different PID and can call exec(), unlike traditional threads which are not allowed to call exec().
- *
- * This fork function is very resource-light because it does not copy any memory from the parent, but shares it.
- *
- * Like standard threads, you have to provide a start function *fn and arguments to it *arg. The life of the
- * new vmfork()'ed process starts from this function.
- *
- * After you have reaped the child via waitpid(), you have to free() the memory at "*memory_to_free_on_child_exit".
+ * libc has no clone3() wrapper which runs a function on a new stack, like clone() does, so this is one for x86_64.
+ * The child continues after the "syscall" instruction but on the new stack. All registers except rax, rcx and r11
+ * keep their values from the parent, so "fn" and "arg" are passed in the callee-saved r12 and r13.
  *
- * When the *fn function returns, the child process terminates.  The integer returned by *fn is the exit code for the child process.
- * The child process may also terminate explicitly by calling exit(2) or after receiving a fatal signal.
+ * We need it only for CLONE_CLEAR_SIGHAND: the kernel resets the signal handlers of the child, which saves the child
+ * a sigaction() call for each of the 64 signals; see _popen_noshell_block_signals().
+ */
+pid_t _popen_noshell_clone3(int (*fn)(void *), void *arg, void *stack, size_t stack_size, uint64_t flags) {
+	struct _popen_noshell_clone3_args cl_args;
+	register void *r12 __asm__("r12") = (void *)fn;
+	register void *r13 __asm__("r13") = arg;
+	long ret = SYS_clone3;
+
+	memset(&cl_args, 0, sizeof(cl_args));
+	cl_args.flags = flags;
+	cl_args.exit_signal = SIGCHLD;
+	cl_args.stack = (uintptr_t)stack;
+	cl_args.stack_size = stack_size;
+
+	__asm__ volatile (
+		"syscall\n\t"
+		"test %%rax, %%rax\n\t"
+		"jnz 1f\n\t"
+		/* child: we are on the new stack now */
+		"xor %%ebp, %%ebp\n\t"
+		"and $-16, %%rsp\n\t"
+		"mov %%r13, %%rdi\n\t"
+		"call *%%r12\n\t"
+		"mov %%eax, %%edi\n\t"
+		"mov %[sys_exit], %%eax\n\t"
+		"syscall\n\t"
+		"hlt\n\t"
+		"1:\n\t"
+		: "+a" (ret)
+		: "D" (&cl_args), "S" (sizeof(cl_args)), "r" (r12), "r" (r13), [sys_exit] "i" (SYS_exit)
+		: "rcx", "r11", "memory"
+	);
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+#endif
+
+/*
+ * popen_noshell_vmfork() on a stack which the caller allocated; the stack must be "stack_size" + 15 bytes long.
  *
- * Returns -1 on error. On success returns the PID of the newly created child.
+ * If "clear_sighand" is not NULL and points to 1, the kernel is asked to reset the signal handlers of the child.
+ * It is set to 0 if this is not supported; the child has to reset them itself then.
  */
-pid_t popen_noshell_vmfork(int (*fn)(void *), void *arg, void **memory_to_free_on_child_exit) {
-		void *stack, *stack_aligned;
+pid_t _popen_noshell_clone(int (*fn)(void *), void *arg, void *stack, size_t stack_size, int *clear_sighand) {
+		void *stack_aligned;
 		pid_t pid;
 
-		stack = malloc(POPEN_NOSHELL_STACK_SIZE + 15);
-		if (!stack) return -1;
-		*memory_to_free_on_child_exit = stack;
+#ifdef POPEN_NOSHELL_HAVE_CLONE3
+		if (clear_sighand && *clear_sighand && !__atomic_load_n(&_popen_noshell_clone3_unsupported, __ATOMIC_RELAXED)) {
+			pid = _popen_noshell_clone3(fn, arg, stack, stack_size, CLONE_VM | CLONE_VFORK | CLONE_CLEAR_SIGHAND);
+			if (pid != -1) return pid;
+			if (errno != ENOSYS && errno != EINVAL && errno != EPERM) return -1;
+			__atomic_store_n(&_popen_noshell_clone3_unsupported, 1, __ATOMIC_RELAXED);
+		}
+#endif
+		if (clear_sighand) *clear_sighand = 0;
 
 		/*
 		 * On all supported Linux platforms the stack grows down, except for HP-PARISC.
 		 * You can grep the kernel source for "STACK_GROWSUP", in order to get this information.
 		 */
 		// stack grows down, set pointer at the end of the block
-		stack_aligned = (void *) ((char * /*byte*/)stack + POPEN_NOSHELL_STACK_SIZE/*bytes*/);
+		stack_aligned = (void *) ((char * /*byte*/)stack + stack_size/*bytes*/);
 
 		/*
 		 * On all supported platforms by GNU libc, the stack is aligned to 16 bytes, except for the SuperH platform which is aligned to 8 bytes.
@@ -371,110 +1089,2503 @@ pid_t popen_noshell_vmfork(int (*fn)(void *), void *arg, void **memory_to_free_o
 		return pid;
 }
 
+// popen_noshell_vmfork() with a custom stack size, see below; for "clear_sighand" see _popen_noshell_clone()
+pid_t _popen_noshell_vmfork(int (*fn)(void *), void *arg, void **memory_to_free_on_child_exit, size_t stack_size, int *clear_sighand) {
+	void *stack;
+
+	stack = malloc(stack_size + 15);
+	if (!stack) return -1;
+	*memory_to_free_on_child_exit = stack;
+
+	return _popen_noshell_clone(fn, arg, stack, stack_size, clear_sighand);
+}
+
 /*
- * Pipe stream to or from process. Similar to popen(), only much faster.
+ * Similar to vfork() and threading.
+ * Starts a process which behaves like a thread (shares global variables in memory with the parent) but
+ * has a different PID and can call exec(), unlike traditional threads which are not allowed to call exec().
  *
- * "file" is the command to be executed. It is searched within the PATH environment variable.
- * "argv[]" is an array to "char *" elements which are passed as command-line arguments.
- *	Note: The first element must be the same string as "file".
- *	Note: The last element must be a (char *)NULL terminating element.
- * "type" specifies if we are reading from the STDOUT or writing to the STDIN of the executed command "file". Use "r" for reading, "w" for writing.
- * "pid" is a pointer to an interger. The PID of the child process is stored there.
- * "stderr_mode" has the following meaning:
- *	0: leave STDERR of the child process attached to the current STDERR of the parent process
- * 	1: ignore the STDERR of the child process
- * 	2: redirect the STDERR of the child process to its STDOUT
+ * This fork function is very resource-light because it does not copy any memory from the parent, but shares it.
  *
- * This function is not very sustainable on failures. This means that if it fails for some reason (out of memory, no such executable, etc.),
- * you are probably in trouble, because the function allocated some memory or file descriptors and never released them.
- * Normally, this function should never fail.
+ * Like standard threads, you have to provide a start function *fn and arguments to it *arg. The life of the
+ * new vmfork()'ed process starts from this function.
+ *
+ * After you have reaped the child via waitpid(), you have to free() the memory at "*memory_to_free_on_child_exit".
+ *
+ * When the *fn function returns, the child process terminates.  The integer returned by *fn is the exit code for the child process.
+ * The child process may also terminate explicitly by calling exit(2) or after receiving a fatal signal.
+ *
+ * Returns -1 on error. On success returns the PID of the newly created child.
+ */
+pid_t popen_noshell_vmfork(int (*fn)(void *), void *arg, void **memory_to_free_on_child_exit) {
+	return _popen_noshell_vmfork(fn, arg, memory_to_free_on_child_exit, POPEN_NOSHELL_STACK_SIZE, NULL);
+}
+
+/*
+ * Pipe stream to or from process. Similar to popen(), only much faster.
+ *
+ * "file" is the command to be executed. It is searched within the PATH environment variable.
+ * "argv[]" is an array to "char *" elements which are passed as command-line arguments.
+ *	Note: The first element must be the same string as "file".
+ *	Note: The last element must be a (char *)NULL terminating element.
+ * "type" specifies if we are reading from the STDOUT or writing to the STDIN of the executed command "file". Use "r" for reading, "w" for writing.
+ * "pid" is a pointer to an interger. The PID of the child process is stored there.
+ * "stderr_mode" has the following meaning:
+ *	0: leave STDERR of the child process attached to the current STDERR of the parent process
+ * 	1: ignore the STDERR of the child process
+ * 	2: redirect the STDERR of the child process to its STDOUT
+ * 	3: a separate pipe for the STDERR of the child process; read it from "pclose_arg->stderr_fd", see popen_noshell_capture()
+ *
+ * If this function fails for some reason (out of memory, out of fds, no such executable, etc.), it releases whatever it
+ * allocated, and a child which was started already is reaped. See popen_noshell_admission_init() for spawn storms.
+ *
+ * Returns NULL on any error, "errno" is set appropriately.
+ * This includes a child which fails before its exec() completes, e.g. ENOENT for no such executable or EACCES:
+ * it is reaped already, and "pclose_arg->child_stage" tells which POPEN_NOSHELL_CHILD_* step failed.
+ * In POPEN_NOSHELL_MODE_POSIX_SPAWN libc reports all errors alike, so only "errno" is set there.
+ * On success, a stream pointer is returned.
+ * 	When you are done working with the stream, you have to close it by calling pclose_noshell(), or else you will leave zombie processes.
+ */
+FILE *popen_noshell(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg, int stderr_mode) {
+	struct popen_noshell_options opts;
+
+	popen_noshell_options_init(&opts);
+	opts.stderr_mode = stderr_mode;
+
+	return popen_noshell_ex(file, argv, type, pclose_arg, &opts);
+}
+
+/*
+ * POPEN_NOSHELL_MODE_AUTO stands for the mode which suits this process best. It is resolved once, by the first spawn
+ * which asks for it or by popen_noshell_auto_decision(). popen_noshell_options_init() resolves it right away, so
+ * "opts.mode" is always a real mode afterwards.
+ *
+ * The choice, in this order:
+ *	- the environment variable POPEN_NOSHELL_MODE: "clone", "fork", "posix_spawn" or "vfork" is taken as it is,
+ *		and "calibrate" runs popen_noshell_auto_calibrate() with "true" as the probe; other values are ignored
+ *	- POPEN_NOSHELL_MODE_FORK under Valgrind, which does not support clone(CLONE_VM) and turns vfork() into fork():
+ *		the errors which the child stores in our memory would be lost
+ *	- POPEN_NOSHELL_MODE_CLONE if the kernel has clone3(), so that it resets the signal handlers of the child
+ *	- else POPEN_NOSHELL_MODE_VFORK: the child resets them itself either way, and vfork() needs no stack
+ * POPEN_NOSHELL_MODE_POSIX_SPAWN is chosen only by the environment: libc does not tell which step of the child failed,
+ * and it cannot do "new_session", "cwd", "rlimits" and "cpu_affinity".
+ * POPEN_NOSHELL_MODE_TRAMPOLINE is never chosen: it needs the trampoline installed, see popen_noshell_set_trampoline().
+ */
+pthread_mutex_t _popen_noshell_auto_mutex = PTHREAD_MUTEX_INITIALIZER; // guards _popen_noshell_auto
+struct popen_noshell_auto_decision _popen_noshell_auto;
+int _popen_noshell_auto_mode = POPEN_NOSHELL_MODE_AUTO; // the resolved _popen_noshell_auto.mode; POPEN_NOSHELL_MODE_AUTO until then
+
+const char *_popen_noshell_mode_names[POPEN_NOSHELL_MODES] = {"clone", "fork", "posix_spawn", "vfork", "trampoline"};
+
+// fills in the features of "decision" and the mode which they suggest
+void _popen_noshell_auto_detect(struct popen_noshell_auto_decision *decision) {
+	const char *preload = getenv("LD_PRELOAD");
+	int fd;
+
+	memset(decision, 0, sizeof(*decision));
+#ifdef __GLIBC__
+	if (sscanf(gnu_get_libc_version(), "%d.%d", &decision->glibc_major, &decision->glibc_minor) != 2) {
+		decision->glibc_major = 0;
+		decision->glibc_minor = 0;
+	}
+#endif
+#ifdef POPEN_NOSHELL_HAVE_CLONE3
+	// no "struct clone_args" at all is EINVAL if the kernel has clone3(); ENOSYS before Linux 5.3 or with some seccomp filters
+	decision->clone3 = (syscall(SYS_clone3, NULL, 0) == -1 && errno == EINVAL &&
+		!__atomic_load_n(&_popen_noshell_clone3_unsupported, __ATOMIC_RELAXED));
+#endif
+#ifdef SYS_pidfd_open
+	fd = syscall(SYS_pidfd_open, getpid(), 0);
+	if (fd >= 0) {
+		decision->pidfd = 1;
+		close(fd);
+	}
+#else
+	(void) fd;
+#endif
+	decision->valgrind = (preload && strstr(preload, "/vgpreload") != NULL); // Valgrind injects itself like this
+
+	decision->source = POPEN_NOSHELL_AUTO_DETECTED;
+	if (decision->valgrind) {
+		decision->mode = POPEN_NOSHELL_MODE_FORK;
+	} else if (decision->clone3) {
+		decision->mode = POPEN_NOSHELL_MODE_CLONE;
+	} else {
+		decision->mode = POPEN_NOSHELL_MODE_VFORK;
+	}
+}
+
+// the mode which POPEN_NOSHELL_MODE_AUTO stands for; the first call resolves it
+int _popen_noshell_auto_resolve() {
+	int mode = __atomic_load_n(&_popen_noshell_auto_mode, __ATOMIC_ACQUIRE);
+	const char *env;
+	int calibrate = 0;
+
+	if (mode != POPEN_NOSHELL_MODE_AUTO) return mode;
+
+	pthread_mutex_lock(&_popen_noshell_auto_mutex);
+	if (_popen_noshell_auto_mode == POPEN_NOSHELL_MODE_AUTO) {
+		_popen_noshell_auto_detect(&_popen_noshell_auto);
+		env = getenv("POPEN_NOSHELL_MODE");
+		for (mode = 0; env && mode < POPEN_NOSHELL_MODES; ++mode) {
+			if (mode != POPEN_NOSHELL_MODE_TRAMPOLINE && strcmp(env, _popen_noshell_mode_names[mode]) == 0) {
+				_popen_noshell_auto.mode = mode;
+				_popen_noshell_auto.source = POPEN_NOSHELL_AUTO_ENV;
+			}
+		}
+		calibrate = (env && strcmp(env, "calibrate") == 0);
+		__atomic_store_n(&_popen_noshell_auto_mode, _popen_noshell_auto.mode, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&_popen_noshell_auto_mutex);
+
+	if (calibrate) { // the detected mode serves the other threads meanwhile, and stays if this fails
+		popen_noshell_auto_calibrate(NULL, NULL, 0);
+	}
+	return __atomic_load_n(&_popen_noshell_auto_mode, __ATOMIC_ACQUIRE);
+}
+
+// copies how POPEN_NOSHELL_MODE_AUTO was resolved into "decision"; resolves it first if nobody did yet
+void popen_noshell_auto_decision(struct popen_noshell_auto_decision *decision) {
+	_popen_noshell_auto_resolve();
+	pthread_mutex_lock(&_popen_noshell_auto_mutex);
+	*decision = _popen_noshell_auto;
+	pthread_mutex_unlock(&_popen_noshell_auto_mutex);
+}
+
+int _popen_noshell_compare_ns(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Makes POPEN_NOSHELL_MODE_AUTO the candidate mode with the fastest spawn + pclose_noshell() of "file" and "argv".
+ * Each candidate spawns them "rounds" times and its median counts; the candidates take turns, so that a noisy moment
+ * hurts all of them alike. The probe should be as tiny as performance_tests/tiny2, or the command is measured instead
+ * of the spawn. NULL "file" and "argv" run "true"; 0 "rounds" means 20.
+ *
+ * The candidates are POPEN_NOSHELL_MODE_CLONE and _VFORK, which support every option and report every failure of the
+ * child. Under Valgrind, POPEN_NOSHELL_MODE_FORK is the only safe one.
+ * This spawns children itself, so call it early, not while other threads use POPEN_NOSHELL_MODE_AUTO.
+ *
+ * Returns the chosen mode, or -1 on any error, "errno" is set appropriately; the previous choice stays then.
+ */
+int popen_noshell_auto_calibrate(const char *file, const char * const *argv, int rounds) {
+	const char *argv_true[] = {"true", NULL};
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	int candidates[POPEN_NOSHELL_MODES];
+	int64_t median[POPEN_NOSHELL_MODES];
+	int64_t *samples, start;
+	int count = 0, best = 0, round, i, saved_errno;
+	char buf[256];
+	FILE *fp;
+
+	if (rounds < 0 || (file && !argv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!file) {
+		file = argv_true[0];
+		argv = argv_true;
+	}
+	if (!rounds) rounds = 20;
+
+	_popen_noshell_auto_resolve(); // detects the features
+	pthread_mutex_lock(&_popen_noshell_auto_mutex);
+	if (_popen_noshell_auto.valgrind) {
+		candidates[count++] = POPEN_NOSHELL_MODE_FORK;
+	} else {
+		candidates[count++] = POPEN_NOSHELL_MODE_CLONE;
+		candidates[count++] = POPEN_NOSHELL_MODE_VFORK;
+	}
+	pthread_mutex_unlock(&_popen_noshell_auto_mutex);
+
+	samples = (int64_t *)malloc(sizeof(int64_t) * rounds * count);
+	if (!samples) return -1;
+	popen_noshell_options_init(&opts);
+	opts.stderr_mode = 1;
+	for (round = -1; round < rounds; ++round) { // round -1 only warms up the caches and the PATH lookup
+		for (i = 0; i < count; ++i) {
+			opts.mode = candidates[i];
+			start = _popen_noshell_now_ns();
+			fp = popen_noshell_ex(file, argv, "r", &pc, &opts);
+			if (!fp) goto fail;
+			while (fread(buf, 1, sizeof(buf), fp) > 0);
+			if (pclose_noshell(&pc) == -1) goto fail;
+			if (round >= 0) samples[i * rounds + round] = _popen_noshell_now_ns() - start;
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		qsort(samples + i * rounds, rounds, sizeof(int64_t), _popen_noshell_compare_ns);
+		median[i] = samples[i * rounds + rounds / 2];
+		if (median[i] < median[best]) best = i;
+	}
+	free(samples);
+
+	pthread_mutex_lock(&_popen_noshell_auto_mutex);
+	memset(_popen_noshell_auto.calibrated_ns, 0, sizeof(_popen_noshell_auto.calibrated_ns));
+	for (i = 0; i < count; ++i) {
+		_popen_noshell_auto.calibrated_ns[candidates[i]] = median[i];
+	}
+	_popen_noshell_auto.mode = candidates[best];
+	_popen_noshell_auto.source = POPEN_NOSHELL_AUTO_CALIBRATED;
+	__atomic_store_n(&_popen_noshell_auto_mode, candidates[best], __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_popen_noshell_auto_mutex);
+	return candidates[best];
+
+fail:
+	saved_errno = errno;
+	free(samples);
+	errno = saved_errno;
+	return -1;
+}
+
+void popen_noshell_options_init(struct popen_noshell_options *opts) {
+	memset(opts, 0, sizeof(struct popen_noshell_options));
+	opts->mode = popen_noshell_get_fork_mode();
+	if (opts->mode == POPEN_NOSHELL_MODE_AUTO) opts->mode = _popen_noshell_auto_resolve();
+}
+
+// the pidfd lets pclose_noshell() sleep until the child exits or a deadline expires, whichever comes first
+void _popen_noshell_open_pidfd(struct popen_noshell_pass_to_pclose *pclose_arg) {
+#ifdef SYS_pidfd_open
+	// the pidfd is always opened with O_CLOEXEC; -1 on older kernels makes us poll waitpid() instead
+	pclose_arg->pidfd = syscall(SYS_pidfd_open, pclose_arg->pid, 0);
+#endif
+}
+
+/*
+ * A spawn context keeps everything which popen_noshell_ex() would otherwise allocate or look up on each call:
+ *	- the clone() stack: with CLONE_VFORK the child is done with it once clone() returns, so one stack serves all spawns
+ *	- the argv copy: made into a reusable arena, instead of a malloc() + strdup() per argument
+ *	- an O_CLOEXEC "/dev/null" file descriptor which the child dup2()'s instead of open()'ing it
+ *	- the PATH lookups of execvp(): resolved once per command and remembered until PATH changes;
+ *		if you replace or remove the binaries in PATH at runtime, destroy and re-create the context
+ *	- the counters in "ctx->stats"
+ *
+ * A context belongs to one thread: spawning through it takes no locks and touches no shared memory, so give each
+ * thread its own. The children may be pclose_noshell()'d by any thread though, since they don't reference the context.
+ *
+ * Returns -1 on any error, "errno" is set appropriately.
+ */
+int popen_noshell_ctx_init(struct popen_noshell_ctx *ctx) {
+	memset(ctx, 0, sizeof(struct popen_noshell_ctx));
+	ctx->dev_null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (ctx->dev_null_fd < 0) return -1;
+	return 0;
+}
+
+void _popen_noshell_ctx_flush_path_cache(struct popen_noshell_ctx *ctx) {
+	int i;
+
+	for (i = 0; i < POPEN_NOSHELL_CTX_PATH_CACHE; ++i) {
+		free(ctx->path_cache[i].file);
+		free(ctx->path_cache[i].path);
+		ctx->path_cache[i].file = NULL;
+		ctx->path_cache[i].path = NULL;
+	}
+	free(ctx->path_env);
+	ctx->path_env = NULL;
+}
+
+void popen_noshell_ctx_destroy(struct popen_noshell_ctx *ctx) {
+	_popen_noshell_ctx_flush_path_cache(ctx);
+	free(ctx->stack);
+	free(ctx->arena);
+	if (ctx->dev_null_fd >= 0 && close(ctx->dev_null_fd) != 0) {
+		warn("close(/dev/null)");
+	}
+	memset(ctx, 0, sizeof(struct popen_noshell_ctx));
+	ctx->dev_null_fd = -1;
+}
+
+/*
+ * The PATH search of execvp(), with its result remembered in the context.
+ * Returns "file" itself if it has a slash, if it was not found, or if we ran out of memory; exec() then does the usual.
+ */
+const char *_popen_noshell_ctx_resolve(struct popen_noshell_ctx *ctx, const char *file) {
+	const char *path, *dir, *end;
+	char buf[PATH_MAX];
+	struct stat st;
+	size_t dir_len, file_len;
+	char *cached_file, *cached_path;
+	int i;
+
+	if (!*file || strchr(file, '/')) return file;
+
+	path = getenv("PATH");
+	if (!path) path = "/bin:/usr/bin"; // the same default as in execvp()
+
+	if (!ctx->path_env || strcmp(ctx->path_env, path) != 0) {
+		_popen_noshell_ctx_flush_path_cache(ctx);
+		ctx->path_env = strdup(path);
+		if (!ctx->path_env) return file;
+	}
+
+	for (i = 0; i < POPEN_NOSHELL_CTX_PATH_CACHE; ++i) {
+		if (ctx->path_cache[i].file && strcmp(ctx->path_cache[i].file, file) == 0) {
+			++ctx->stats.path_cache_hits;
+			return ctx->path_cache[i].path;
+		}
+	}
+	++ctx->stats.path_cache_misses;
+
+	file_len = strlen(file);
+	for (dir = path; ; dir = end + 1) {
+		end = strchrnul(dir, ':');
+		dir_len = end - dir;
+		if (dir_len == 0) { // an empty entry means the current directory
+			dir = ".";
+			dir_len = 1;
+		}
+		if (dir_len + 1 + file_len < sizeof(buf)) {
+			memcpy(buf, dir, dir_len);
+			buf[dir_len] = '/';
+			memcpy(buf + dir_len + 1, file, file_len + 1);
+			if (access(buf, X_OK) == 0 && stat(buf, &st) == 0 && S_ISREG(st.st_mode)) {
+				break;
+			}
+		}
+		if (!*end) return file; // not found
+	}
+
+	cached_file = strdup(file);
+	cached_path = strdup(buf);
+	if (!cached_file || !cached_path) {
+		free(cached_file);
+		free(cached_path);
+		return file;
+	}
+
+	i = ctx->path_cache_next;
+	ctx->path_cache_next = (i + 1) % POPEN_NOSHELL_CTX_PATH_CACHE;
+	free(ctx->path_cache[i].file);
+	free(ctx->path_cache[i].path);
+	ctx->path_cache[i].file = cached_file;
+	ctx->path_cache[i].path = cached_path;
+
+	return cached_path;
+}
+
+// copies "file" and "argv" into the arena of the context, like popen_noshell_copy_argv() does on the heap
+int _popen_noshell_ctx_copy_argv(struct popen_noshell_ctx *ctx, struct popen_noshell_clone_arg *arg) {
+	const char * const *argv;
+	size_t size, len;
+	char **argv_new;
+	char *p, *arena;
+	int argc = 0;
+
+	size = strlen(arg->file) + 1;
+	for (argv = arg->argv; *argv; ++argv) {
+		size += strlen(*argv) + 1;
+		++argc;
+	}
+	size += sizeof(char *) * (argc + 1);
+
+	if (size > ctx->arena_size) {
+		arena = (char *)realloc(ctx->arena, size);
+		if (!arena) return -1;
+		ctx->arena = arena;
+		ctx->arena_size = size;
+	}
+
+	argv_new = (char **)ctx->arena; // the pointers come first, so that they are aligned
+	p = ctx->arena + sizeof(char *) * (argc + 1);
+	for (argc = 0, argv = arg->argv; *argv; ++argv, ++argc) {
+		len = strlen(*argv) + 1;
+		memcpy(p, *argv, len);
+		argv_new[argc] = p;
+		p += len;
+	}
+	argv_new[argc] = NULL;
+	memcpy(p, arg->file, strlen(arg->file) + 1);
+
+	arg->file = p;
+	arg->argv = (const char * const *)argv_new;
+	return 0;
+}
+
+// clone() on the stack of the context; nothing has to be freed by pclose_noshell()
+pid_t _popen_noshell_ctx_clone(struct popen_noshell_ctx *ctx, struct popen_noshell_clone_arg *arg,
+	struct popen_noshell_pass_to_pclose *pclose_arg, size_t stack_size, int argv_stable
+) {
+	if (!argv_stable && _popen_noshell_ctx_copy_argv(ctx, arg) != 0) return -1;
+
+	if (ctx->stack_size < stack_size) {
+		free(ctx->stack);
+		ctx->stack_size = 0;
+		ctx->stack = malloc(stack_size + 15);
+		if (!ctx->stack) return -1;
+		ctx->stack_size = stack_size;
+	}
+	_POPEN_NOSHELL_TRACE(stack, POPEN_NOSHELL_PHASE_STACK, pclose_arg);
+
+	return _popen_noshell_clone(&popen_noshell_child_process_by_clone, arg, ctx->stack, ctx->stack_size,
+		(arg->sigmask ? &arg->sighand_cleared : NULL));
+}
+
+/*
+ * The arguments of a child which shares our memory until its exec(): "child_arg" itself with "argv_stable", as
+ * CLONE_VFORK and vfork() keep our stack frame alive until then, and the caller promised the same for "argv".
+ * Otherwise a copy, so that nobody can free() our memory while we use it in the child; pclose_noshell() frees it.
+ * Returns NULL on error; _popen_noshell_ex() frees whatever was copied then.
+ */
+struct popen_noshell_clone_arg *_popen_noshell_shared_clone_arg(struct popen_noshell_clone_arg *child_arg,
+	struct popen_noshell_pass_to_pclose *pclose_arg, int argv_stable
+) {
+	struct popen_noshell_clone_arg *arg;
+
+	pclose_arg->free_clone_mem = 1; // at least the stack, if any
+	pclose_arg->func_args = NULL;
+	if (argv_stable) return child_arg;
+
+	arg = (struct popen_noshell_clone_arg*) malloc(sizeof(struct popen_noshell_clone_arg));
+	if (!arg) return NULL;
+	*arg = *child_arg;
+	pclose_arg->func_args = arg;
+	arg->argv = NULL;
+	arg->file = strdup(child_arg->file);
+	if (!arg->file) return NULL;
+	arg->argv = (const char * const *)popen_noshell_copy_argv(child_arg->argv);
+	if (!arg->argv) return NULL;
+	return arg;
+}
+
+// starts the child in "child_arg->mode"; returns the PID of the child, or -1 on error
+pid_t _popen_noshell_spawn(struct popen_noshell_clone_arg *child_arg, struct popen_noshell_pass_to_pclose *pclose_arg, const struct popen_noshell_options *opts) {
+	size_t stack_size;
+	pid_t pid;
+
+	if (opts->mode == POPEN_NOSHELL_MODE_FORK) { // use fork()
+
+		child_arg->sighand_cleared = 0;
+		_POPEN_NOSHELL_TRACE(stack, POPEN_NOSHELL_PHASE_STACK, pclose_arg);
+		pid = fork();
+		if (pid == -1) return -1;
+		if (pid == 0) {
+			_popen_noshell_child_process(NULL, child_arg);
+			errx(EXIT_FAILURE, "This must never happen");
+		} // child life ends here, for sure
+
+	} else if (_POPEN_NOSHELL_BY_POSIX_SPAWN(opts->mode)) { // use posix_spawn(), of the command or of the trampoline
+
+		_POPEN_NOSHELL_TRACE(stack, POPEN_NOSHELL_PHASE_STACK, pclose_arg);
+		pid = _popen_noshell_child_process(NULL, child_arg);
+		if (pid == 0) return -1; // "errno" is set
+
+	} else if (opts->mode == POPEN_NOSHELL_MODE_VFORK) { // use vfork() on our own stack
+
+		// the child borrows our stack frame until its exec(), so it must never return from here
+		child_arg->sighand_cleared = 0; // there is no vfork() which clears them, so the child does it
+		_POPEN_NOSHELL_TRACE(stack, POPEN_NOSHELL_PHASE_STACK, pclose_arg);
+		struct popen_noshell_clone_arg *arg = _popen_noshell_shared_clone_arg(child_arg, pclose_arg, opts->argv_stable);
+
+		if (!arg) return -1;
+		pid = vfork();
+		if (pid == -1) return -1;
+		if (pid == 0) {
+#ifndef POPEN_NOSHELL_VALGRIND_DEBUG
+			_popen_noshell_child_process(arg, arg); // shares our memory, so it reports like a clone()'d child
+#else
+			_popen_noshell_child_process(NULL, arg); // Valgrind turns vfork() into fork(), so it reports by the error channel
+#endif
+			_exit(255); // never reached
+		} // child life ends here, for sure
+		child_arg->child_stage = arg->child_stage;
+		child_arg->child_errno = arg->child_errno;
+
+	} else if (opts->ctx) { // use clone() with the stack and the memory of the context
+
+		pid = _popen_noshell_ctx_clone(opts->ctx, child_arg, pclose_arg, (opts->stack_size ? opts->stack_size : POPEN_NOSHELL_STACK_SIZE),
+			opts->argv_stable);
+
+	} else { // use clone()
+
+		struct popen_noshell_clone_arg *arg = _popen_noshell_shared_clone_arg(child_arg, pclose_arg, opts->argv_stable);
+
+		if (!arg) return -1;
+		// like _popen_noshell_vmfork(), but with a trace point between the malloc() and the clone()
+		stack_size = (opts->stack_size ? opts->stack_size : POPEN_NOSHELL_STACK_SIZE);
+		pclose_arg->stack = malloc(stack_size + 15);
+		if (!pclose_arg->stack) return -1;
+		_POPEN_NOSHELL_TRACE(stack, POPEN_NOSHELL_PHASE_STACK, pclose_arg);
+
+		pid = _popen_noshell_clone(&popen_noshell_child_process_by_clone, arg, pclose_arg->stack, stack_size,
+			(arg->sigmask ? &arg->sighand_cleared : NULL));
+		child_arg->child_stage = arg->child_stage;
+		child_arg->child_errno = arg->child_errno;
+
+	} // done: using clone()
+
+	return pid;
+}
+
+// the warn() of a child which shares our memory and may not warn() itself, see _CHILD_WARN()
+void _popen_noshell_warn_child_error(const struct popen_noshell_clone_arg *child_arg) {
+	const char *what[] = {"", "setpgid()", "the setup of STDIN, STDOUT and STDERR", "_popen_noshell_child_close_fds()", "exec()",
+		"chdir()", "setrlimit()", "sched_setaffinity()"};
+	int stage = child_arg->child_stage;
+
+	errno = child_arg->child_errno;
+	if (stage == POPEN_NOSHELL_CHILD_EXEC) {
+		warn("exec(\"%s\") inside the child", child_arg->file);
+	} else if (stage == POPEN_NOSHELL_CHILD_PGROUP && child_arg->new_session) {
+		warn("setsid() inside the child");
+	} else if (stage > 0 && stage < (int)(sizeof(what) / sizeof(what[0]))) {
+		warn("%s inside the child", what[stage]);
+	}
+}
+
+// reads the report of the child from the error channel, see _popen_noshell_child_report(); closes both ends of "errpipe"
+void _popen_noshell_read_child_report(int errpipe[2], struct popen_noshell_clone_arg *child_arg) {
+	int msg[2];
+	ssize_t ret;
+
+	close(errpipe[1]); // or we would never see EOF
+	do {
+		ret = read(errpipe[0], msg, sizeof(msg)); // blocks until the child called exec() or failed
+	} while (ret < 0 && errno == EINTR);
+	if (ret == sizeof(msg)) {
+		child_arg->child_stage = msg[0];
+		child_arg->child_errno = msg[1];
+	}
+	close(errpipe[0]);
+}
+
+// the spawn itself, see popen_noshell_ex(); "stage" tells where it failed
+FILE *_popen_noshell_ex(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg,
+	const struct popen_noshell_options *opts, int *stage
+) {
+	int read_pipe;
+	int pipefd[2] = {-1, -1}; // 0 -> READ, 1 -> WRITE ends
+	int errpipe[2] = {-1, -1}; // the error channel of a fork()'ed child
+	int stderr_pipe[2] = {-1, -1}; // stderr_mode 3
+	struct popen_noshell_clone_arg child_arg;
+	sigset_t parent_sigmask;
+	int64_t child_trace_ns[3] = {0, 0, 0}; // POPEN_NOSHELL_PHASE_CHILD_*
+	pid_t pid;
+	FILE *fp;
+	int i, shared, saved_errno;
+
+	memset(pclose_arg, 0, sizeof(struct popen_noshell_pass_to_pclose));
+	pclose_arg->pidfd = -1;
+	pclose_arg->stderr_fd = -1;
+	pclose_arg->timers_index = -1;
+	pclose_arg->tracer = __atomic_load_n(&_popen_noshell_tracer, __ATOMIC_ACQUIRE);
+	pclose_arg->mode = opts->mode;
+	_POPEN_NOSHELL_TRACE(start, POPEN_NOSHELL_PHASE_START, pclose_arg);
+	*stage = POPEN_NOSHELL_STAGE_ARGS;
+
+	if (strcmp(type, "r") == 0) {
+		read_pipe = 1;
+	} else if (strcmp(type, "w") == 0) {
+		read_pipe = 0;
+	} else {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (opts->mode < POPEN_NOSHELL_MODE_CLONE || opts->mode >= POPEN_NOSHELL_MODES) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (opts->timeout_ms < 0 || opts->idle_timeout_ms < 0 || opts->kill_grace_ms < 0 || opts->pipe_size < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (opts->keep_fds_count < 0 || (opts->keep_fds_count > 0 && !opts->keep_fds)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (opts->rlimits_count < 0 || (opts->rlimits_count > 0 && !opts->rlimits) || (opts->cpu_affinity && !opts->cpu_affinity_size)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (opts->mode == POPEN_NOSHELL_MODE_POSIX_SPAWN && (opts->new_session || opts->cwd || opts->rlimits_count || opts->cpu_affinity)) {
+		errno = ENOTSUP; // see POPEN_NOSHELL_MODE_TRAMPOLINE
+		return NULL;
+	}
+#ifndef POPEN_NOSHELL_HAVE_ADDCLOSEFROM
+	if (opts->close_fds && opts->mode == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
+		errno = ENOTSUP; // needs posix_spawn_file_actions_addclosefrom_np() of glibc 2.34
+		return NULL;
+	}
+#endif
+	pclose_arg->kill_pgroup = (opts->new_process_group || opts->new_session);
+	pclose_arg->kill_grace_ms = opts->kill_grace_ms;
+	pclose_arg->idle_timeout_ms = opts->idle_timeout_ms;
+	if (opts->timeout_ms || opts->idle_timeout_ms) {
+		pclose_arg->last_io_ns = _popen_noshell_now_ns();
+		if (opts->timeout_ms) {
+			pclose_arg->deadline_ns = pclose_arg->last_io_ns + (int64_t)opts->timeout_ms * 1000000;
+		}
+	}
+
+	// issue #7: O_CLOEXEC, so that child processes don't inherit and hold opened the
+	// file descriptors of the parent.
+	// The child process turns this off for its fd of the pipe.
+	*stage = POPEN_NOSHELL_STAGE_PIPE;
+	if (pipe2(pipefd, O_CLOEXEC) != 0) return NULL;
+	if (opts->pipe_size && fcntl(pipefd[0], F_SETPIPE_SZ, opts->pipe_size) < 0) goto fail;
+#ifndef POPEN_NOSHELL_VALGRIND_DEBUG
+	if (opts->mode == POPEN_NOSHELL_MODE_FORK || opts->mode == POPEN_NOSHELL_MODE_TRAMPOLINE) {
+#else
+	if (opts->mode != POPEN_NOSHELL_MODE_POSIX_SPAWN) { // Valgrind gets fork() instead of clone(), so the memory is not shared
+#endif
+		if (pipe2(errpipe, O_CLOEXEC) != 0) goto fail;
+	}
+	if (opts->stderr_mode == 3 && pipe2(stderr_pipe, O_CLOEXEC) != 0) goto fail;
+	_POPEN_NOSHELL_TRACE(pipe, POPEN_NOSHELL_PHASE_PIPE, pclose_arg);
+
+	child_arg.mode = opts->mode;
+	child_arg.pipefd_0 = pipefd[0];
+	child_arg.pipefd_1 = pipefd[1];
+	child_arg.read_pipe = read_pipe;
+	child_arg.stderr_mode = opts->stderr_mode;
+	child_arg.stderr_pipefd = stderr_pipe[1];
+	child_arg.new_process_group = opts->new_process_group;
+	child_arg.new_session = opts->new_session;
+	child_arg.cwd = opts->cwd;
+	child_arg.rlimits = opts->rlimits;
+	child_arg.rlimits_count = opts->rlimits_count;
+	child_arg.cpu_affinity = opts->cpu_affinity;
+	child_arg.cpu_affinity_size = opts->cpu_affinity_size;
+	child_arg.trampoline = popen_noshell_get_trampoline();
+	child_arg.file = file;
+	child_arg.argv = argv;
+	child_arg.envp = opts->envp;
+	child_arg.dev_null_fd = -1;
+	child_arg.sigmask = NULL;
+	child_arg.sighand_cleared = 0;
+	child_arg.close_fds = opts->close_fds;
+	child_arg.keep_fds = opts->keep_fds;
+	child_arg.keep_fds_count = opts->keep_fds_count;
+	// only a clone()'d or vfork()'d child shares our memory, and only until exec(), which we wait for
+#ifndef POPEN_NOSHELL_VALGRIND_DEBUG
+	shared = (opts->mode == POPEN_NOSHELL_MODE_CLONE || opts->mode == POPEN_NOSHELL_MODE_VFORK);
+#else
+	shared = (opts->mode == POPEN_NOSHELL_MODE_CLONE); // Valgrind turns vfork() into fork()
+#endif
+	child_arg.trace_ns = (pclose_arg->tracer && shared ? child_trace_ns : NULL);
+	child_arg.errpipe_fd = errpipe[1];
+	child_arg.child_stage = POPEN_NOSHELL_CHILD_OK;
+	child_arg.child_errno = 0;
+	if (opts->ctx) {
+		child_arg.dev_null_fd = opts->ctx->dev_null_fd;
+		child_arg.file = _popen_noshell_ctx_resolve(opts->ctx, file);
+	}
+
+	if (!_POPEN_NOSHELL_BY_POSIX_SPAWN(opts->mode) && !opts->no_signal_mask) { // posix_spawn() does this by itself
+		_popen_noshell_block_signals(&parent_sigmask);
+		child_arg.sigmask = &parent_sigmask;
+		child_arg.sighand_cleared = 1; // try to get this done by the kernel, see _popen_noshell_clone()
+	}
+	*stage = POPEN_NOSHELL_STAGE_SPAWN;
+	pid = _popen_noshell_spawn(&child_arg, pclose_arg, opts);
+	saved_errno = errno;
+	if (errpipe[0] >= 0) {
+		if (pid != -1) {
+			_popen_noshell_read_child_report(errpipe, &child_arg);
+		} else {
+			close(errpipe[0]);
+			close(errpipe[1]);
+		}
+	}
+	if (child_arg.sigmask) {
+		_popen_noshell_restore_signals(&parent_sigmask);
+	}
+	if (pid == -1) {
+		errno = saved_errno;
+		goto fail;
+	}
+
+	/* parent process */
+
+	if (child_arg.child_stage != POPEN_NOSHELL_CHILD_OK) { // the child failed and exits right away; reap it and fail fast
+		_POPEN_NOSHELL_STAT_ADD(opts->mode, exec_failures, 1);
+		while (waitpid(pid, NULL, __WALL) == -1 && errno == EINTR);
+		if (_POPEN_NOSHELL_SHARES_MEMORY(opts->mode)) {
+			_popen_noshell_warn_child_error(&child_arg);
+		}
+		pclose_arg->child_stage = child_arg.child_stage;
+		errno = child_arg.child_errno;
+		goto fail;
+	}
+
+	*stage = POPEN_NOSHELL_STAGE_FDOPEN;
+	pclose_arg->pid = pid;
+	if (pclose_arg->tracer) {
+		for (i = 0; i < 3; ++i) {
+			if (child_trace_ns[i]) _popen_noshell_trace(pclose_arg, POPEN_NOSHELL_PHASE_CHILD_START + i, child_trace_ns[i]);
+		}
+	}
+	_POPEN_NOSHELL_TRACE(spawned, POPEN_NOSHELL_PHASE_SPAWNED, pclose_arg);
+	if (opts->new_process_group && !opts->new_session) { // setsid() of the child would fail in the new process group
+		// the child does the same, whoever comes first wins; this fails with EACCES after the child did exec(), which is fine
+		setpgid(pid, pid);
+	}
+	if (opts->timeout_ms || opts->idle_timeout_ms) {
+		_popen_noshell_open_pidfd(pclose_arg);
+	}
+
+	i = (read_pipe ? 1/*write*/ : 0/*read*/); // the end which only the child uses
+	if (close(pipefd[i]) != 0) {
+		pipefd[i] = -1; // Linux releases the fd even then
+		goto fail_child;
+	}
+	pipefd[i] = -1;
+	if (stderr_pipe[1] >= 0) {
+		close(stderr_pipe[1]); // or we would never see EOF
+		stderr_pipe[1] = -1;
+	}
+	if (read_pipe) {
+		fp = fdopen(pipefd[0/*read*/], "r");
+	} else { // write_pipe
+		fp = fdopen(pipefd[1/*write*/], "w");
+	}
+	if (fp == NULL) {
+		goto fail_child; // fdopen() failed
+	}
+
+	pclose_arg->fp = fp;
+	pclose_arg->stderr_fd = stderr_pipe[0];
+	_POPEN_NOSHELL_TRACE(return, POPEN_NOSHELL_PHASE_RETURN, pclose_arg);
+	
+	return fp;
+
+	/*
+	 * Every failure releases whatever was allocated until then, so that a spawn storm which hits RLIMIT_NPROC,
+	 * RLIMIT_NOFILE or ENOMEM leaks nothing. A child which was started already is killed: nobody could talk to it.
+	 */
+fail_child:
+	saved_errno = errno;
+	kill(pid, SIGKILL);
+	while (waitpid(pid, NULL, __WALL) == -1 && errno == EINTR);
+	if (pclose_arg->pidfd >= 0) {
+		close(pclose_arg->pidfd);
+		pclose_arg->pidfd = -1;
+	}
+	errno = saved_errno;
+fail:
+	saved_errno = errno;
+	if (pipefd[0] >= 0) close(pipefd[0]);
+	if (pipefd[1] >= 0) close(pipefd[1]);
+	if (stderr_pipe[0] >= 0) close(stderr_pipe[0]);
+	if (stderr_pipe[1] >= 0) close(stderr_pipe[1]);
+	if (pclose_arg->free_clone_mem) {
+		free(pclose_arg->stack);
+		_pclose_noshell_free_clone_arg_memory(pclose_arg->func_args);
+		pclose_arg->free_clone_mem = 0;
+	}
+	pclose_arg->pid = 0;
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Fire and forget: starts "file" with "argv" in the background, and nobody has to reap it, nor to read from it.
+ * The spawn goes through a short-lived intermediate process: it is clone()'d with CLONE_VM | CLONE_VFORK like any child,
+ * it runs popen_noshell_ex() to start the command, and exits right away. We reap it at once, and the command is
+ * re-parented to init, which reaps it in the end. So the disposition of SIGCHLD stays as it is, and the cost is one
+ * more clone() of a process which shares our memory.
+ *
+ * The STDIN of the command is at EOF, and its STDOUT is /dev/null. "opts" are the same as for popen_noshell_ex(), except that
+ * "stderr_mode" 3 and the deadlines make no sense here. If the process is a subreaper (PR_SET_CHILD_SUBREAPER),
+ * the command is re-parented to us instead, so run a reaper then, see popen_noshell_reaper_start().
+ *
+ * The intermediate runs on the thread state of the caller, which sleeps meanwhile: its TLS, errno and malloc() caches.
+ * That is fine for the spawns which share our memory or use posix_spawn(), but not for a fork() there, so
+ * POPEN_NOSHELL_MODE_FORK and _TRAMPOLINE fail with EINVAL; POPEN_NOSHELL_MODE_AUTO uses _POSIX_SPAWN instead of _FORK.
+ * The "reaper" and "admission" options fail with EINVAL too: the command is not our child, so a reaper would never
+ * see it, and it would never leave the in-flight count of an admission.
+ *
+ * "pid" may be NULL; else the PID of the command is stored there, which may belong to another process after it exited.
+ * Returns -1 on error, "errno" is set appropriately, e.g. ENOENT for no such executable, or EINTR if a signal killed the
+ * intermediate before it started the command; once the command runs, this succeeds.
+ */
+// popen_noshell_ex() itself; the intermediate gets this on top of the stack of a regular child, because a vfork()'d
+// command runs the setup of the child and the PATH search of execvp() on the stack of the intermediate
+#define POPEN_NOSHELL_DETACHED_STACK_SIZE 64*1024
+
+struct _popen_noshell_detached_arg {
+	const char *file;
+	const char * const *argv;
+	const struct popen_noshell_options *opts;
+	const sigset_t *sigmask;
+	int sighand_cleared;
+	int report_fd;
+};
+
+struct _popen_noshell_detached_report {
+	pid_t pid;
+	int error;
+	int stage; /* POPEN_NOSHELL_STAGE_* */
+};
+
+// the intermediate process; it shares our memory, and the thread which spawned it waits until it exits
+int _popen_noshell_detached_intermediate(void *raw_arg) {
+	struct _popen_noshell_detached_arg *arg = (struct _popen_noshell_detached_arg *)raw_arg;
+	struct _popen_noshell_detached_report report;
+	struct popen_noshell_pass_to_pclose pclose_arg;
+	ssize_t ret;
+	FILE *fp;
+
+	// no handler of the parent may run here; then the spawn of the command blocks the signals itself
+	_popen_noshell_child_reset_signals(arg->sigmask, arg->sighand_cleared);
+
+	memset(&report, 0, sizeof(report));
+	fp = _popen_noshell_ex(arg->file, arg->argv, "w", &pclose_arg, arg->opts, &report.stage);
+	if (fp) {
+		report.pid = pclose_arg.pid;
+	} else {
+		report.error = errno;
+	}
+	// before the cleanup: the command runs, so the caller must learn its PID even if we get killed from now on
+	ret = write(arg->report_fd, &report, sizeof(report));
+	if (fp) {
+		fclose(fp); // the STDIN of the command gets EOF, like /dev/null
+		if (pclose_arg.free_clone_mem) { // our memory is that of the parent
+			free(pclose_arg.stack);
+			_pclose_noshell_free_clone_arg_memory(pclose_arg.func_args);
+		}
+	}
+	return (ret == sizeof(report) ? 0 : 1);
+}
+
+int popen_noshell_spawn_detached(const char *file, const char * const *argv, const struct popen_noshell_options *opts, pid_t *pid) {
+	struct _popen_noshell_detached_arg arg;
+	struct _popen_noshell_detached_report report;
+	struct popen_noshell_options resolved;
+	sigset_t parent_sigmask;
+	int report_pipe[2];
+	int valid_mode;
+	int64_t start;
+	size_t stack_size;
+	void *stack;
+	pid_t intermediate;
+	ssize_t ret;
+	int saved_errno;
+
+	if (opts->mode == POPEN_NOSHELL_MODE_AUTO) {
+		resolved = *opts;
+		resolved.mode = _popen_noshell_auto_resolve();
+		if (resolved.mode == POPEN_NOSHELL_MODE_FORK) resolved.mode = POPEN_NOSHELL_MODE_POSIX_SPAWN;
+		opts = &resolved;
+	}
+	valid_mode = (opts->mode >= POPEN_NOSHELL_MODE_CLONE && opts->mode < POPEN_NOSHELL_MODES);
+	if (opts->stderr_mode == 3 || opts->timeout_ms || opts->idle_timeout_ms) {
+		errno = EINVAL; // nobody would read the pipe, or wait for the deadlines
+		return -1;
+	}
+	if (opts->mode == POPEN_NOSHELL_MODE_FORK || opts->mode == POPEN_NOSHELL_MODE_TRAMPOLINE || opts->reaper || opts->admission) {
+		errno = EINVAL; // see above
+		return -1;
+	}
+
+	start = _popen_noshell_now_ns();
+	memset(&report, 0, sizeof(report));
+	report.stage = POPEN_NOSHELL_STAGE_SPAWN;
+	if (pipe2(report_pipe, O_CLOEXEC) != 0) {
+		report.stage = POPEN_NOSHELL_STAGE_PIPE;
+		goto fail;
+	}
+	stack_size = (opts->stack_size ? opts->stack_size : POPEN_NOSHELL_STACK_SIZE) + POPEN_NOSHELL_DETACHED_STACK_SIZE;
+	stack = malloc(stack_size + 15);
+	if (!stack) {
+		close(report_pipe[0]);
+		close(report_pipe[1]);
+		goto fail;
+	}
+
+	arg.file = file;
+	arg.argv = argv;
+	arg.opts = opts;
+	arg.report_fd = report_pipe[1];
+	_popen_noshell_block_signals(&parent_sigmask);
+	arg.sigmask = &parent_sigmask;
+	arg.sighand_cleared = 1;
+	intermediate = _popen_noshell_clone(&_popen_noshell_detached_intermediate, &arg, stack, stack_size, &arg.sighand_cleared);
+	saved_errno = errno;
+	_popen_noshell_restore_signals(&parent_sigmask);
+	close(report_pipe[1]);
+	if (intermediate == -1) {
+		free(stack);
+		close(report_pipe[0]);
+		errno = saved_errno;
+		goto fail;
+	}
+
+	// thanks to CLONE_VFORK, the intermediate exited already; a reaper may have reaped it, hence no check for ECHILD
+	while (waitpid(intermediate, NULL, __WALL) == -1 && errno == EINTR);
+	free(stack);
+	do {
+		ret = read(report_pipe[0], &report, sizeof(report));
+	} while (ret < 0 && errno == EINTR);
+	close(report_pipe[0]);
+	if (ret != sizeof(report)) { // a signal killed the intermediate before it started the command
+		report.stage = POPEN_NOSHELL_STAGE_SPAWN;
+		errno = EINTR;
+		goto fail;
+	}
+	if (report.error) {
+		errno = report.error;
+		goto fail;
+	}
+
+	if (pid) *pid = report.pid;
+	_POPEN_NOSHELL_STAT_ADD(opts->mode, spawns, 1);
+	_POPEN_NOSHELL_STAT_ADD(opts->mode, spawn_ns, _popen_noshell_now_ns() - start);
+	if (opts->ctx) {
+		++opts->ctx->stats.spawns;
+		opts->ctx->stats.spawn_ns += _popen_noshell_now_ns() - start;
+	}
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (valid_mode) {
+		_POPEN_NOSHELL_STAT_ADD(opts->mode, failures[report.stage], 1);
+	}
+	if (opts->ctx) {
+		++opts->ctx->stats.failures;
+	}
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * The reaper: a background thread which reaps all children of the process in batches, by wait4(-1, WNOHANG) in a loop,
+ * and keeps the exit status of each child spawned through it until pclose_noshell() takes it. So a child whose handle is
+ * dropped without pclose_noshell() leaves no zombie, and a storm of exits costs a few sweeps instead of a blocking
+ * waitpid() per child. The thread sleeps in epoll_wait() on a pidfd per child; on kernels without pidfds, and with
+ * "subreaper" for the grandchildren which are re-parented to us, it also sweeps every POPEN_NOSHELL_REAPER_SWEEP_MS.
+ *
+ * It reaps every child of the process, so while it runs, all popen_noshell_ex() calls must pass it in
+ * "popen_noshell_options.reaper", and nothing else may wait for its own children, e.g. system().
+ * The status of a child which is never pclose_noshell()'d stays in the table until popen_noshell_reaper_stop().
+ *
+ * With "subreaper", PR_SET_CHILD_SUBREAPER is set for the process until popen_noshell_reaper_stop().
+ * Stop the reaper after the last pclose_noshell() of its children.
+ *
+ * Returns -1 on error, "errno" is set appropriately.
+ */
+#define POPEN_NOSHELL_REAPER_SWEEP_MS 100
+
+// the slot of "pid", or the empty slot where it would go
+struct popen_noshell_reaper_entry *_popen_noshell_reaper_slot(struct popen_noshell_reaper *reaper, pid_t pid) {
+	int mask = reaper->table_size - 1;
+	int i = (int)(((uint32_t)pid * 2654435761U) & mask);
+
+	while (reaper->table[i].pid && reaper->table[i].pid != pid) {
+		i = (i + 1) & mask;
+	}
+	return &reaper->table[i];
+}
+
+// backward-shift deletion, so that linear probing needs no tombstones
+void _popen_noshell_reaper_delete(struct popen_noshell_reaper *reaper, struct popen_noshell_reaper_entry *entry) {
+	int mask = reaper->table_size - 1;
+	int i = (int)(entry - reaper->table);
+	int j = i, home;
+
+	while (1) {
+		j = (j + 1) & mask;
+		if (!reaper->table[j].pid) break;
+		home = (int)(((uint32_t)reaper->table[j].pid * 2654435761U) & mask);
+		if (((j - home) & mask) >= ((j - i) & mask)) { // "j" may move back to "i"
+			reaper->table[i] = reaper->table[j];
+			i = j;
+		}
+	}
+	reaper->table[i].pid = 0;
+	--reaper->table_count;
+}
+
+// keeps the load factor at most 1/2, counting the spawns in progress; called under "lock"
+int _popen_noshell_reaper_reserve(struct popen_noshell_reaper *reaper) {
+	struct popen_noshell_reaper_entry *old = reaper->table, *entry;
+	int old_size = reaper->table_size;
+	int size = (old_size ? old_size : 64);
+	int i;
+
+	while ((reaper->table_count + reaper->reserved + 1) * 2 > size) size *= 2;
+	if (size != old_size) {
+		reaper->table = (struct popen_noshell_reaper_entry *)calloc(size, sizeof(struct popen_noshell_reaper_entry));
+		if (!reaper->table) {
+			reaper->table = old;
+			return -1;
+		}
+		reaper->table_size = size;
+		for (i = 0; i < old_size; ++i) {
+			if (!old[i].pid) continue;
+			entry = _popen_noshell_reaper_slot(reaper, old[i].pid);
+			*entry = old[i];
+		}
+		free(old);
+	}
+	++reaper->reserved;
+	return 0;
+}
+
+// reaps whatever exited; the spawns are held off meanwhile, so each child is in the table before it can be reaped here
+void _popen_noshell_reaper_sweep(struct popen_noshell_reaper *reaper) {
+	struct popen_noshell_reaper_entry *entry;
+	struct rusage usage;
+	int status, count = 0;
+	pid_t pid;
+
+	pthread_rwlock_wrlock(&reaper->reaping);
+	pthread_mutex_lock(&reaper->lock);
+	while ((pid = wait4(-1, &status, __WALL | WNOHANG, &usage)) > 0) {
+		++count;
+		entry = _popen_noshell_reaper_slot(reaper, pid);
+		if (!entry->pid) {
+			++reaper->orphans;
+			continue;
+		}
+		entry->reaped = 1;
+		entry->status = status;
+		entry->usage = usage;
+		if (entry->pidfd >= 0) { // which also removes it from the epoll
+			close(entry->pidfd);
+			entry->pidfd = -1;
+		}
+	}
+	if (count) {
+		reaper->reaped += count;
+		++reaper->batches;
+		pthread_cond_broadcast(&reaper->reaped_cond);
+	}
+	pthread_mutex_unlock(&reaper->lock);
+	pthread_rwlock_unlock(&reaper->reaping);
+}
+
+void *_popen_noshell_reaper_thread(void *data) {
+	struct popen_noshell_reaper *reaper = (struct popen_noshell_reaper *)data;
+	struct epoll_event events[64];
+	uint64_t count;
+	int i, ret, timeout, stopped;
+
+	while (1) {
+		pthread_mutex_lock(&reaper->lock);
+		timeout = (reaper->subreaper || reaper->no_pidfd ? POPEN_NOSHELL_REAPER_SWEEP_MS : -1);
+		stopped = reaper->stopped;
+		pthread_mutex_unlock(&reaper->lock);
+		if (stopped) return NULL;
+
+		ret = epoll_wait(reaper->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+		if (ret < 0 && errno != EINTR) {
+			warn("epoll_wait(reaper)");
+		}
+		for (i = 0; i < ret; ++i) {
+			if (!events[i].data.ptr) { // the "event_fd": stop, or a new timeout
+				if (read(reaper->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) warn("read(reaper eventfd)");
+			}
+		}
+		_popen_noshell_reaper_sweep(reaper);
+	}
+}
+
+void _popen_noshell_reaper_wake(struct popen_noshell_reaper *reaper) {
+	uint64_t one = 1;
+
+	if (write(reaper->event_fd, &one, sizeof(one)) != sizeof(one)) {
+		warn("write(reaper eventfd)");
+	}
+}
+
+int popen_noshell_reaper_start(struct popen_noshell_reaper *reaper, int subreaper) {
+	struct epoll_event ev;
+	pthread_rwlockattr_t attr;
+	pthread_condattr_t cond_attr;
+	sigset_t all, old;
+	int ret;
+
+	memset(reaper, 0, sizeof(struct popen_noshell_reaper));
+	reaper->subreaper = subreaper;
+	reaper->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	reaper->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (reaper->epoll_fd < 0 || reaper->event_fd < 0) {
+		ret = errno;
+		goto fail;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(reaper->epoll_fd, EPOLL_CTL_ADD, reaper->event_fd, &ev) != 0) {
+		ret = errno;
+		goto fail;
+	}
+
+	if ((ret = pthread_mutex_init(&reaper->lock, NULL)) != 0) goto fail;
+	if ((ret = pthread_condattr_init(&cond_attr)) != 0) goto fail_mutex;
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC); // for the deadlines of _popen_noshell_reaper_sleep()
+	ret = pthread_cond_init(&reaper->reaped_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	if (ret != 0) goto fail_mutex;
+	// or a steady stream of spawns would keep the sweeps out
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	ret = pthread_rwlock_init(&reaper->reaping, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (ret != 0) goto fail_cond;
+
+	if (subreaper) {
+		if (prctl(PR_GET_CHILD_SUBREAPER, &reaper->prev_subreaper) != 0 || prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+			ret = errno;
+			goto fail_rwlock;
+		}
+	}
+
+	// the signals of the process are not for this thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&reaper->thread, NULL, _popen_noshell_reaper_thread, reaper);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret == 0) return 0;
+
+	if (subreaper) prctl(PR_SET_CHILD_SUBREAPER, reaper->prev_subreaper);
+fail_rwlock:
+	pthread_rwlock_destroy(&reaper->reaping);
+fail_cond:
+	pthread_cond_destroy(&reaper->reaped_cond);
+fail_mutex:
+	pthread_mutex_destroy(&reaper->lock);
+fail:
+	if (reaper->epoll_fd >= 0) close(reaper->epoll_fd);
+	if (reaper->event_fd >= 0) close(reaper->event_fd);
+	reaper->epoll_fd = reaper->event_fd = -1;
+	errno = ret;
+	return -1;
+}
+
+/*
+ * The pending pclose_noshell() calls get the statuses of the final sweep, or wait4() for their child themselves.
+ * "lock" and "reaped_cond" are not destroyed, so that a pclose_noshell() after this can still tell that the reaper is gone;
+ * they hold no resources, and popen_noshell_reaper_start() initializes them again.
+ */
+void popen_noshell_reaper_stop(struct popen_noshell_reaper *reaper) {
+	int i;
+
+	pthread_mutex_lock(&reaper->lock);
+	reaper->stopped = 1;
+	pthread_mutex_unlock(&reaper->lock);
+	_popen_noshell_reaper_wake(reaper);
+	pthread_join(reaper->thread, NULL);
+	_popen_noshell_reaper_sweep(reaper); // what exited meanwhile
+
+	pthread_mutex_lock(&reaper->lock);
+	reaper->stopped = 2; // nobody reaps for the waiters any more
+	pthread_cond_broadcast(&reaper->reaped_cond);
+	while (reaper->waiters) { // they still look at the table
+		pthread_cond_wait(&reaper->reaped_cond, &reaper->lock);
+	}
+	pthread_mutex_unlock(&reaper->lock);
+
+	if (reaper->subreaper && prctl(PR_SET_CHILD_SUBREAPER, reaper->prev_subreaper) != 0) {
+		warn("prctl(PR_SET_CHILD_SUBREAPER)");
+	}
+
+	for (i = 0; i < reaper->table_size; ++i) {
+		if (reaper->table[i].pid && reaper->table[i].pidfd >= 0) close(reaper->table[i].pidfd);
+	}
+	free(reaper->table);
+	reaper->table = NULL;
+	reaper->table_size = reaper->table_count = 0;
+	close(reaper->epoll_fd);
+	close(reaper->event_fd);
+	reaper->epoll_fd = reaper->event_fd = -1;
+	pthread_rwlock_destroy(&reaper->reaping);
+}
+
+// _popen_noshell_ex() which puts the child into the table of "opts->reaper" before the reaper may reap it
+FILE *_popen_noshell_ex_reaped(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg,
+	const struct popen_noshell_options *opts, int *stage
+) {
+	struct popen_noshell_reaper *reaper = opts->reaper;
+	struct popen_noshell_reaper_entry *entry;
+	struct epoll_event ev;
+	int saved_errno, wake = 0;
+	FILE *fp;
+
+	if (!reaper) return _popen_noshell_ex(file, argv, type, pclose_arg, opts, stage);
+
+	pthread_mutex_lock(&reaper->lock);
+	if (_popen_noshell_reaper_reserve(reaper) != 0) {
+		pthread_mutex_unlock(&reaper->lock);
+		memset(pclose_arg, 0, sizeof(struct popen_noshell_pass_to_pclose));
+		pclose_arg->pidfd = -1;
+		pclose_arg->stderr_fd = -1;
+		*stage = POPEN_NOSHELL_STAGE_SPAWN;
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_unlock(&reaper->lock);
+
+	pthread_rwlock_rdlock(&reaper->reaping);
+	fp = _popen_noshell_ex(file, argv, type, pclose_arg, opts, stage);
+	saved_errno = errno;
+	pthread_mutex_lock(&reaper->lock);
+	--reaper->reserved;
+	if (fp) {
+		entry = _popen_noshell_reaper_slot(reaper, pclose_arg->pid);
+		memset(entry, 0, sizeof(struct popen_noshell_reaper_entry));
+		entry->pid = pclose_arg->pid;
+		entry->pidfd = -1;
+#ifdef SYS_pidfd_open
+		entry->pidfd = syscall(SYS_pidfd_open, pclose_arg->pid, 0);
+#endif
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = entry; // anything but NULL; the sweep finds the children by wait4()
+		if (entry->pidfd < 0 || epoll_ctl(reaper->epoll_fd, EPOLL_CTL_ADD, entry->pidfd, &ev) != 0) {
+			if (entry->pidfd >= 0) close(entry->pidfd);
+			entry->pidfd = -1;
+			wake = !reaper->no_pidfd && !reaper->subreaper; // the thread may sleep without a timeout
+			reaper->no_pidfd = 1;
+		}
+		++reaper->table_count;
+		pclose_arg->reaper = reaper;
+	}
+	pthread_mutex_unlock(&reaper->lock);
+	pthread_rwlock_unlock(&reaper->reaping);
+
+	if (wake) _popen_noshell_reaper_wake(reaper);
+	errno = saved_errno;
+	return fp;
+}
+
+// wait4() for a child of a reaper; the reaper does the actual wait4(), and this waits for it
+pid_t _popen_noshell_reaper_wait(struct popen_noshell_reaper *reaper, pid_t pid, int *status, int options, struct rusage *usage) {
+	struct popen_noshell_reaper_entry *entry;
+	pid_t ret = pid;
+
+	pthread_mutex_lock(&reaper->lock);
+	if (reaper->stopped == 2) { // pclose_noshell() after popen_noshell_reaper_stop(); the status may be lost already
+		pthread_mutex_unlock(&reaper->lock);
+		return wait4(pid, status, options | __WALL, usage);
+	}
+	++reaper->waiters;
+	entry = _popen_noshell_reaper_slot(reaper, pid);
+	while (entry->pid && !entry->reaped && reaper->stopped != 2) {
+		if (options & WNOHANG) {
+			ret = 0;
+			goto out;
+		}
+		pthread_cond_wait(&reaper->reaped_cond, &reaper->lock);
+		entry = _popen_noshell_reaper_slot(reaper, pid); // the table may have grown
+	}
+	if (!entry->pid) {
+		errno = ECHILD;
+		ret = -1;
+	} else if (!entry->reaped) { // the reaper stopped before our child exited, so it is ours to reap
+		ret = -2;
+	} else {
+		*status = entry->status;
+		if (usage) *usage = entry->usage;
+		_popen_noshell_reaper_delete(reaper, entry);
+	}
+out:
+	if (--reaper->waiters == 0 && reaper->stopped == 2) {
+		pthread_cond_broadcast(&reaper->reaped_cond); // popen_noshell_reaper_stop() waits for this
+	}
+	pthread_mutex_unlock(&reaper->lock);
+	if (ret == -2) {
+		return wait4(pid, status, options | __WALL, usage);
+	}
+	return ret;
+}
+
+/*
+ * Sleeps until the reaper reaped "pid", or until "due_ns" of CLOCK_MONOTONIC; the pidfd of the child is no use for
+ * this, because it becomes readable when the child exits, which is before the thread reaps it.
+ * Returns -1 if the reaper is stopped, so that the caller waits for the child by itself.
+ */
+int _popen_noshell_reaper_sleep(struct popen_noshell_reaper *reaper, pid_t pid, int64_t due_ns) {
+	struct popen_noshell_reaper_entry *entry;
+	struct timespec ts;
+
+	pthread_mutex_lock(&reaper->lock);
+	if (reaper->stopped == 2) {
+		pthread_mutex_unlock(&reaper->lock);
+		return -1;
+	}
+	entry = _popen_noshell_reaper_slot(reaper, pid);
+	if (entry->pid && !entry->reaped) {
+		ts.tv_sec = due_ns / 1000000000;
+		ts.tv_nsec = due_ns % 1000000000;
+		pthread_cond_timedwait(&reaper->reaped_cond, &reaper->lock, &ts);
+	}
+	pthread_mutex_unlock(&reaper->lock);
+	return 0;
+}
+
+// popen_noshell_kill() of a child of a reaper; the lock keeps the thread from reaping it while we signal
+int _popen_noshell_reaper_kill(struct popen_noshell_reaper *reaper, pid_t pid, pid_t target, int sig) {
+	struct popen_noshell_reaper_entry *entry;
+	int ret, saved_errno;
+
+	pthread_mutex_lock(&reaper->lock);
+	if (reaper->stopped != 2) { // afterwards, the child is reaped by pclose_noshell() itself
+		entry = _popen_noshell_reaper_slot(reaper, pid);
+		if (!entry->pid || entry->reaped) { // its PID may belong to another process already
+			pthread_mutex_unlock(&reaper->lock);
+			errno = ESRCH;
+			return -1;
+		}
+	}
+	ret = kill(target, sig);
+	saved_errno = errno;
+	pthread_mutex_unlock(&reaper->lock);
+	errno = saved_errno;
+	return ret;
+}
+
+/*
+ * Admission control: during a spawn storm, popen_noshell_ex() waits for its turn instead of failing halfway with
+ * EAGAIN, EMFILE or ENOMEM. It is shared by all threads which pass it in "popen_noshell_options.admission":
+ *	max_in_flight: the spawns queue up until pclose_noshell() reaps a child of another one
+ *	min_free_fds: the spawns back off while the process is short of fds
+ *	max_memory_pressure: the spawns back off while the PSI memory pressure is above this
+ * A spawn which still fails with one of those errors is tried again after a backoff. After "max_wait_ms" of
+ * waiting in total, popen_noshell_ex() fails with EAGAIN, or with the error of its last try.
+ *
+ * Initialize it by popen_noshell_admission_init(), then set the limits. Destroy it when no spawns use it any more.
+ * Returns -1 on error, "errno" is set appropriately.
+ */
+int popen_noshell_admission_init(struct popen_noshell_admission *adm) {
+	pthread_condattr_t attr;
+	int ret;
+
+	memset(adm, 0, sizeof(struct popen_noshell_admission));
+	adm->max_wait_ms = -1;
+	adm->backoff_ms = 1;
+	adm->psi_fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC); // Linux 4.20+ with CONFIG_PSI
+
+	if ((ret = pthread_condattr_init(&attr)) != 0 ||
+		(ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) != 0 ||
+		(ret = pthread_cond_init(&adm->released, &attr)) != 0
+	) {
+		if (adm->psi_fd >= 0) close(adm->psi_fd);
+		errno = ret;
+		return -1;
+	}
+	pthread_condattr_destroy(&attr);
+	if ((ret = pthread_mutex_init(&adm->lock, NULL)) != 0) {
+		pthread_cond_destroy(&adm->released);
+		if (adm->psi_fd >= 0) close(adm->psi_fd);
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+void popen_noshell_admission_destroy(struct popen_noshell_admission *adm) {
+	pthread_mutex_destroy(&adm->lock);
+	pthread_cond_destroy(&adm->released);
+	if (adm->psi_fd >= 0) close(adm->psi_fd);
+	adm->psi_fd = -1;
+}
+
+// the number of open fds of the process; -1 if unknown
+long _popen_noshell_count_fds() {
+	struct dirent *de;
+	struct stat st;
+	long count = 0;
+	DIR *dir;
+
+	if (stat("/proc/self/fd", &st) == 0 && st.st_size > 0) { // Linux 6.2+ reports the count as the size
+		return st.st_size;
+	}
+	dir = opendir("/proc/self/fd");
+	if (!dir) return -1;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] != '.') ++count;
+	}
+	closedir(dir);
+	return count - 1; // the fd of "dir" itself
+}
+
+// the "some avg10" of the PSI memory pressure, in percent; -1 if unknown
+double _popen_noshell_memory_pressure(int psi_fd) {
+	char buf[256];
+	double avg10;
+	ssize_t len;
+
+	len = pread(psi_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) return -1;
+	buf[len] = '\0';
+	if (sscanf(buf, "some avg10=%lf", &avg10) != 1) return -1;
+	return avg10;
+}
+
+// returns EMFILE or ENOMEM if that resource is short, else 0; call it with "adm->lock" held
+int _popen_noshell_admission_short_of(struct popen_noshell_admission *adm) {
+	int64_t now = _popen_noshell_now_ns();
+	struct rlimit rl;
+	long fds;
+
+	if (now - adm->checked_ns < 10000000) return adm->short_of; // /proc is not free, and the values change slowly
+	adm->checked_ns = now;
+	adm->short_of = 0;
+
+	if (adm->min_free_fds > 0 && getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		fds = _popen_noshell_count_fds();
+		if (fds >= 0 && (long)rl.rlim_cur - fds < adm->min_free_fds) {
+			adm->short_of = EMFILE;
+		}
+	}
+	if (!adm->short_of && adm->max_memory_pressure > 0 && adm->psi_fd >= 0 &&
+		_popen_noshell_memory_pressure(adm->psi_fd) >= adm->max_memory_pressure
+	) {
+		adm->short_of = ENOMEM;
+	}
+
+	return adm->short_of;
+}
+
+// sleeps for "*backoff_ms" but not beyond "deadline_ns" (0 for none), and doubles "*backoff_ms" for the next time
+void _popen_noshell_backoff(const struct popen_noshell_admission *adm, int *backoff_ms, int64_t deadline_ns) {
+	int64_t ns = (int64_t)*backoff_ms * 1000000;
+	struct timespec ts;
+
+	if (deadline_ns && deadline_ns - _popen_noshell_now_ns() < ns) {
+		ns = deadline_ns - _popen_noshell_now_ns();
+	}
+	if (ns > 0) {
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		nanosleep(&ts, NULL);
+	}
+	if (*backoff_ms < (adm->backoff_ms > 0 ? adm->backoff_ms : 1) * 64) {
+		*backoff_ms *= 2;
+	}
+}
+
+// takes a slot; returns -1 with EAGAIN if "deadline_ns" (0 for none) passed first
+int _popen_noshell_admit(struct popen_noshell_admission *adm, int64_t deadline_ns) {
+	int backoff_ms = (adm->backoff_ms > 0 ? adm->backoff_ms : 1);
+	struct timespec ts;
+	int delayed = 0;
+
+	pthread_mutex_lock(&adm->lock);
+	while (1) {
+		if (adm->max_in_flight > 0 && adm->in_flight >= adm->max_in_flight) {
+			// queue up until pclose_noshell() releases a slot
+		} else if (_popen_noshell_admission_short_of(adm)) {
+			// back off, the resources are not freed by anything we could wait for
+		} else {
+			break;
+		}
+		if (deadline_ns && _popen_noshell_now_ns() >= deadline_ns) {
+			++adm->rejected;
+			pthread_mutex_unlock(&adm->lock);
+			errno = EAGAIN;
+			return -1;
+		}
+		delayed = 1;
+
+		if (adm->max_in_flight > 0 && adm->in_flight >= adm->max_in_flight) {
+			if (deadline_ns) {
+				ts.tv_sec = deadline_ns / 1000000000;
+				ts.tv_nsec = deadline_ns % 1000000000;
+				pthread_cond_timedwait(&adm->released, &adm->lock, &ts);
+			} else {
+				pthread_cond_wait(&adm->released, &adm->lock);
+			}
+		} else {
+			pthread_mutex_unlock(&adm->lock);
+			_popen_noshell_backoff(adm, &backoff_ms, deadline_ns);
+			pthread_mutex_lock(&adm->lock);
+		}
+	}
+	++adm->in_flight;
+	++adm->admitted;
+	if (delayed) ++adm->delayed;
+	pthread_mutex_unlock(&adm->lock);
+
+	return 0;
+}
+
+void _popen_noshell_admission_release(struct popen_noshell_admission *adm) {
+	pthread_mutex_lock(&adm->lock);
+	--adm->in_flight;
+	pthread_cond_signal(&adm->released);
+	pthread_mutex_unlock(&adm->lock);
+}
+
+// _popen_noshell_ex() under the admission control of "opts->admission", see popen_noshell_admission_init()
+FILE *_popen_noshell_ex_admitted(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg,
+	const struct popen_noshell_options *opts, int *stage
+) {
+	struct popen_noshell_admission *adm = opts->admission;
+	int64_t deadline_ns = 0;
+	int backoff_ms = (adm->backoff_ms > 0 ? adm->backoff_ms : 1);
+	int saved_errno;
+	FILE *fp;
+
+	if (adm->max_wait_ms >= 0) {
+		deadline_ns = _popen_noshell_now_ns() + (int64_t)adm->max_wait_ms * 1000000;
+	}
+	while (1) {
+		if (_popen_noshell_admit(adm, deadline_ns) != 0) {
+			memset(pclose_arg, 0, sizeof(struct popen_noshell_pass_to_pclose));
+			pclose_arg->pidfd = -1;
+			pclose_arg->stderr_fd = -1;
+			*stage = POPEN_NOSHELL_STAGE_SPAWN;
+			return NULL;
+		}
+		fp = _popen_noshell_ex_reaped(file, argv, type, pclose_arg, opts, stage);
+		if (fp) {
+			pclose_arg->admission = adm;
+			return fp;
+		}
+
+		saved_errno = errno;
+		_popen_noshell_admission_release(adm);
+		if ((saved_errno != EAGAIN && saved_errno != EMFILE && saved_errno != ENFILE && saved_errno != ENOMEM) ||
+			(deadline_ns && _popen_noshell_now_ns() >= deadline_ns)
+		) {
+			errno = saved_errno;
+			return NULL;
+		}
+		pthread_mutex_lock(&adm->lock);
+		++adm->retried;
+		pthread_mutex_unlock(&adm->lock);
+		_popen_noshell_backoff(adm, &backoff_ms, deadline_ns);
+	}
+}
+
+/*
+ * Pipe stream to or from process. Same as popen_noshell() but takes its settings from "opts".
+ *
+ * "opts" is initialized by popen_noshell_options_init() and then only the needed fields are changed:
+ *	mode: one of the POPEN_NOSHELL_MODE_* constants; unlike popen_noshell_set_fork_mode(), this is safe to vary between threads;
+ *		POPEN_NOSHELL_MODE_AUTO lets the library choose, see popen_noshell_auto_decision()
+ *	stderr_mode: the same as the "stderr_mode" argument of popen_noshell()
+ *	stack_size: the size of the stack which is allocated for the child in POPEN_NOSHELL_MODE_CLONE;
+ *		POPEN_NOSHELL_MODE_VFORK allocates none, as the child runs on the stack of the caller until its exec()
+ *	pipe_size: resize the pipe by F_SETPIPE_SZ, useful for children with a lot of output
+ *	envp: the environment of the child, a NULL-terminated array of "NAME=value" strings;
+ *		it is not copied, so other threads must not free it while popen_noshell_ex() runs
+ *	ctx: a spawn context of the calling thread, see popen_noshell_ctx_init()
+ *	no_signal_mask: don't block the signals around the spawn; only for benchmarking, see _popen_noshell_block_signals()
+ *	close_fds: the child inherits no fds except STDIN, STDOUT and STDERR, even if some fds of the parent lack O_CLOEXEC;
+ *		this is cheap even with hundreds of thousands of open fds, because close_range() does the job
+ *	keep_fds, keep_fds_count: with "close_fds", these fds are inherited anyway, and even if they have O_CLOEXEC;
+ *		the array is not copied, so it must stay valid while popen_noshell_ex() runs
+ *	argv_stable: in POPEN_NOSHELL_MODE_CLONE and _VFORK, "file" and "argv" are used in place instead of being copied for the child,
+ *		which saves the malloc() and strdup() per argument; other threads must not free or change them while popen_noshell_ex() runs
+ *	timeout_ms: the child may run at most that long; pclose_noshell() kills it when the time is up
+ *	idle_timeout_ms: the child is killed if no data passes through popen_noshell_read() / popen_noshell_write() for that long;
+ *		pclose_noshell() gives the child the same amount of time to exit
+ *	kill_grace_ms: when a deadline expires, SIGTERM is sent first and SIGKILL follows after that many milliseconds
+ *	new_process_group: the child becomes a process group leader and the signals are sent to the whole group,
+ *		so that grandchildren which keep our pipe open die too
+ *	new_session: setsid() in the child, so that it also loses our controlling terminal; implies "new_process_group"
+ *	cwd, rlimits, cpu_affinity: chdir(), setrlimit() and sched_setaffinity() in the child, in this order, after "close_fds";
+ *		POPEN_NOSHELL_MODE_POSIX_SPAWN cannot do these nor "new_session" and fails with ENOTSUP, use _TRAMPOLINE instead;
+ *		a failure is reported as POPEN_NOSHELL_CHILD_CWD, _RLIMIT or _AFFINITY in "pclose_arg->child_stage"
+ *	admission: wait for a free slot and for enough fds and memory instead of failing, see popen_noshell_admission_init()
+ *	reaper: a running reaper which reaps the child and keeps its status for pclose_noshell(), see popen_noshell_reaper_start()
+ *
+ * Deadlines are enforced by popen_noshell_read(), popen_noshell_write() and pclose_noshell().
+ * Use popen_noshell_timers_*() if you have many children and want a single timer for all of them.
+ */
+FILE *popen_noshell_ex(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg, const struct popen_noshell_options *opts) {
+	struct popen_noshell_options resolved;
+	struct popen_noshell_ctx *ctx = opts->ctx;
+	int valid_mode;
+	int64_t start, elapsed;
+	int stage, saved_errno;
+	FILE *fp;
+
+	if (opts->mode == POPEN_NOSHELL_MODE_AUTO) {
+		resolved = *opts;
+		resolved.mode = _popen_noshell_auto_resolve();
+		opts = &resolved;
+	}
+	valid_mode = (opts->mode >= POPEN_NOSHELL_MODE_CLONE && opts->mode < POPEN_NOSHELL_MODES);
+
+	start = _popen_noshell_now_ns();
+	if (opts->admission) {
+		fp = _popen_noshell_ex_admitted(file, argv, type, pclose_arg, opts, &stage);
+	} else {
+		fp = _popen_noshell_ex_reaped(file, argv, type, pclose_arg, opts, &stage);
+	}
+	elapsed = _popen_noshell_now_ns() - start;
+
+	if (fp) {
+		_POPEN_NOSHELL_STAT_ADD(opts->mode, spawns, 1);
+		_POPEN_NOSHELL_STAT_ADD(opts->mode, spawn_ns, elapsed);
+		_POPEN_NOSHELL_STAT_ADD(opts->mode, live_children, 1);
+		if (ctx) {
+			++ctx->stats.spawns;
+			ctx->stats.spawn_ns += elapsed;
+		}
+	} else {
+		saved_errno = errno;
+		if (valid_mode) {
+			_POPEN_NOSHELL_STAT_ADD(opts->mode, failures[stage], 1);
+		}
+		if (ctx) {
+			++ctx->stats.failures;
+		}
+		errno = saved_errno;
+	}
+	return fp;
+}
+
+/*
+ * A handle table: the records of the children live in the table instead of in structs of the caller, and they are
+ * addressed by 64-bit handles which carry the index of the record and its generation. The generation changes whenever
+ * a record is taken or released, so a stale handle, e.g. a second popen_noshell_handle_close(), fails with EBADF
+ * instead of touching a record which may belong to another child already.
+ *
+ * The records are allocated in chunks of POPEN_NOSHELL_HANDLES_PER_CHUNK and reused; they never move, so the pointer
+ * returned by popen_noshell_handle_get() stays valid until the handle is closed, e.g. for popen_noshell_timers_add().
+ * With "pool_ctx" set, the clone() spawns without a "ctx" in their options borrow a spawn context from a pool of the table,
+ * so that the stack and the argv copy are reused too, instead of being malloc()'d for each child. Mind what else
+ * a context does, see popen_noshell_ctx_init(): its PATH cache keeps finding a command which was removed or replaced
+ * until PATH changes, and the spawns count in its stats instead of in yours. The pool grows to the number of concurrent spawns.
+ *
+ * The table may be shared by many threads. Close all handles before popen_noshell_handles_destroy().
+ * Returns -1 on error, "errno" is set appropriately.
+ */
+int popen_noshell_handles_init(struct popen_noshell_handles *table) {
+	int ret;
+
+	memset(table, 0, sizeof(struct popen_noshell_handles));
+	table->free_head = -1;
+	if ((ret = pthread_mutex_init(&table->lock, NULL)) != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+void popen_noshell_handles_destroy(struct popen_noshell_handles *table) {
+	int i;
+
+	for (i = 0; i < table->ctx_pool_count; ++i) {
+		popen_noshell_ctx_destroy(table->ctx_pool[i]);
+		free(table->ctx_pool[i]);
+	}
+	free(table->ctx_pool);
+	for (i = 0; i < table->chunks_count; ++i) {
+		free(table->chunks[i]);
+	}
+	free(table->chunks);
+	pthread_mutex_destroy(&table->lock);
+	memset(table, 0, sizeof(struct popen_noshell_handles));
+	table->free_head = -1;
+}
+
+// the record of a live "handle", or NULL; called under "lock"
+struct popen_noshell_handle_record *_popen_noshell_handle_record(struct popen_noshell_handles *table, popen_noshell_handle handle) {
+	uint32_t index = (uint32_t)handle;
+	uint32_t generation = (uint32_t)(handle >> 32);
+	struct popen_noshell_handle_record *rec;
+
+	if (!(generation & 1) || index >= (uint32_t)table->chunks_count * POPEN_NOSHELL_HANDLES_PER_CHUNK) return NULL;
+	rec = &table->chunks[index / POPEN_NOSHELL_HANDLES_PER_CHUNK][index % POPEN_NOSHELL_HANDLES_PER_CHUNK];
+	return (rec->generation == generation && rec->published ? rec : NULL);
+}
+
+// a free record, taken out of the free list; called under "lock"
+int _popen_noshell_handle_take(struct popen_noshell_handles *table) {
+	struct popen_noshell_handle_record **chunks, *chunk;
+	int i, index;
+
+	if (table->free_head < 0) {
+		if ((table->chunks_count + 1) * (int64_t)POPEN_NOSHELL_HANDLES_PER_CHUNK > INT32_MAX) {
+			errno = EMFILE;
+			return -1;
+		}
+		chunks = (struct popen_noshell_handle_record **)realloc(table->chunks, sizeof(*chunks) * (table->chunks_count + 1));
+		if (!chunks) return -1;
+		table->chunks = chunks;
+		chunk = (struct popen_noshell_handle_record *)aligned_alloc(64, sizeof(*chunk) * POPEN_NOSHELL_HANDLES_PER_CHUNK);
+		if (!chunk) return -1;
+		memset(chunk, 0, sizeof(*chunk) * POPEN_NOSHELL_HANDLES_PER_CHUNK);
+		index = table->chunks_count * POPEN_NOSHELL_HANDLES_PER_CHUNK;
+		for (i = 0; i < POPEN_NOSHELL_HANDLES_PER_CHUNK; ++i) {
+			chunk[i].next_free = (i + 1 < POPEN_NOSHELL_HANDLES_PER_CHUNK ? index + i + 1 : -1);
+		}
+		table->chunks[table->chunks_count++] = chunk;
+		table->free_head = index;
+	}
+
+	index = table->free_head;
+	table->free_head = table->chunks[index / POPEN_NOSHELL_HANDLES_PER_CHUNK][index % POPEN_NOSHELL_HANDLES_PER_CHUNK].next_free;
+	return index;
+}
+
+// back to the free list with a new generation; called under "lock"
+void _popen_noshell_handle_release(struct popen_noshell_handles *table, int index) {
+	struct popen_noshell_handle_record *rec = &table->chunks[index / POPEN_NOSHELL_HANDLES_PER_CHUNK][index % POPEN_NOSHELL_HANDLES_PER_CHUNK];
+
+	if (rec->generation & 1) ++rec->generation;
+	rec->published = 0;
+	rec->next_free = table->free_head;
+	table->free_head = index;
+}
+
+/*
+ * popen_noshell_ex() into a record of the table; the FILE is in popen_noshell_handle_get(table, handle)->fp.
+ * Returns 0 on error, "errno" is set appropriately.
+ */
+popen_noshell_handle popen_noshell_handle_open(struct popen_noshell_handles *table, const char *file, const char * const *argv,
+	const char *type, const struct popen_noshell_options *opts
+) {
+	struct popen_noshell_handle_record *rec;
+	struct popen_noshell_options pooled;
+	struct popen_noshell_ctx *ctx = NULL;
+	int index, saved_errno;
+	FILE *fp;
+
+	if (opts->mode == POPEN_NOSHELL_MODE_AUTO) { // so that it may get a pooled context
+		pooled = *opts;
+		pooled.mode = _popen_noshell_auto_resolve();
+		opts = &pooled;
+	}
+	pthread_mutex_lock(&table->lock);
+	index = _popen_noshell_handle_take(table);
+	if (index < 0) {
+		pthread_mutex_unlock(&table->lock);
+		return 0;
+	}
+	rec = &table->chunks[index / POPEN_NOSHELL_HANDLES_PER_CHUNK][index % POPEN_NOSHELL_HANDLES_PER_CHUNK];
+	++rec->generation; // odd: in use, though not "published" for popen_noshell_handle_get() until the spawn succeeded
+	if (!opts->ctx && opts->mode == POPEN_NOSHELL_MODE_CLONE && table->pool_ctx && table->ctx_pool_count) {
+		ctx = table->ctx_pool[--table->ctx_pool_count];
+	}
+	pthread_mutex_unlock(&table->lock);
+
+	if (!opts->ctx && opts->mode == POPEN_NOSHELL_MODE_CLONE && table->pool_ctx && !ctx) {
+		ctx = (struct popen_noshell_ctx *)aligned_alloc(64, sizeof(struct popen_noshell_ctx));
+		if (ctx && popen_noshell_ctx_init(ctx) != 0) {
+			free(ctx);
+			ctx = NULL; // spawn without one then
+		}
+	}
+	if (ctx) {
+		if (opts != &pooled) pooled = *opts;
+		pooled.ctx = ctx;
+		opts = &pooled;
+	}
+
+	fp = popen_noshell_ex(file, argv, type, &rec->arg, opts);
+	saved_errno = errno;
+
+	pthread_mutex_lock(&table->lock);
+	if (ctx) {
+		if (table->ctx_pool_count == table->ctx_pool_size) {
+			struct popen_noshell_ctx **pool = (struct popen_noshell_ctx **)realloc(table->ctx_pool,
+				sizeof(*pool) * (table->ctx_pool_size ? table->ctx_pool_size * 2 : 4));
+
+			if (pool) {
+				table->ctx_pool = pool;
+				table->ctx_pool_size = (table->ctx_pool_size ? table->ctx_pool_size * 2 : 4);
+			}
+		}
+		if (table->ctx_pool_count < table->ctx_pool_size) {
+			table->ctx_pool[table->ctx_pool_count++] = ctx;
+			ctx = NULL;
+		}
+	}
+	if (fp) {
+		++table->live;
+		rec->published = 1;
+	} else {
+		_popen_noshell_handle_release(table, index);
+	}
+	pthread_mutex_unlock(&table->lock);
+
+	if (ctx) { // no room in the pool
+		popen_noshell_ctx_destroy(ctx);
+		free(ctx);
+	}
+	errno = saved_errno;
+	if (!fp) return 0;
+	return ((popen_noshell_handle)rec->generation << 32) | (uint32_t)index;
+}
+
+/*
+ * The record of an open handle, for the FILE in "->fp" and for the functions which take a popen_noshell_pass_to_pclose,
+ * e.g. popen_noshell_read() or popen_noshell_kill(). Don't pass it to pclose_noshell(), close the handle instead.
+ * Returns NULL with "errno" set to EBADF if the handle is not open.
+ */
+struct popen_noshell_pass_to_pclose *popen_noshell_handle_get(struct popen_noshell_handles *table, popen_noshell_handle handle) {
+	struct popen_noshell_handle_record *rec;
+
+	pthread_mutex_lock(&table->lock);
+	rec = _popen_noshell_handle_record(table, handle);
+	pthread_mutex_unlock(&table->lock);
+	if (!rec) {
+		errno = EBADF;
+		return NULL;
+	}
+	return &rec->arg;
+}
+
+/*
+ * pclose_noshell() of the child, and the record is free for reuse. The handle is invalid from then on,
+ * even if this fails.
+ * Returns -1 on error, "errno" is set appropriately: EBADF if the handle is not open, e.g. closed already.
+ */
+int popen_noshell_handle_close(struct popen_noshell_handles *table, popen_noshell_handle handle) {
+	struct popen_noshell_handle_record *rec;
+	int status, saved_errno;
+
+	pthread_mutex_lock(&table->lock);
+	rec = _popen_noshell_handle_record(table, handle);
+	if (rec) { // even and unpublished: no other close nor get can have it, nor can a spawn until it is released below
+		++rec->generation;
+		rec->published = 0;
+	}
+	pthread_mutex_unlock(&table->lock);
+	if (!rec) {
+		errno = EBADF;
+		return -1;
+	}
+
+	status = pclose_noshell(&rec->arg);
+	saved_errno = errno;
+
+	pthread_mutex_lock(&table->lock);
+	--table->live;
+	_popen_noshell_handle_release(table, (int)(uint32_t)handle);
+	pthread_mutex_unlock(&table->lock);
+	errno = saved_errno;
+	return status;
+}
+
+/*
+ * Sends the signal "sig" to the child process, or to its whole process group if "new_process_group" was requested.
+ * Until pclose_noshell() the child is not reaped, so its PID cannot be reused by another process meanwhile. The child
+ * of a reaper is reaped as soon as it exits, and then this fails with ESRCH.
  *
- * Returns NULL on any error, "errno" is set appropriately.
- * On success, a stream pointer is returned.
- * 	When you are done working with the stream, you have to close it by calling pclose_noshell(), or else you will leave zombie processes.
+ * Returns -1 on any error, "errno" is set appropriately.
  */
-FILE *popen_noshell(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg, int stderr_mode) {
-	int read_pipe;
-	int pipefd[2]; // 0 -> READ, 1 -> WRITE ends
-	pid_t pid;
-	FILE *fp;
+int popen_noshell_kill(struct popen_noshell_pass_to_pclose *arg, int sig) {
+	if (arg->reaper) {
+		return _popen_noshell_reaper_kill(arg->reaper, arg->pid, (arg->kill_pgroup ? -arg->pid : arg->pid), sig);
+	}
+	if (arg->kill_pgroup) {
+		return kill(-arg->pid, sig);
+	}
+#ifdef SYS_pidfd_send_signal
+	if (arg->pidfd >= 0) {
+		return syscall(SYS_pidfd_send_signal, arg->pidfd, sig, NULL, 0);
+	}
+#endif
+	return kill(arg->pid, sig);
+}
 
-	memset(pclose_arg, 0, sizeof(struct popen_noshell_pass_to_pclose));
+// returns when the next deadline of the child is due, or 0 if there is none
+int64_t _popen_noshell_due_ns(struct popen_noshell_pass_to_pclose *arg) {
+	int64_t due = 0;
 
-	if (strcmp(type, "r") == 0) {
-		read_pipe = 1;
-	} else if (strcmp(type, "w") == 0) {
-		read_pipe = 0;
+	switch (arg->kill_stage) {
+		case 0:
+			if (arg->idle_timeout_ms) {
+				due = arg->last_io_ns + (int64_t)arg->idle_timeout_ms * 1000000;
+			}
+			if (arg->deadline_ns && (!due || arg->deadline_ns < due)) {
+				due = arg->deadline_ns;
+			}
+			return due;
+		case 1:
+			return arg->kill_ns;
+		default:
+			return 0;
+	}
+}
+
+// a deadline expired: SIGTERM first, SIGKILL after the grace period
+void _popen_noshell_expire(struct popen_noshell_pass_to_pclose *arg, int64_t now) {
+	if (arg->kill_stage == 0) {
+		arg->timed_out = 1;
+		arg->kill_stage = 1;
+		arg->kill_ns = now + (int64_t)arg->kill_grace_ms * 1000000;
+		if (popen_noshell_kill(arg, SIGTERM) != 0) {
+			warn("popen_noshell_kill(%d, SIGTERM)", (int)arg->pid);
+		}
+	} else if (arg->kill_stage == 1) {
+		arg->kill_stage = 2;
+		if (popen_noshell_kill(arg, SIGKILL) != 0) {
+			warn("popen_noshell_kill(%d, SIGKILL)", (int)arg->pid);
+		}
+	}
+}
+
+int _popen_noshell_ms_until(int64_t due, int64_t now) {
+	int64_t ms = (due - now + 999999) / 1000000; // round up, so that we don't spin
+
+	return (ms > INT32_MAX ? INT32_MAX : (int)ms);
+}
+
+// returns 0 when "fd" is ready for "events", or -1 with "errno" set to ETIMEDOUT if a deadline expired
+int _popen_noshell_wait_fd(struct popen_noshell_pass_to_pclose *arg, int fd, short events) {
+	struct pollfd pfd;
+	int64_t due, now;
+	int ret;
+
+	if (arg->kill_stage) { // we already gave up on this child
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if (!arg->deadline_ns && !arg->idle_timeout_ms) {
+		return 0;
+	}
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while (1) {
+		due = _popen_noshell_due_ns(arg);
+		now = _popen_noshell_now_ns();
+		if (now >= due) {
+			_popen_noshell_expire(arg, now);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		ret = poll(&pfd, 1, _popen_noshell_ms_until(due, now));
+		if (ret > 0) return 0;
+		if (ret < 0 && errno != EINTR) return -1;
+	}
+}
+
+/*
+ * Reads from the STDOUT of the child like read(2) does, but honors the "timeout_ms" and "idle_timeout_ms" options.
+ * When a deadline expires, the child is sent SIGTERM and -1 is returned with "errno" set to ETIMEDOUT.
+ *
+ * This bypasses the buffer of the FILE returned by popen_noshell_ex(), so don't mix it with fgets() and friends.
+ */
+ssize_t popen_noshell_read(struct popen_noshell_pass_to_pclose *arg, void *buf, size_t count) {
+	int fd = fileno(arg->fp);
+	ssize_t ret;
+
+	do {
+		if (_popen_noshell_wait_fd(arg, fd, POLLIN) != 0) return -1;
+		ret = read(fd, buf, count);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret > 0 && arg->idle_timeout_ms) {
+		arg->last_io_ns = _popen_noshell_now_ns();
+	}
+	if (ret > 0) {
+		_POPEN_NOSHELL_STAT_ADD(arg->mode, bytes_read, ret);
+	}
+	if (ret > 0 && !arg->trace_got_output) {
+		arg->trace_got_output = 1;
+		_POPEN_NOSHELL_TRACE(first_byte, POPEN_NOSHELL_PHASE_FIRST_BYTE, arg);
+	}
+	return ret;
+}
+
+/*
+ * Writes to the STDIN of the child like write(2) does, but honors the "timeout_ms" and "idle_timeout_ms" options.
+ * When a deadline expires, the child is sent SIGTERM and -1 is returned with "errno" set to ETIMEDOUT.
+ *
+ * This bypasses the buffer of the FILE returned by popen_noshell_ex(); fflush() it first if you wrote anything there.
+ */
+ssize_t popen_noshell_write(struct popen_noshell_pass_to_pclose *arg, const void *buf, size_t count) {
+	int fd = fileno(arg->fp);
+	ssize_t ret;
+
+	do {
+		if (_popen_noshell_wait_fd(arg, fd, POLLOUT) != 0) return -1;
+		ret = write(fd, buf, count);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret > 0) {
+		_POPEN_NOSHELL_STAT_ADD(arg->mode, bytes_written, ret);
+	}
+	if (ret > 0 && arg->idle_timeout_ms) {
+		arg->last_io_ns = _popen_noshell_now_ns();
+	}
+	return ret;
+}
+
+// where the next read() of a capture goes; "scratch" if the capture is full already
+char *_popen_noshell_capture_room(struct popen_noshell_capture *cap, char *scratch, size_t scratch_size, size_t *room) {
+	size_t want, size;
+	char *data;
+
+	if (cap->max && cap->len >= cap->max) {
+		*room = scratch_size;
+		return scratch;
+	}
+	if (cap->size - cap->len < 4096 + 1) { // +1 for the '\0'
+		size = (cap->size ? cap->size * 2 : 16384);
+		if (cap->max && size > cap->max + 1) size = cap->max + 1;
+		data = (char *)realloc(cap->data, size);
+		if (!data) return NULL;
+		cap->data = data;
+		cap->size = size;
+	}
+	want = cap->size - cap->len - 1;
+	if (cap->max && want > cap->max - cap->len) want = cap->max - cap->len;
+	*room = want;
+	return cap->data + cap->len;
+}
+
+// accounts "ret" bytes which were read into "buf"; returns 1 at EOF, or -1 on error
+int _popen_noshell_capture_got(struct popen_noshell_capture *cap, const char *buf, const char *scratch, ssize_t ret) {
+	if (ret < 0) return (errno == EINTR || errno == EAGAIN ? 0 : -1);
+	if (ret == 0) return 1;
+	if (buf == scratch) {
+		cap->dropped += ret;
 	} else {
-		errno = EINVAL;
-		return NULL;
+		cap->len += ret;
+		cap->data[cap->len] = '\0';
 	}
+	return 0;
+}
 
-	// issue #7: O_CLOEXEC, so that child processes don't inherit and hold opened the
-	// file descriptors of the parent.
-	// The child process turns this off for its fd of the pipe.
-	if (pipe2(pipefd, O_CLOEXEC) != 0) return NULL;
+/*
+ * Reads the STDOUT of the child into "out" and its STDERR into "err" at the same time, so that neither stream can fill up
+ * its pipe and block the child while we wait for the other one. STDERR needs stderr_mode 3; pass NULL for a stream which
+ * you don't want, e.g. for "out" in the "w" mode of popen_noshell_ex(). Set the "max" of each capture first: the bytes over it
+ * are still read, but only counted in "dropped", so a chatty child finishes anyway. Honors the deadlines of the child.
+ *
+ * Call it instead of reading the FILE, and pclose_noshell() afterwards. free() the "data" of the captures even on errors.
+ *
+ * Returns -1 on error, "errno" is set appropriately, e.g. ETIMEDOUT; what was captured until then is kept.
+ */
+int popen_noshell_capture(struct popen_noshell_pass_to_pclose *arg, struct popen_noshell_capture *out, struct popen_noshell_capture *err) {
+	struct popen_noshell_capture *caps[2] = {out, err};
+	struct pollfd pfd[2];
+	char scratch[16384];
+	char *buf;
+	size_t room;
+	int open_count = 0;
+	int64_t due, now;
+	int i, ret, timeout;
+	ssize_t got;
+
+	for (i = 0; i < 2; ++i) {
+		pfd[i].fd = -1;
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+		if (!caps[i]) continue;
+		caps[i]->data = NULL;
+		caps[i]->len = caps[i]->size = caps[i]->dropped = 0;
+	}
+	if (out) {
+		pfd[0].fd = fileno(arg->fp);
+		if ((fcntl(pfd[0].fd, F_GETFL) & O_ACCMODE) != O_RDONLY) {
+			errno = EINVAL; // the FILE is the STDIN of the child
+			return -1;
+		}
+		++open_count;
+	}
+	if (err) {
+		if (arg->stderr_fd < 0) {
+			errno = EINVAL; // not stderr_mode 3
+			return -1;
+		}
+		pfd[1].fd = arg->stderr_fd;
+		++open_count;
+	}
 
-	if (_popen_noshell_fork_mode == POPEN_NOSHELL_MODE_FORK) { // use fork()
+	while (open_count) {
+		if (arg->kill_stage) { // we already gave up on this child
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		timeout = -1;
+		due = _popen_noshell_due_ns(arg);
+		if (due) {
+			now = _popen_noshell_now_ns();
+			if (now >= due) {
+				_popen_noshell_expire(arg, now);
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			timeout = _popen_noshell_ms_until(due, now);
+		}
+		ret = poll(pfd, 2, timeout);
+		if (ret < 0 && errno != EINTR) return -1;
+		if (ret <= 0) continue;
+
+		for (i = 0; i < 2; ++i) {
+			if (pfd[i].fd < 0 || !pfd[i].revents) continue;
+			buf = _popen_noshell_capture_room(caps[i], scratch, sizeof(scratch), &room);
+			if (!buf) return -1;
+			if (i == 0) { // counted like any other output
+				got = popen_noshell_read(arg, buf, room);
+			} else {
+				got = read(pfd[i].fd, buf, room);
+				if (got > 0 && arg->idle_timeout_ms) arg->last_io_ns = _popen_noshell_now_ns();
+			}
+			ret = _popen_noshell_capture_got(caps[i], buf, scratch, got);
+			if (ret < 0) return -1;
+			if (ret > 0) { // EOF; poll() ignores negative fds
+				pfd[i].fd = -1;
+				--open_count;
+			}
+		}
+	}
+	return 0;
+}
 
-		pid = fork();
-		if (pid == -1) return NULL;
-		if (pid == 0) {
-			_popen_noshell_child_process(NULL, pipefd[0], pipefd[1], read_pipe, stderr_mode, file, argv);
-			errx(EXIT_FAILURE, "This must never happen");
-		} // child life ends here, for sure
+/*
+ * The record reader: the output of the child is split at a delimiter straight in a large buffer, so that each record
+ * costs neither a libc call nor a copy, unlike fgets(). The delimiter is searched for 32 or 16 bytes at a time.
+ */
 
-	} else if (_popen_noshell_fork_mode == POPEN_NOSHELL_MODE_POSIX_SPAWN) { // use posix_spawn()
+// the end of the search, if "c" is not found
+const char *_popen_noshell_find_scalar(const char *p, const char *end, char c) {
+	while (p < end && *p != c) ++p;
+	return p;
+}
 
-		pid = _popen_noshell_child_process(NULL, pipefd[0], pipefd[1], read_pipe, stderr_mode, file, argv);
-		if (pid == 0) {
-			warnx("posix_spawn() failed");
-			return NULL;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+const char *_popen_noshell_find_sse2(const char *p, const char *end, char c) {
+	__m128i needle = _mm_set1_epi8(c);
+	int mask;
+
+	for (; end - p >= 16; p += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+		if (mask) return p + __builtin_ctz(mask);
+	}
+	return _popen_noshell_find_scalar(p, end, c);
+}
+
+// compiled for AVX2 even if the rest is not, and only called if the CPU has it
+__attribute__((target("avx2")))
+const char *_popen_noshell_find_avx2(const char *p, const char *end, char c) {
+	__m256i needle = _mm256_set1_epi8(c);
+	unsigned int mask;
+
+	for (; end - p >= 32; p += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle));
+		if (mask) return p + __builtin_ctz(mask);
+	}
+	return _popen_noshell_find_sse2(p, end, c);
+}
+#endif
+
+const char *_popen_noshell_find(int simd, const char *p, const char *end, char c) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+	if (simd == POPEN_NOSHELL_SIMD_AVX2) return _popen_noshell_find_avx2(p, end, c);
+	if (simd == POPEN_NOSHELL_SIMD_SSE2) return _popen_noshell_find_sse2(p, end, c);
+#endif
+	return _popen_noshell_find_scalar(p, end, c);
+}
+
+/*
+ * Reads the records of the child "arg", separated by "delim": '\n' for lines, '\0' for "find -print0", or any other byte.
+ * "size" is the initial size of the buffer, 0 for 64 kB; it grows if a record does not fit.
+ * The best search which the CPU supports is stored in "reader->simd"; lower it to compare with the slower ones.
+ *
+ * Returns -1 on error, "errno" is set appropriately.
+ */
+int popen_noshell_reader_init(struct popen_noshell_reader *reader, struct popen_noshell_pass_to_pclose *arg, size_t size, int delim) {
+	memset(reader, 0, sizeof(struct popen_noshell_reader));
+	reader->arg = arg;
+	reader->delim = (char)delim;
+	reader->size = (size ? size : 65536);
+	reader->buf = (char *)malloc(reader->size);
+	if (!reader->buf) return -1;
+
+	reader->simd = POPEN_NOSHELL_SIMD_SCALAR;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+	__builtin_cpu_init();
+	reader->simd = (__builtin_cpu_supports("avx2") ? POPEN_NOSHELL_SIMD_AVX2 : POPEN_NOSHELL_SIMD_SSE2);
+#endif
+	return 0;
+}
+
+/*
+ * Finds the next record. "*record" points into the buffer of the reader and is valid until the next call;
+ * "*len" excludes the delimiter. The last record may lack its delimiter.
+ * The data is read by popen_noshell_read(), so the deadlines of the child are honored; don't mix it with the FILE.
+ *
+ * Returns 1 if a record was found, 0 at EOF, or -1 on error with "errno" set appropriately.
+ */
+int popen_noshell_reader_next(struct popen_noshell_reader *reader, const char **record, size_t *len) {
+	const char *found;
+	char *buf;
+	ssize_t ret;
+
+	while (1) {
+		found = _popen_noshell_find(reader->simd, reader->buf + reader->scan, reader->buf + reader->end, reader->delim);
+		if (found < reader->buf + reader->end) {
+			*record = reader->buf + reader->begin;
+			*len = found - *record;
+			reader->begin = reader->scan = found - reader->buf + 1;
+			return 1;
+		}
+		reader->scan = reader->end; // these bytes were searched already
+
+		if (reader->eof) {
+			if (reader->begin == reader->end) return 0;
+			*record = reader->buf + reader->begin;
+			*len = reader->end - reader->begin;
+			reader->begin = reader->scan = reader->end;
+			return 1;
 		}
 
-	} else { // use clone()
+		// keep only the partial record, at the start of the buffer
+		if (reader->begin > 0) {
+			memmove(reader->buf, reader->buf + reader->begin, reader->end - reader->begin);
+			reader->end -= reader->begin;
+			reader->scan -= reader->begin;
+			reader->begin = 0;
+		}
+		if (reader->end == reader->size) {
+			buf = (char *)realloc(reader->buf, reader->size * 2);
+			if (!buf) return -1;
+			reader->buf = buf;
+			reader->size *= 2;
+		}
+
+		ret = popen_noshell_read(reader->arg, reader->buf + reader->end, reader->size - reader->end);
+		if (ret < 0) return -1;
+		if (ret == 0) reader->eof = 1;
+		reader->end += ret;
+	}
+}
 
-		struct popen_noshell_clone_arg *arg = NULL;
+void popen_noshell_reader_destroy(struct popen_noshell_reader *reader) {
+	free(reader->buf);
+	reader->buf = NULL;
+}
 
-		arg = (struct popen_noshell_clone_arg*) malloc(sizeof(struct popen_noshell_clone_arg));
-		if (!arg) return NULL;
+// the child of a reaper is reaped by the reaper thread
+pid_t _pclose_noshell_wait4(struct popen_noshell_pass_to_pclose *arg, int *status, int options, struct rusage *usage) {
+	if (arg->reaper) return _popen_noshell_reaper_wait(arg->reaper, arg->pid, status, options, usage);
+	return wait4(arg->pid, status, __WALL | options, usage);
+}
 
-		/* Copy memory structures, so that nobody can free() our memory while we use it in the child! */
-		arg->pipefd_0 = pipefd[0];
-		arg->pipefd_1 = pipefd[1];
-		arg->read_pipe = read_pipe;
-		arg->stderr_mode = stderr_mode;
-		arg->file = strdup(file);
-		if (!arg->file) return NULL;
-		arg->argv = (const char * const *)popen_noshell_copy_argv(argv);
-		if (!arg->argv) return NULL;
+// waitpid() which kills the child when its deadlines expire; "usage" may be NULL
+int _pclose_noshell_waitpid(struct popen_noshell_pass_to_pclose *arg, int *status, struct rusage *usage) {
+	struct pollfd pfd;
+	struct timespec ts;
+	int64_t due, now;
+	pid_t ret;
+	int ms;
+
+	if (!arg->deadline_ns && !arg->idle_timeout_ms && !arg->kill_stage) {
+		do {
+			ret = _pclose_noshell_wait4(arg, status, 0, usage);
+		} while (ret == -1 && errno == EINTR);
+		return (ret == arg->pid ? 0 : -1);
+	}
 
-		pclose_arg->free_clone_mem = 1;
-		pclose_arg->func_args = arg;
-		pclose_arg->stack = NULL; // we will populate it below
+	// the pipe was just closed, which counts as I/O; the child has "idle_timeout_ms" to exit
+	if (arg->kill_stage == 0) {
+		arg->last_io_ns = _popen_noshell_now_ns();
+	}
 
-		pid = popen_noshell_vmfork(&popen_noshell_child_process_by_clone, arg, &(pclose_arg->stack));
-		if (pid == -1) return NULL;
+	pfd.fd = arg->pidfd;
+	pfd.events = POLLIN;
+	while (1) {
+		ret = _pclose_noshell_wait4(arg, status, WNOHANG, usage);
+		if (ret == arg->pid) return 0;
+		if (ret == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
 
-	} // done: using clone()
+		due = _popen_noshell_due_ns(arg);
+		if (!due) { // SIGKILL was sent already
+			do {
+				ret = _pclose_noshell_wait4(arg, status, 0, usage);
+			} while (ret == -1 && errno == EINTR);
+			return (ret == arg->pid ? 0 : -1);
+		}
+		now = _popen_noshell_now_ns();
+		if (now >= due) {
+			_popen_noshell_expire(arg, now);
+			continue;
+		}
 
-	/* parent process */
+		ms = _popen_noshell_ms_until(due, now);
+		if (arg->reaper && _popen_noshell_reaper_sleep(arg->reaper, arg->pid, due) == 0) {
+			// woken up by a reaped child, maybe ours
+		} else if (arg->pidfd >= 0) { // the pidfd becomes readable when the child exits
+			if (poll(&pfd, 1, ms) < 0 && errno != EINTR) return -1;
+		} else { // no pidfd support in the kernel, so we poll waitpid() in short intervals
+			if (ms > 10) ms = 10;
+			ts.tv_sec = 0;
+			ts.tv_nsec = (long)ms * 1000000;
+			nanosleep(&ts, NULL);
+		}
+	}
+}
 
-	if (read_pipe) {
-		if (close(pipefd[1/*write*/]) != 0) return NULL;
-		fp = fdopen(pipefd[0/*read*/], "r");
-	} else { // write_pipe
-		if (close(pipefd[0/*read*/]) != 0) return NULL;
-		fp = fdopen(pipefd[1/*write*/], "w");
+/*
+ * Deadlines for many children at once.
+ *
+ * The children are kept in a binary heap ordered by their next deadline, and a single timerfd "timers->fd" is armed
+ * for the earliest one. So 10k pending deadlines cost one file descriptor, and O(log N) work per child.
+ * Add the "timers->fd" to your poll() / epoll() loop and call popen_noshell_timers_expire() when it becomes readable.
+ *
+ * The idle deadlines move forward on each I/O. The heap is not updated on every read() though: an entry whose idle
+ * deadline moved is simply re-queued when its old deadline fires.
+ *
+ * The children are only signalled here; you still have to call pclose_noshell() for each of them, which also removes
+ * them from the timers.
+ */
+int popen_noshell_timers_init(struct popen_noshell_timers *timers) {
+	memset(timers, 0, sizeof(struct popen_noshell_timers));
+	timers->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timers->fd < 0) return -1;
+	return 0;
+}
+
+void popen_noshell_timers_destroy(struct popen_noshell_timers *timers) {
+	int i;
+
+	for (i = 0; i < timers->count; ++i) {
+		timers->heap[i]->timers = NULL;
+		timers->heap[i]->timers_index = -1;
 	}
-	if (fp == NULL) {
-		return NULL; // fdopen() failed
+	free(timers->heap);
+	if (timers->fd >= 0 && close(timers->fd) != 0) {
+		warn("close(timerfd)");
 	}
+	memset(timers, 0, sizeof(struct popen_noshell_timers));
+	timers->fd = -1;
+}
 
-	pclose_arg->fp = fp;
-	pclose_arg->pid = pid;
-	
-	return fp; // we should never end up here
+void _popen_noshell_timers_set(struct popen_noshell_timers *timers, int i, struct popen_noshell_pass_to_pclose *arg) {
+	timers->heap[i] = arg;
+	arg->timers_index = i;
+}
+
+void _popen_noshell_timers_sift(struct popen_noshell_timers *timers, int i) {
+	struct popen_noshell_pass_to_pclose *arg = timers->heap[i];
+	int parent, child;
+
+	while (i > 0) { // up
+		parent = (i - 1) / 2;
+		if (timers->heap[parent]->timers_key_ns <= arg->timers_key_ns) break;
+		_popen_noshell_timers_set(timers, i, timers->heap[parent]);
+		i = parent;
+	}
+	while (1) { // down
+		child = 2 * i + 1;
+		if (child >= timers->count) break;
+		if (child + 1 < timers->count && timers->heap[child + 1]->timers_key_ns < timers->heap[child]->timers_key_ns) {
+			++child;
+		}
+		if (arg->timers_key_ns <= timers->heap[child]->timers_key_ns) break;
+		_popen_noshell_timers_set(timers, i, timers->heap[child]);
+		i = child;
+	}
+	_popen_noshell_timers_set(timers, i, arg);
+}
+
+// arm the timerfd for the earliest deadline, or disarm it if there are none
+int _popen_noshell_timers_arm(struct popen_noshell_timers *timers) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (timers->count) {
+		its.it_value.tv_sec = timers->heap[0]->timers_key_ns / 1000000000;
+		its.it_value.tv_nsec = timers->heap[0]->timers_key_ns % 1000000000;
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec) {
+			its.it_value.tv_nsec = 1; // a zero value would disarm the timer
+		}
+	}
+	return timerfd_settime(timers->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void _popen_noshell_timers_delete(struct popen_noshell_timers *timers, int i) {
+	timers->heap[i]->timers = NULL;
+	timers->heap[i]->timers_index = -1;
+	--timers->count;
+	if (i != timers->count) {
+		_popen_noshell_timers_set(timers, i, timers->heap[timers->count]);
+		_popen_noshell_timers_sift(timers, i);
+	}
+}
+
+/*
+ * Returns -1 on any error, "errno" is set appropriately.
+ * Adding a child which has no deadlines is a no-op.
+ */
+int popen_noshell_timers_add(struct popen_noshell_timers *timers, struct popen_noshell_pass_to_pclose *arg) {
+	struct popen_noshell_pass_to_pclose **heap;
+	int64_t due;
+
+	if (arg->timers) {
+		errno = EBUSY;
+		return -1;
+	}
+	due = _popen_noshell_due_ns(arg);
+	if (!due) return 0;
+
+	if (timers->count == timers->size) {
+		heap = (struct popen_noshell_pass_to_pclose **)realloc(timers->heap, sizeof(*heap) * (timers->size ? timers->size * 2 : 64));
+		if (!heap) return -1;
+		timers->heap = heap;
+		timers->size = (timers->size ? timers->size * 2 : 64);
+	}
+
+	arg->timers = timers;
+	arg->timers_key_ns = due;
+	_popen_noshell_timers_set(timers, timers->count++, arg);
+	_popen_noshell_timers_sift(timers, arg->timers_index);
+
+	if (arg->timers_index == 0) return _popen_noshell_timers_arm(timers);
+	return 0;
+}
+
+void popen_noshell_timers_remove(struct popen_noshell_timers *timers, struct popen_noshell_pass_to_pclose *arg) {
+	int was_first;
+
+	if (arg->timers != timers) return;
+
+	was_first = (arg->timers_index == 0);
+	_popen_noshell_timers_delete(timers, arg->timers_index);
+	if (was_first && _popen_noshell_timers_arm(timers) != 0) {
+		warn("timerfd_settime()");
+	}
+}
+
+/*
+ * Call this when "timers->fd" is readable. Signals all children whose deadlines have expired.
+ *
+ * Returns the number of signalled children, or -1 on error with "errno" set appropriately.
+ */
+int popen_noshell_timers_expire(struct popen_noshell_timers *timers) {
+	struct popen_noshell_pass_to_pclose *arg;
+	uint64_t expirations;
+	int64_t now, due;
+	int signalled = 0;
+
+	if (read(timers->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		return -1;
+	}
+
+	now = _popen_noshell_now_ns();
+	while (timers->count && timers->heap[0]->timers_key_ns <= now) {
+		arg = timers->heap[0];
+		due = _popen_noshell_due_ns(arg);
+		if (due && due <= now) {
+			_popen_noshell_expire(arg, now);
+			++signalled;
+			due = _popen_noshell_due_ns(arg);
+		}
+		if (!due) { // nothing more to wait for
+			_popen_noshell_timers_delete(timers, 0);
+		} else { // re-queue: a moved idle deadline, or the SIGKILL after the grace period
+			arg->timers_key_ns = due;
+			_popen_noshell_timers_sift(timers, 0);
+		}
+	}
+
+	if (_popen_noshell_timers_arm(timers) != 0) return -1;
+	return signalled;
 }
 
 int popen_noshell_add_ptr_to_argv(char ***argv, int *count, char *start) {
@@ -641,24 +3752,58 @@ FILE *popen_noshell_compat(const char *command, const char *type, struct popen_n
 /*
  * You have to call this function after you have done working with the FILE pointer "fp" returned by popen_noshell() or by popen_noshell_compat().
  *
+ * If a deadline was given to popen_noshell_ex(), the child is killed when it expires. The "timed_out" member of "arg"
+ * tells if that happened.
+ *
  * Returns -1 on any error, "errno" is set appropriately.
  * Returns the "status" of the child process as returned by waitpid().
  */
 int pclose_noshell(struct popen_noshell_pass_to_pclose *arg) {
-	int status;
+	return pclose_noshell_rusage(arg, NULL);
+}
 
-	if (fclose(arg->fp) != 0) {
-		return -1;
+/*
+ * The same as pclose_noshell(), but also stores the resource usage of the child in "usage", as wait4() does.
+ */
+// what the handle holds besides the FILE; done even if waiting for the child failed
+void _pclose_noshell_release(struct popen_noshell_pass_to_pclose *arg) {
+	if (arg->admission) {
+		_popen_noshell_admission_release(arg->admission);
+		arg->admission = NULL;
 	}
 
-	if (waitpid(arg->pid, &status, __WALL) != arg->pid) {
-		return -1;
+	if (arg->timers) {
+		popen_noshell_timers_remove(arg->timers, arg);
+	}
+	if (arg->pidfd >= 0) {
+		close(arg->pidfd);
+		arg->pidfd = -1;
 	}
 
 	if (arg->free_clone_mem) {
 		free(arg->stack);
 		_pclose_noshell_free_clone_arg_memory(arg->func_args);
+		arg->free_clone_mem = 0;
 	}
+}
 
-	return status;
+int pclose_noshell_rusage(struct popen_noshell_pass_to_pclose *arg, struct rusage *usage) {
+	int status, ret;
+
+	if (fclose(arg->fp) != 0) {
+		return -1;
+	}
+	if (arg->stderr_fd >= 0) { // a child which still writes there gets EPIPE instead of blocking forever
+		close(arg->stderr_fd);
+		arg->stderr_fd = -1;
+	}
+
+	ret = _pclose_noshell_waitpid(arg, &status, usage);
+	if (ret == 0) {
+		_POPEN_NOSHELL_TRACE(exit, POPEN_NOSHELL_PHASE_EXIT, arg);
+		_POPEN_NOSHELL_STAT_ADD(arg->mode, live_children, -1);
+	}
+	_pclose_noshell_release(arg);
+
+	return (ret == 0 ? status : -1);
 }
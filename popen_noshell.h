@@ -20,8 +20,12 @@
 #define POPEN_NOSHELL_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,18 +34,176 @@ extern "C" {
 /* stack for the child process before it does exec() */
 #define POPEN_NOSHELL_STACK_SIZE 8*1024*1024 /* currently most Linux distros set this to 8 MBytes */
 
-/* constants to use with popen_noshell_set_fork_mode() */
+/* constants to use with popen_noshell_set_fork_mode() and popen_noshell_options.mode */
 #define POPEN_NOSHELL_MODE_CLONE 0 /* default, faster */
 #define POPEN_NOSHELL_MODE_FORK 1 /* slower */
 #define POPEN_NOSHELL_MODE_POSIX_SPAWN 2 /* the fastest, if implemented properly by libc: see issue #11 */
+#define POPEN_NOSHELL_MODE_VFORK 3 /* like POPEN_NOSHELL_MODE_CLONE, but on the stack of the caller, so nothing is allocated */
+#define POPEN_NOSHELL_MODE_TRAMPOLINE 4 /* posix_spawn() of a tiny static program which does the rest; see popen_noshell_set_trampoline() */
+#define POPEN_NOSHELL_MODES 5
+#define POPEN_NOSHELL_MODE_AUTO -1 /* one of the above, chosen at runtime; see popen_noshell_auto_decision() */
+
+/* the default path of the program "popen_noshell_trampoline.c" for POPEN_NOSHELL_MODE_TRAMPOLINE */
+#ifndef POPEN_NOSHELL_TRAMPOLINE_PATH
+#define POPEN_NOSHELL_TRAMPOLINE_PATH "/usr/local/libexec/popen_noshell_trampoline"
+#endif
+
+/* a setrlimit() for the child, see popen_noshell_options.rlimits */
+struct popen_noshell_rlimit {
+	int resource; /* RLIMIT_* */
+	struct rlimit limit;
+};
 
 struct popen_noshell_clone_arg {
+	int mode;
 	int pipefd_0;
 	int pipefd_1;
 	int read_pipe;
 	int stderr_mode;
+	int stderr_pipefd; /* stderr_mode 3: the write end of the STDERR pipe; -1 otherwise */
+	int new_process_group;
+	int new_session;
+	const char *cwd; /* NULL keeps ours */
+	const struct popen_noshell_rlimit *rlimits;
+	int rlimits_count;
+	const void *cpu_affinity; /* a cpu_set_t; NULL keeps ours */
+	size_t cpu_affinity_size;
+	const char *trampoline; /* POPEN_NOSHELL_MODE_TRAMPOLINE: the path of the program */
+	int dev_null_fd; /* -1 if the child has to open() /dev/null itself */
+	const sigset_t *sigmask; /* the signal mask to restore in the child; NULL if signals were not blocked */
+	int sighand_cleared; /* the kernel already reset the signal handlers of the child */
+	int close_fds; /* see popen_noshell_options */
+	const int *keep_fds;
+	int keep_fds_count;
+	int64_t *trace_ns; /* the child stores the times of the POPEN_NOSHELL_PHASE_CHILD_* phases here; NULL if not traced */
+	int errpipe_fd; /* the child reports its failure here, see POPEN_NOSHELL_CHILD_*; -1 if "child_errno" is shared instead */
+	int child_stage; /* a clone()'d child sets these two if it failed before its exec() completed */
+	int child_errno;
 	const char *file;
 	const char * const *argv;
+	char * const *envp;
+};
+
+/* size of the resolved PATH cache of a spawn context */
+#define POPEN_NOSHELL_CTX_PATH_CACHE 16
+
+/* counters of a spawn context; plain integers, because only the owner thread updates them */
+struct popen_noshell_ctx_stats {
+	unsigned long spawns;
+	unsigned long failures;
+	unsigned long path_cache_hits;
+	unsigned long path_cache_misses;
+	uint64_t spawn_ns; /* total time spent in popen_noshell_ex() by the successful spawns */
+};
+
+/* per-thread spawn context; see popen_noshell_ctx_init() */
+struct popen_noshell_ctx {
+	void *stack; /* the clone() stack, reused by all spawns */
+	size_t stack_size;
+	int dev_null_fd;
+	char *arena; /* scratch memory for the argv copy */
+	size_t arena_size;
+	char *path_env; /* the PATH for which "path_cache" is valid */
+	struct {
+		char *file;
+		char *path;
+	} path_cache[POPEN_NOSHELL_CTX_PATH_CACHE];
+	int path_cache_next;
+	struct popen_noshell_ctx_stats stats;
+} __attribute__((aligned(64))); /* no false sharing when the contexts of many threads are kept in an array */
+
+/* per-call options for popen_noshell_ex(); initialize them by popen_noshell_options_init() */
+struct popen_noshell_options {
+	int mode; /* POPEN_NOSHELL_MODE_*; popen_noshell_options_init() sets the one from popen_noshell_set_fork_mode() */
+	int stderr_mode; /* see popen_noshell() */
+	size_t stack_size; /* clone() mode only; 0 means POPEN_NOSHELL_STACK_SIZE */
+	int pipe_size; /* F_SETPIPE_SZ of the pipe; 0 keeps the system default */
+	char * const *envp; /* the environment of the child; NULL means "environ" */
+	struct popen_noshell_ctx *ctx; /* spawn through a per-thread context; NULL for none */
+	int no_signal_mask; /* don't block the signals around clone() / fork(); only for benchmarking */
+	int close_fds; /* don't let the child inherit any fds above STDERR, even the ones without O_CLOEXEC... */
+	const int *keep_fds; /* ...except these, which are inherited even if they have O_CLOEXEC */
+	int keep_fds_count;
+	int argv_stable; /* clone() mode: no other thread frees or changes "file" and "argv" during the call, so they are not copied */
+
+	/* deadlines; a value of 0 disables the corresponding timeout */
+	int timeout_ms; /* total time which the child may run, counted from the spawn */
+	int idle_timeout_ms; /* max time without any I/O done by popen_noshell_read() or popen_noshell_write() */
+	int kill_grace_ms; /* time between SIGTERM and SIGKILL when a deadline expires */
+	int new_process_group; /* start the child in its own process group, so that a timeout kills the whole process tree */
+
+	/* what posix_spawn() cannot do; POPEN_NOSHELL_MODE_POSIX_SPAWN fails with ENOTSUP, use POPEN_NOSHELL_MODE_TRAMPOLINE instead */
+	int new_session; /* setsid() in the child, which also makes it a process group leader like "new_process_group" */
+	const char *cwd; /* chdir() in the child; NULL keeps ours */
+	const struct popen_noshell_rlimit *rlimits; /* setrlimit() in the child, in this order */
+	int rlimits_count;
+	const void *cpu_affinity; /* a cpu_set_t for sched_setaffinity() in the child; NULL keeps ours */
+	size_t cpu_affinity_size; /* sizeof() it, or CPU_ALLOC_SIZE() */
+
+	struct popen_noshell_admission *admission; /* queue or back off the spawn when resources are short; NULL for none */
+	struct popen_noshell_reaper *reaper; /* a running reaper which reaps the child instead of pclose_noshell(); NULL for none */
+};
+
+struct popen_noshell_timers;
+struct popen_noshell_pass_to_pclose;
+struct popen_noshell_admission;
+struct popen_noshell_reaper;
+
+/* the stages at which popen_noshell_ex() may fail, see popen_noshell_mode_stats.failures */
+#define POPEN_NOSHELL_STAGE_ARGS 0 /* invalid arguments */
+#define POPEN_NOSHELL_STAGE_PIPE 1 /* pipe2() or F_SETPIPE_SZ */
+#define POPEN_NOSHELL_STAGE_SPAWN 2 /* the memory for the child, clone(), fork() or posix_spawn() */
+#define POPEN_NOSHELL_STAGE_FDOPEN 3 /* fdopen() of the pipe */
+#define POPEN_NOSHELL_STAGES 4
+
+/* library-wide counters of one POPEN_NOSHELL_MODE_*; see popen_noshell_stats_snapshot() */
+struct popen_noshell_mode_stats {
+	uint64_t spawns;
+	uint64_t failures[POPEN_NOSHELL_STAGES];
+	uint64_t exec_failures; /* the child failed before its exec() completed; also counted in failures[POPEN_NOSHELL_STAGE_SPAWN] */
+	uint64_t spawn_ns; /* total time spent in popen_noshell_ex() by the successful spawns */
+	uint64_t bytes_read; /* by popen_noshell_read() */
+	uint64_t bytes_written; /* by popen_noshell_write() */
+	int64_t live_children; /* spawned and not reaped by pclose_noshell() yet */
+};
+
+#define POPEN_NOSHELL_STATS_MAGIC 0x5354415453504e50ULL /* "PNPSTATS" */
+#define POPEN_NOSHELL_STATS_VERSION 3 /* 2: POPEN_NOSHELL_MODE_VFORK, 3: POPEN_NOSHELL_MODE_TRAMPOLINE */
+
+/* this is also the layout of the shared memory segment, see popen_noshell_stats_publish() */
+struct popen_noshell_stats {
+	uint64_t magic; /* POPEN_NOSHELL_STATS_MAGIC */
+	uint32_t version; /* POPEN_NOSHELL_STATS_VERSION */
+	int32_t pid; /* the process which the counters belong to */
+	struct popen_noshell_mode_stats modes[POPEN_NOSHELL_MODES]; /* indexed by POPEN_NOSHELL_MODE_* */
+};
+
+/* where the child failed, see popen_noshell_pass_to_pclose.child_stage */
+#define POPEN_NOSHELL_CHILD_OK 0
+#define POPEN_NOSHELL_CHILD_PGROUP 1 /* setpgid() of "new_process_group", or setsid() of "new_session" */
+#define POPEN_NOSHELL_CHILD_STDIO 2 /* setting up STDIN, STDOUT and STDERR */
+#define POPEN_NOSHELL_CHILD_CLOSE_FDS 3 /* "close_fds" */
+#define POPEN_NOSHELL_CHILD_EXEC 4 /* exec() itself, e.g. ENOENT or EACCES */
+#define POPEN_NOSHELL_CHILD_CWD 5 /* chdir() of "cwd" */
+#define POPEN_NOSHELL_CHILD_RLIMIT 6 /* setrlimit() of "rlimits" */
+#define POPEN_NOSHELL_CHILD_AFFINITY 7 /* sched_setaffinity() of "cpu_affinity" */
+
+/* the phases of a spawn, in the order in which they happen; see popen_noshell_set_tracer() */
+#define POPEN_NOSHELL_PHASE_START 0 /* popen_noshell_ex() was called */
+#define POPEN_NOSHELL_PHASE_PIPE 1 /* pipe2() is done */
+#define POPEN_NOSHELL_PHASE_STACK 2 /* argv is copied and the clone() stack allocated; clone() / fork() / posix_spawn() follows */
+#define POPEN_NOSHELL_PHASE_CHILD_START 3 /* the child started running; POPEN_NOSHELL_MODE_CLONE and _VFORK only */
+#define POPEN_NOSHELL_PHASE_CHILD_FDS 4 /* the child set up its STDIN, STDOUT and STDERR; POPEN_NOSHELL_MODE_CLONE and _VFORK only */
+#define POPEN_NOSHELL_PHASE_CHILD_EXEC 5 /* the child calls exec(); POPEN_NOSHELL_MODE_CLONE and _VFORK only */
+#define POPEN_NOSHELL_PHASE_SPAWNED 6 /* the parent runs again; in POPEN_NOSHELL_MODE_CLONE and _VFORK the exec() is complete */
+#define POPEN_NOSHELL_PHASE_RETURN 7 /* popen_noshell_ex() returns */
+#define POPEN_NOSHELL_PHASE_FIRST_BYTE 8 /* popen_noshell_read() got the first output of the child */
+#define POPEN_NOSHELL_PHASE_EXIT 9 /* pclose_noshell() reaped the child */
+
+struct popen_noshell_tracer {
+	/* "ns" is the CLOCK_MONOTONIC time of the phase; called in the thread which spawns, never in the child */
+	void (*hook)(const struct popen_noshell_tracer *tracer, int phase, const struct popen_noshell_pass_to_pclose *arg, int64_t ns);
+	void *user_data;
 };
 
 struct popen_noshell_pass_to_pclose {
@@ -50,6 +212,169 @@ struct popen_noshell_pass_to_pclose {
 	int free_clone_mem;
 	void *stack;
 	struct popen_noshell_clone_arg *func_args;
+
+	/* deadlines, see popen_noshell_ex() */
+	int pidfd; /* -1 if not opened */
+	int kill_pgroup;
+	int kill_grace_ms;
+	int idle_timeout_ms;
+	int kill_stage; /* 0: running, 1: SIGTERM was sent, 2: SIGKILL was sent */
+	int timed_out;
+	int64_t deadline_ns; /* CLOCK_MONOTONIC */
+	int64_t last_io_ns;
+	int64_t kill_ns; /* when SIGKILL follows the SIGTERM */
+
+	/* used by popen_noshell_timers_*() */
+	struct popen_noshell_timers *timers;
+	int timers_index;
+	int64_t timers_key_ns;
+
+	/* tracing, see popen_noshell_set_tracer() */
+	const struct popen_noshell_tracer *tracer; /* NULL if not traced */
+	int trace_got_output;
+
+	int mode; /* for the library-wide counters */
+
+	/* when popen_noshell_ex() returns NULL because the child failed, this is POPEN_NOSHELL_CHILD_*; else POPEN_NOSHELL_CHILD_OK */
+	int child_stage;
+
+	struct popen_noshell_admission *admission; /* the child holds a slot there until pclose_noshell(); NULL if none */
+
+	int stderr_fd; /* stderr_mode 3: the read end of the STDERR pipe of the child, see popen_noshell_capture(); -1 otherwise */
+
+	struct popen_noshell_reaper *reaper; /* holds the exit status for pclose_noshell(); NULL if none */
+};
+
+/* how POPEN_NOSHELL_MODE_AUTO was resolved, see popen_noshell_auto_decision() */
+#define POPEN_NOSHELL_AUTO_DETECTED 0 /* by the features of libc and of the kernel */
+#define POPEN_NOSHELL_AUTO_ENV 1 /* by the environment variable POPEN_NOSHELL_MODE */
+#define POPEN_NOSHELL_AUTO_CALIBRATED 2 /* by popen_noshell_auto_calibrate() */
+
+struct popen_noshell_auto_decision {
+	int mode; /* the POPEN_NOSHELL_MODE_* which POPEN_NOSHELL_MODE_AUTO stands for */
+	int source; /* POPEN_NOSHELL_AUTO_* */
+	int glibc_major; /* 0 for another libc */
+	int glibc_minor;
+	int clone3; /* clone3() works, so the kernel resets the signal handlers of a POPEN_NOSHELL_MODE_CLONE child */
+	int pidfd; /* pidfd_open() works, so pclose_noshell() sleeps on the pidfd instead of polling */
+	int valgrind; /* we run under Valgrind, which turns clone(CLONE_VM) and vfork() into fork() */
+	int64_t calibrated_ns[POPEN_NOSHELL_MODES]; /* the median of a spawn + pclose_noshell(); 0 if not measured */
+};
+
+/* a single timerfd which serves the deadlines of many children at once */
+struct popen_noshell_timers {
+	int fd; /* poll() this for POLLIN and then call popen_noshell_timers_expire() */
+	struct popen_noshell_pass_to_pclose **heap;
+	int count;
+	int size;
+};
+
+/* how popen_noshell_reader_next() searches for the delimiter */
+#define POPEN_NOSHELL_SIMD_SCALAR 0
+#define POPEN_NOSHELL_SIMD_SSE2 1
+#define POPEN_NOSHELL_SIMD_AVX2 2
+
+/* splits the output of a child into records without copying them; see popen_noshell_reader_init() */
+struct popen_noshell_reader {
+	struct popen_noshell_pass_to_pclose *arg;
+	char *buf;
+	size_t size;
+	size_t begin; /* the start of the next record */
+	size_t scan; /* where the search for the delimiter continues */
+	size_t end; /* the end of the data */
+	char delim;
+	int eof;
+	int simd; /* POPEN_NOSHELL_SIMD_* */
+};
+
+/* the output of one stream of the child, see popen_noshell_capture() */
+struct popen_noshell_capture {
+	char *data; /* '\0'-terminated; free() it */
+	size_t len;
+	size_t size; /* allocated */
+	size_t max; /* set this before the capture; 0 means unlimited */
+	size_t dropped; /* the bytes over "max", which were read and discarded */
+};
+
+/* admission control for spawn storms, shared by many threads; see popen_noshell_admission_init() */
+struct popen_noshell_admission {
+	/* the limits; change them after popen_noshell_admission_init() and before the first spawn; 0 disables a check */
+	int max_in_flight; /* children spawned through this and not reaped by pclose_noshell() yet */
+	int min_free_fds; /* RLIMIT_NOFILE minus the open fds of the process */
+	int max_memory_pressure; /* percent of time stalled on memory, the "some avg10" of /proc/pressure/memory */
+	int max_wait_ms; /* a spawn which is not admitted in this time fails with EAGAIN; -1 waits forever */
+	int backoff_ms; /* the first sleep when a resource is short; it doubles after each try, up to 64 times this */
+
+	/* counters; read them under "lock" */
+	unsigned long admitted;
+	unsigned long delayed; /* admitted, but after waiting in the queue or backing off */
+	unsigned long retried; /* the spawn failed with EAGAIN, EMFILE, ENFILE or ENOMEM and was tried again */
+	unsigned long rejected; /* gave up after "max_wait_ms" */
+
+	pthread_mutex_t lock;
+	pthread_cond_t released; /* CLOCK_MONOTONIC */
+	int in_flight;
+	int psi_fd; /* /proc/pressure/memory; -1 if the kernel has no PSI */
+	int64_t checked_ns; /* the fds and PSI are checked at most once in 10 ms */
+	int short_of; /* the result of the last check: 0, EMFILE or ENOMEM */
+};
+
+/* the exit status of a child of a reaper, until pclose_noshell() takes it */
+struct popen_noshell_reaper_entry {
+	pid_t pid; /* 0 for an empty slot */
+	int pidfd; /* owned by the reaper; -1 once reaped or if the kernel has no pidfds */
+	int reaped;
+	int status;
+	struct rusage usage;
+};
+
+/* a background thread which reaps the children in batches; see popen_noshell_reaper_start() */
+struct popen_noshell_reaper {
+	int subreaper; /* PR_SET_CHILD_SUBREAPER, so that orphaned grandchildren are reaped too */
+
+	/* counters; read them under "lock" */
+	unsigned long reaped; /* children and grandchildren */
+	unsigned long batches; /* the sweeps which reaped anything */
+	unsigned long orphans; /* reaped, but not spawned through this reaper, e.g. grandchildren */
+
+	pthread_t thread;
+	pthread_mutex_t lock; /* guards the table, the counters, "waiters" and "stopped" */
+	pthread_cond_t reaped_cond;
+	pthread_rwlock_t reaping; /* spawns hold it for reading until their child is in the table, a sweep for writing */
+	struct popen_noshell_reaper_entry *table; /* open addressing by PID, linear probing */
+	int table_size; /* a power of 2 */
+	int table_count;
+	int reserved; /* slots for the spawns in progress */
+	int epoll_fd;
+	int event_fd; /* wakes the thread up to stop */
+	int no_pidfd; /* some children have no pidfd, so the thread sweeps periodically */
+	int waiters; /* pclose_noshell() calls which wait for the thread; popen_noshell_reaper_stop() waits for them in turn */
+	int stopped; /* 1 while popen_noshell_reaper_stop() runs, 2 once the thread reaps no more */
+	int prev_subreaper;
+};
+
+/* a child in a handle table, see popen_noshell_handles_init() */
+typedef uint64_t popen_noshell_handle; /* the generation in the upper 32 bits, the index of the record in the lower; never 0 */
+
+#define POPEN_NOSHELL_HANDLES_PER_CHUNK 64
+
+struct popen_noshell_handle_record {
+	uint32_t generation; /* odd while the record is in use; first, so that a check shares its cache line with "arg.fp" and "arg.pid" */
+	int published; /* popen_noshell_handle_open() returned the handle, so popen_noshell_handle_get() may give it out */
+	int next_free; /* the next record in the free list; -1 at its end */
+	struct popen_noshell_pass_to_pclose arg;
+} __attribute__((aligned(64))); /* no false sharing between the children of different threads */
+
+struct popen_noshell_handles {
+	pthread_mutex_t lock;
+	struct popen_noshell_handle_record **chunks; /* POPEN_NOSHELL_HANDLES_PER_CHUNK records each; they never move */
+	int chunks_count;
+	int free_head; /* -1 if all records are in use */
+	int live; /* open handles */
+	int pool_ctx; /* set it after popen_noshell_handles_init() to lend pooled spawn contexts, see there; 0 by default */
+	struct popen_noshell_ctx **ctx_pool; /* the spawn contexts which no spawn uses right now */
+	int ctx_pool_count;
+	int ctx_pool_size;
 };
 
 /***************************
@@ -59,19 +384,85 @@ struct popen_noshell_pass_to_pclose {
 /* this is the native function call */
 FILE *popen_noshell(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg, int stderr_mode);
 
+/* the same as popen_noshell() but accepts per-call options */
+void popen_noshell_options_init(struct popen_noshell_options *opts);
+FILE *popen_noshell_ex(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg, const struct popen_noshell_options *opts);
+
+/* per-thread spawn contexts, see popen_noshell_options.ctx */
+int popen_noshell_ctx_init(struct popen_noshell_ctx *ctx);
+void popen_noshell_ctx_destroy(struct popen_noshell_ctx *ctx);
+
+/* raw I/O on the pipe which honors the deadlines; don't mix with buffered stdio reads on the same FILE */
+ssize_t popen_noshell_read(struct popen_noshell_pass_to_pclose *arg, void *buf, size_t count);
+ssize_t popen_noshell_write(struct popen_noshell_pass_to_pclose *arg, const void *buf, size_t count);
+
+/* zero-copy records of the output, e.g. lines; don't mix with the FILE either */
+int popen_noshell_reader_init(struct popen_noshell_reader *reader, struct popen_noshell_pass_to_pclose *arg, size_t size, int delim);
+int popen_noshell_reader_next(struct popen_noshell_reader *reader, const char **record, size_t *len);
+void popen_noshell_reader_destroy(struct popen_noshell_reader *reader);
+
+/* reads STDOUT and the STDERR pipe of stderr_mode 3 at the same time, until both are at EOF */
+int popen_noshell_capture(struct popen_noshell_pass_to_pclose *arg, struct popen_noshell_capture *out, struct popen_noshell_capture *err);
+
+/* send a signal to the child, or to its process group if "new_process_group" was requested */
+int popen_noshell_kill(struct popen_noshell_pass_to_pclose *arg, int sig);
+
+/* children addressed by generation-checked handles instead of structs of the caller */
+int popen_noshell_handles_init(struct popen_noshell_handles *table);
+void popen_noshell_handles_destroy(struct popen_noshell_handles *table);
+popen_noshell_handle popen_noshell_handle_open(struct popen_noshell_handles *table, const char *file, const char * const *argv,
+	const char *type, const struct popen_noshell_options *opts);
+struct popen_noshell_pass_to_pclose *popen_noshell_handle_get(struct popen_noshell_handles *table, popen_noshell_handle handle);
+int popen_noshell_handle_close(struct popen_noshell_handles *table, popen_noshell_handle handle);
+
+/* start a command which nobody has to reap; its STDIN is at EOF and its STDOUT is /dev/null */
+int popen_noshell_spawn_detached(const char *file, const char * const *argv, const struct popen_noshell_options *opts, pid_t *pid);
+
+/* background reaping in batches, see popen_noshell_options.reaper */
+int popen_noshell_reaper_start(struct popen_noshell_reaper *reaper, int subreaper);
+void popen_noshell_reaper_stop(struct popen_noshell_reaper *reaper);
+
+/* admission control for spawn storms, see popen_noshell_options.admission */
+int popen_noshell_admission_init(struct popen_noshell_admission *adm);
+void popen_noshell_admission_destroy(struct popen_noshell_admission *adm);
+
+/* deadlines for many children, driven by a single timerfd */
+int popen_noshell_timers_init(struct popen_noshell_timers *timers);
+int popen_noshell_timers_add(struct popen_noshell_timers *timers, struct popen_noshell_pass_to_pclose *arg);
+void popen_noshell_timers_remove(struct popen_noshell_timers *timers, struct popen_noshell_pass_to_pclose *arg);
+int popen_noshell_timers_expire(struct popen_noshell_timers *timers);
+void popen_noshell_timers_destroy(struct popen_noshell_timers *timers);
+
 /* more insecure, but more compatible with popen() */
 FILE *popen_noshell_compat(const char *command, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg);
 
 /* call this when you have finished reading and writing from/to the child process */
 int pclose_noshell(struct popen_noshell_pass_to_pclose *arg); /* the pclose() equivalent */
+int pclose_noshell_rusage(struct popen_noshell_pass_to_pclose *arg, struct rusage *usage); /* ...which also returns the rusage of the child */
 
 /* this is the innovative faster vmfork() which shares memory with the parent and is very resource-light; see the source code for documentation */
 pid_t popen_noshell_vmfork(int (*fn)(void *), void *arg, void **memory_to_free_on_child_exit);
 
-/* used only for benchmarking purposes */
+/* library-wide counters; see popen_noshell_stats_snapshot() */
+void popen_noshell_stats_snapshot(struct popen_noshell_stats *stats);
+int popen_noshell_stats_publish(const char *name);
+int popen_noshell_stats_unpublish();
+
+/* spawn tracing; NULL disables it */
+void popen_noshell_set_tracer(const struct popen_noshell_tracer *tracer);
+
+/* the default mode for popen_noshell() and popen_noshell_options_init(); prefer popen_noshell_options.mode in threaded code */
 void popen_noshell_set_fork_mode(int mode);
 int popen_noshell_get_fork_mode();
 
+/* the program of POPEN_NOSHELL_MODE_TRAMPOLINE; NULL restores POPEN_NOSHELL_TRAMPOLINE_PATH */
+void popen_noshell_set_trampoline(const char *path);
+const char *popen_noshell_get_trampoline();
+
+/* POPEN_NOSHELL_MODE_AUTO */
+void popen_noshell_auto_decision(struct popen_noshell_auto_decision *decision);
+int popen_noshell_auto_calibrate(const char *file, const char * const *argv, int rounds);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,287 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef POPEN_NOSHELL_HPP
+#define POPEN_NOSHELL_HPP
+
+/*
+ * Header-only C++17 wrapper of the C API, e.g.:
+ *
+ *	auto child = popen_noshell_cpp::Process::spawn({"ls", "-la", dir}, "r");
+ *	std::string out = child.read_all();
+ *	popen_noshell_cpp::Result res = child.wait();
+ *
+ * A Process owns its child and reaps it in the destructor, so it is move-only. Link with popen_noshell.c as usual.
+ */
+
+#include "popen_noshell.h"
+#include <sys/wait.h>
+#include <errno.h>
+#include <string.h>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace popen_noshell_cpp {
+
+/*
+ * The argv of a child, built from std::string_view's. A string_view has no terminating '\0', so the strings are copied,
+ * but into a single buffer together with the argv pointers. Small lists fit into the object itself and need no heap.
+ * It points into itself, so it can be neither copied nor moved; pass it as a temporary to Process::spawn().
+ */
+class Args {
+public:
+	Args(std::initializer_list<std::string_view> args) {
+		assign(args.begin(), args.end());
+	}
+
+	// any range of things convertible to std::string_view, e.g. std::vector<std::string>
+	template <class Range>
+	explicit Args(const Range &args) {
+		assign(std::begin(args), std::end(args));
+	}
+
+	Args(const Args &) = delete;
+	Args &operator=(const Args &) = delete;
+
+	const char * const *argv() const noexcept { return argv_; }
+	const char *file() const noexcept { return argv_[0]; } // NULL for an empty list
+
+private:
+	static constexpr size_t inline_size = 512;
+
+	template <class It>
+	void assign(It first, It last) {
+		size_t count = 0, bytes = 0;
+		char *buf, *str;
+		const char **ptr;
+		It it;
+
+		for (it = first; it != last; ++it) {
+			++count;
+			bytes += std::string_view(*it).size() + 1;
+		}
+		bytes += (count + 1) * sizeof(char *);
+		if (bytes <= inline_size) {
+			buf = inline_;
+		} else {
+			heap_.reset(new char[bytes]); // operator new[] is aligned enough for the pointers
+			buf = heap_.get();
+		}
+
+		ptr = reinterpret_cast<const char **>(buf);
+		str = buf + (count + 1) * sizeof(char *);
+		for (it = first; it != last; ++it) {
+			std::string_view sv(*it);
+			memcpy(str, sv.data(), sv.size());
+			str[sv.size()] = '\0';
+			*ptr++ = str;
+			str += sv.size() + 1;
+		}
+		*ptr = NULL;
+		argv_ = reinterpret_cast<const char * const *>(buf);
+	}
+
+	alignas(char *) char inline_[inline_size];
+	std::unique_ptr<char[]> heap_;
+	const char * const *argv_;
+};
+
+/* what wait() returns */
+struct Result {
+	int status; // as returned by waitpid()
+	struct rusage usage; // of the child, as returned by wait4()
+	bool timed_out; // a deadline of popen_noshell_options killed the child
+
+	bool exited() const noexcept { return WIFEXITED(status); }
+	int exit_code() const noexcept { return (WIFEXITED(status) ? WEXITSTATUS(status) : -1); }
+	bool signaled() const noexcept { return WIFSIGNALED(status); }
+	int signal() const noexcept { return (WIFSIGNALED(status) ? WTERMSIG(status) : 0); }
+};
+
+/*
+ * A child spawned by popen_noshell_ex(). The destructor closes the pipe and reaps the child, which blocks until it exits;
+ * kill() it first if it may run forever, or detach() it to take over the C handle.
+ *
+ * The C handle lives on the heap, so neither moving a Process nor detach() invalidates it for popen_noshell_timers_add().
+ */
+class Process {
+public:
+	Process() noexcept = default;
+	Process(Process &&) noexcept = default;
+	Process &operator=(Process &&other) noexcept {
+		if (this != &other) {
+			reap_quietly();
+			arg_ = std::move(other.arg_);
+		}
+		return *this;
+	}
+	~Process() { reap_quietly(); }
+
+	// "type" and "opts" as for popen_noshell_ex(); NULL options take the defaults; throws std::system_error on failures
+	static Process spawn(const Args &args, const char *type = "r", const struct popen_noshell_options *opts = NULL) {
+		std::error_code ec;
+		Process child = spawn(args, type, opts, ec);
+
+		if (ec) throw std::system_error(ec, std::string("popen_noshell_ex(") + (args.file() ? args.file() : "") + ")");
+		return child;
+	}
+
+	// for an argv which is NULL-terminated already; set "argv_stable" in "opts" if no other thread changes it
+	static Process spawn(const char *file, const char * const *argv, const char *type = "r",
+		const struct popen_noshell_options *opts = NULL
+	) {
+		std::error_code ec;
+		Process child = spawn(file, argv, type, opts, ec);
+
+		if (ec) throw std::system_error(ec, std::string("popen_noshell_ex(") + (file ? file : "") + ")");
+		return child;
+	}
+
+	// the same but without exceptions; an empty Process is returned on failures
+	static Process spawn(const Args &args, const char *type, const struct popen_noshell_options *opts, std::error_code &ec) {
+		struct popen_noshell_options stable;
+
+		// nobody else sees the Args, so the clone() mode needs no copy of it
+		if (opts) stable = *opts;
+		else popen_noshell_options_init(&stable);
+		stable.argv_stable = 1;
+		return spawn(args.file(), args.argv(), type, &stable, ec);
+	}
+
+	static Process spawn(const char *file, const char * const *argv, const char *type, const struct popen_noshell_options *opts,
+		std::error_code &ec
+	) {
+		struct popen_noshell_options defaults;
+		Process child;
+
+		ec.clear();
+		if (!file) {
+			ec.assign(EINVAL, std::generic_category());
+			return child;
+		}
+		if (!opts) {
+			popen_noshell_options_init(&defaults);
+			opts = &defaults;
+		}
+		child.arg_.reset(new struct popen_noshell_pass_to_pclose());
+		if (!popen_noshell_ex(file, argv, type, child.arg_.get(), opts)) {
+			ec.assign(errno, std::generic_category());
+			child.arg_.reset();
+		}
+		return child;
+	}
+
+	explicit operator bool() const noexcept { return (bool)arg_; }
+	pid_t pid() const noexcept { return arg_->pid; }
+
+	// the pipe, for your own buffering or for poll(); don't mix it with the FILE * of native_handle()
+	int fd() const noexcept { return fileno(arg_->fp); }
+
+	// the C handle, e.g. for popen_noshell_timers_add(); the Process still owns it
+	struct popen_noshell_pass_to_pclose *native_handle() const noexcept { return arg_.get(); }
+
+	// popen_noshell_read() and popen_noshell_write(), which honor the deadlines
+	ssize_t read(void *buf, size_t count) noexcept { return popen_noshell_read(arg_.get(), buf, count); }
+	ssize_t write(const void *buf, size_t count) noexcept { return popen_noshell_write(arg_.get(), buf, count); }
+	ssize_t write(std::string_view data) noexcept { return write(data.data(), data.size()); }
+
+	// reads until EOF; throws std::system_error on failures
+	std::string read_all() {
+		std::string out;
+		size_t len = 0;
+		ssize_t ret;
+
+		while (1) {
+			if (out.size() - len < 4096) out.resize(len + 16384);
+			ret = read(&out[len], out.size() - len);
+			if (ret == 0) break;
+			if (ret < 0) {
+				if (errno == EINTR) continue;
+				throw std::system_error(errno, std::generic_category(), "popen_noshell_read()");
+			}
+			len += ret;
+		}
+		out.resize(len);
+		return out;
+	}
+
+	int kill(int sig) noexcept { return popen_noshell_kill(arg_.get(), sig); }
+
+	// closes the pipe and reaps the child; the Process is empty afterwards; throws std::system_error on failures
+	Result wait() {
+		std::unique_ptr<struct popen_noshell_pass_to_pclose> arg(std::move(arg_));
+		Result res;
+
+		memset(&res, 0, sizeof(res));
+		res.status = pclose_noshell_rusage(arg.get(), &res.usage);
+		if (res.status == -1) throw std::system_error(errno, std::generic_category(), "pclose_noshell()");
+		res.timed_out = arg->timed_out;
+		return res;
+	}
+
+	// gives up the ownership of the C handle itself, not of a copy, so that its timers entry stays valid;
+	// call pclose_noshell() on it yourself
+	std::unique_ptr<struct popen_noshell_pass_to_pclose> detach() noexcept { return std::move(arg_); }
+
+private:
+	void reap_quietly() noexcept {
+		if (arg_) {
+			pclose_noshell(arg_.get());
+			arg_.reset();
+		}
+	}
+
+	std::unique_ptr<struct popen_noshell_pass_to_pclose> arg_;
+};
+
+namespace detail {
+	inline const char *c_str(const char *str) noexcept { return str; }
+	inline const char *c_str(const std::string &str) noexcept { return str.c_str(); }
+	const char *c_str(std::string_view str) = delete; // not '\0'-terminated, use Args
+}
+
+/*
+ * spawn_ex("r", opts, "ls", "-la", path): the argv is an array on the stack of the caller, whose size is known at compile time.
+ * The arguments are C strings or std::string's, and they are passed to the child as they are, without any copy,
+ * so the spawn allocates nothing for them. Other threads must not change them until spawn_ex() returns.
+ * "type" and "opts" as for popen_noshell_ex(); NULL options take the defaults. Throws std::system_error on failures.
+ */
+template <class File, class... Strings>
+Process spawn_ex(const char *type, const struct popen_noshell_options *opts, const File &file, const Strings &... args) {
+	const char *argv[] = {detail::c_str(file), detail::c_str(args)..., NULL};
+	struct popen_noshell_options stable;
+
+	if (opts) stable = *opts;
+	else popen_noshell_options_init(&stable);
+	stable.argv_stable = 1;
+	return Process::spawn(argv[0], argv, type, &stable);
+}
+
+// spawn("ls", "-la", path) reads the output of the child with the default options
+template <class File, class... Strings>
+Process spawn(const File &file, const Strings &... args) {
+	return spawn_ex("r", NULL, file, args...);
+}
+
+} // namespace popen_noshell_cpp
+
+#endif
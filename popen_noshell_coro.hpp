@@ -0,0 +1,488 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef POPEN_NOSHELL_CORO_HPP
+#define POPEN_NOSHELL_CORO_HPP
+
+/*
+ * C++20 coroutines on top of popen_noshell.hpp, so that one thread can drive thousands of children, e.g.:
+ *
+ *	popen_noshell_cpp::Task<int> count_lines(popen_noshell_cpp::Reactor &reactor) {
+ *		auto spawn = popen_noshell_cpp::async_spawn(reactor, {"ls", "-la"});
+ *		auto child = co_await spawn;
+ *		std::string line;
+ *		int lines = 0;
+ *
+ *		while (co_await child.next_line(line)) ++lines;
+ *		co_await child.wait();
+ *		co_return lines;
+ *	}
+ *
+ *	popen_noshell_cpp::EpollReactor reactor;
+ *	int lines = reactor.run(count_lines(reactor));
+ *
+ * The coroutines sleep in a Reactor until the pipe of their child is readable or the child exits. EpollReactor is the
+ * reference one; plug your own event loop in by implementing the Reactor interface.
+ *
+ * The spawn itself does not wait for the child, only for its exec(), so "co_await async_spawn()" completes at once.
+ * The deadlines of popen_noshell_options are served by popen_noshell_timers, if the Reactor provides them.
+ */
+
+#include "popen_noshell.hpp"
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace popen_noshell_cpp {
+
+/* something which waits for an fd to become readable, see Reactor::watch() */
+class Waiter {
+public:
+	virtual void ready() = 0;
+
+protected:
+	~Waiter() = default;
+};
+
+class Reactor {
+public:
+	virtual ~Reactor() = default;
+
+	// calls "waiter->ready()" once, when "fd" becomes readable, hangs up or fails; "fd" is watched by one waiter at a time
+	virtual void watch(int fd, Waiter *waiter) = 0;
+
+	// stop watching "fd" before it gets closed; there must be no pending watch() for it
+	virtual void forget(int fd) noexcept = 0;
+
+	// the timers which serve the deadlines of the children; NULL if the deadlines are not supported
+	virtual struct popen_noshell_timers *timers() noexcept { return NULL; }
+};
+
+/* the reference Reactor: one epoll instance, plus one timerfd for the deadlines of all children */
+class EpollReactor : public Reactor {
+public:
+	EpollReactor() {
+		struct epoll_event ev;
+
+		epfd_ = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd_ < 0) throw std::system_error(errno, std::generic_category(), "epoll_create1()");
+		if (popen_noshell_timers_init(&timers_) != 0) {
+			int saved_errno = errno;
+			close(epfd_);
+			throw std::system_error(saved_errno, std::generic_category(), "popen_noshell_timers_init()");
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL; // the timers
+		if (epoll_ctl(epfd_, EPOLL_CTL_ADD, timers_.fd, &ev) != 0) {
+			int saved_errno = errno;
+			popen_noshell_timers_destroy(&timers_);
+			close(epfd_);
+			throw std::system_error(saved_errno, std::generic_category(), "epoll_ctl()");
+		}
+	}
+
+	~EpollReactor() override {
+		popen_noshell_timers_destroy(&timers_);
+		close(epfd_);
+	}
+
+	EpollReactor(const EpollReactor &) = delete;
+	EpollReactor &operator=(const EpollReactor &) = delete;
+
+	void watch(int fd, Waiter *waiter) override {
+		struct epoll_event ev;
+
+		// the fd stays in the epoll set after its one-shot event, so it is usually there already
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = waiter;
+		if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) != 0) {
+			if (errno != ENOENT || epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+				throw std::system_error(errno, std::generic_category(), "epoll_ctl()");
+			}
+		}
+		++pending_;
+	}
+
+	void forget(int fd) noexcept override {
+		epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	struct popen_noshell_timers *timers() noexcept override { return &timers_; }
+
+	// the number of watch()'es which did not fire yet
+	int pending() const noexcept { return pending_; }
+
+	// waits up to "timeout_ms" (-1 for forever) and dispatches the events; returns their number
+	int run_once(int timeout_ms) {
+		struct epoll_event events[64];
+		int i, count;
+
+		count = epoll_wait(epfd_, events, 64, timeout_ms);
+		if (count < 0) {
+			if (errno == EINTR) return 0;
+			throw std::system_error(errno, std::generic_category(), "epoll_wait()");
+		}
+		for (i = 0; i < count; ++i) {
+			if (!events[i].data.ptr) {
+				popen_noshell_timers_expire(&timers_);
+				continue;
+			}
+			--pending_;
+			static_cast<Waiter *>(events[i].data.ptr)->ready();
+		}
+		return count;
+	}
+
+	// runs until nothing waits any more
+	void run() {
+		while (pending_ > 0) run_once(-1);
+	}
+
+	// starts "task" and runs until it completes; returns its result
+	template <class Task>
+	auto run(Task &&task) {
+		task.start();
+		while (!task.done()) {
+			if (pending_ == 0) throw std::logic_error("EpollReactor::run(): the task waits for something else");
+			run_once(-1);
+		}
+		return task.result();
+	}
+
+private:
+	int epfd_;
+	int pending_ = 0;
+	struct popen_noshell_timers timers_;
+};
+
+namespace detail {
+	template <class T>
+	struct task_value {
+		std::optional<T> value;
+		void return_value(T v) { value.emplace(std::move(v)); }
+		T get() { return std::move(*value); }
+	};
+
+	template <>
+	struct task_value<void> {
+		void return_void() noexcept {}
+		void get() noexcept {}
+	};
+}
+
+/*
+ * A lazy coroutine. co_await it from another Task, or start() it and drive the Reactor until done().
+ * The frame is destroyed with the Task, so keep it alive until it completes.
+ */
+template <class T = void>
+class Task {
+public:
+	struct promise_type;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(handle_type h) noexcept {
+			std::coroutine_handle<> next = h.promise().continuation;
+			return (next ? next : std::noop_coroutine());
+		}
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type : detail::task_value<T> {
+		std::coroutine_handle<> continuation;
+		std::exception_ptr exception;
+
+		Task get_return_object() noexcept { return Task(handle_type::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		final_awaiter final_suspend() noexcept { return {}; }
+		void unhandled_exception() noexcept { exception = std::current_exception(); }
+	};
+
+	Task(Task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (h_) h_.destroy();
+			h_ = std::exchange(other.h_, {});
+		}
+		return *this;
+	}
+	~Task() { if (h_) h_.destroy(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+		h_.promise().continuation = caller;
+		return h_;
+	}
+	T await_resume() { return result(); }
+
+	void start() { h_.resume(); }
+	bool done() const noexcept { return h_.done(); }
+
+	// the co_return'ed value of a completed Task; rethrows its exception
+	T result() {
+		if (h_.promise().exception) std::rethrow_exception(h_.promise().exception);
+		return h_.promise().get();
+	}
+
+private:
+	explicit Task(handle_type h) noexcept : h_(h) {}
+
+	handle_type h_;
+};
+
+/*
+ * A Process whose output and exit are awaited. The awaiters read by popen_noshell_read() only when the Reactor
+ * reported the pipe as readable, so the thread never blocks. Don't move it while an awaiter is pending.
+ */
+class AsyncProcess {
+public:
+	AsyncProcess(Reactor &reactor, Process &&process) : reactor_(&reactor), process_(std::move(process)) {
+		struct popen_noshell_pass_to_pclose *arg = process_.native_handle();
+
+		if (reactor_->timers() && (arg->deadline_ns || arg->idle_timeout_ms)) {
+			if (popen_noshell_timers_add(reactor_->timers(), arg) != 0) {
+				throw std::system_error(errno, std::generic_category(), "popen_noshell_timers_add()");
+			}
+		}
+	}
+
+	AsyncProcess(AsyncProcess &&) noexcept = default;
+	AsyncProcess &operator=(AsyncProcess &&) noexcept = default;
+	~AsyncProcess() {
+		if (process_) reactor_->forget(process_.fd()); // the Process reaps the child
+	}
+
+	Process &process() noexcept { return process_; }
+	pid_t pid() const noexcept { return process_.pid(); }
+
+	/* "co_await next_chunk()" returns the next output; empty at EOF; valid until the next read */
+	class ChunkAwaiter : public Waiter {
+	public:
+		explicit ChunkAwaiter(AsyncProcess *proc) noexcept : proc_(proc) {}
+
+		bool await_ready() const noexcept { return (proc_->begin_ != proc_->end_ || proc_->eof_); }
+		void await_suspend(std::coroutine_handle<> h) {
+			handle_ = h;
+			proc_->reactor_->watch(proc_->process_.fd(), this);
+		}
+		std::string_view await_resume() {
+			std::string_view out;
+
+			if (error_) throw std::system_error(error_, std::generic_category(), "popen_noshell_read()");
+			out = std::string_view(proc_->buf_.data() + proc_->begin_, proc_->end_ - proc_->begin_);
+			proc_->begin_ = proc_->end_ = 0; // the buffer is reused by the next read
+			return out;
+		}
+
+		void ready() override {
+			if (proc_->fill() < 0) {
+				if (errno == EINTR || errno == EAGAIN) {
+					proc_->reactor_->watch(proc_->process_.fd(), this);
+					return;
+				}
+				error_ = errno;
+			}
+			handle_.resume();
+		}
+
+	private:
+		AsyncProcess *proc_;
+		std::coroutine_handle<> handle_;
+		int error_ = 0;
+	};
+
+	/* "co_await next_line(line)" stores the next line without its '\n'; returns false at EOF */
+	class LineAwaiter : public Waiter {
+	public:
+		LineAwaiter(AsyncProcess *proc, std::string &line) noexcept : proc_(proc), line_(&line) {}
+
+		bool await_ready() { return take(); }
+		void await_suspend(std::coroutine_handle<> h) {
+			handle_ = h;
+			proc_->reactor_->watch(proc_->process_.fd(), this);
+		}
+		bool await_resume() {
+			if (error_) throw std::system_error(error_, std::generic_category(), "popen_noshell_read()");
+			return got_;
+		}
+
+		void ready() override {
+			if (proc_->fill() < 0) {
+				if (errno != EINTR && errno != EAGAIN) {
+					error_ = errno;
+					handle_.resume();
+					return;
+				}
+			} else if (take()) {
+				handle_.resume();
+				return;
+			}
+			proc_->reactor_->watch(proc_->process_.fd(), this); // a partial line
+		}
+
+	private:
+		// true if the awaiter is done: a line was taken from the buffer, or EOF
+		bool take() {
+			const char *begin = proc_->buf_.data() + proc_->begin_;
+			size_t len = proc_->end_ - proc_->begin_;
+			const char *nl = (len ? static_cast<const char *>(memchr(begin, '\n', len)) : NULL);
+
+			if (nl) {
+				line_->assign(begin, nl - begin);
+				proc_->begin_ += nl - begin + 1;
+				got_ = true;
+				return true;
+			}
+			if (proc_->eof_) {
+				line_->assign(begin, len); // the last line may lack its '\n'
+				proc_->begin_ = proc_->end_;
+				got_ = (len > 0);
+				return true;
+			}
+			return false;
+		}
+
+		AsyncProcess *proc_;
+		std::string *line_;
+		std::coroutine_handle<> handle_;
+		bool got_ = false;
+		int error_ = 0;
+	};
+
+	/*
+	 * "co_await wait()" closes the pipe, waits for the child to exit, and reaps it; see Process::wait().
+	 * It blocks the thread only if the kernel has no pidfd support.
+	 */
+	class ExitAwaiter : public Waiter {
+	public:
+		explicit ExitAwaiter(AsyncProcess *proc) noexcept : proc_(proc) {}
+
+		bool await_ready() {
+			struct popen_noshell_pass_to_pclose *arg = proc_->process_.native_handle();
+
+			// the child may wait for EOF, so close our end now; /dev/null keeps the fd valid for pclose_noshell()
+			fflush(arg->fp);
+			proc_->reactor_->forget(proc_->process_.fd());
+			int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+			if (null_fd < 0) return true;
+			dup3(null_fd, proc_->process_.fd(), O_CLOEXEC);
+			close(null_fd);
+
+#ifdef SYS_pidfd_open
+			if (arg->pidfd < 0) arg->pidfd = syscall(SYS_pidfd_open, arg->pid, 0); // closed by pclose_noshell()
+#endif
+			return (arg->pidfd < 0);
+		}
+		void await_suspend(std::coroutine_handle<> h) {
+			handle_ = h;
+			proc_->reactor_->watch(proc_->process_.native_handle()->pidfd, this);
+		}
+		Result await_resume() {
+			struct popen_noshell_pass_to_pclose *arg = proc_->process_.native_handle();
+
+			if (arg->pidfd >= 0) proc_->reactor_->forget(arg->pidfd);
+			return proc_->process_.wait();
+		}
+
+		void ready() override { handle_.resume(); }
+
+	private:
+		AsyncProcess *proc_;
+		std::coroutine_handle<> handle_;
+	};
+
+	ChunkAwaiter next_chunk() noexcept { return ChunkAwaiter(this); }
+	LineAwaiter next_line(std::string &line) noexcept { return LineAwaiter(this, line); }
+	ExitAwaiter wait() noexcept { return ExitAwaiter(this); }
+
+private:
+	// one popen_noshell_read() into the buffer; returns its result
+	ssize_t fill() {
+		struct popen_noshell_pass_to_pclose *arg = process_.native_handle();
+		ssize_t ret;
+
+		if (begin_ == end_) begin_ = end_ = 0;
+		if (buf_.size() - end_ < 4096) {
+			if (begin_ > 0) {
+				memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+				end_ -= begin_;
+				begin_ = 0;
+			}
+			if (buf_.size() - end_ < 4096) buf_.resize(buf_.empty() ? 65536 : buf_.size() * 2);
+		}
+
+		ret = popen_noshell_read(arg, buf_.data() + end_, buf_.size() - end_);
+		if (ret > 0) end_ += ret;
+		if (ret == 0) eof_ = true;
+		return ret;
+	}
+
+	Reactor *reactor_;
+	Process process_;
+	std::vector<char> buf_;
+	size_t begin_ = 0;
+	size_t end_ = 0;
+	bool eof_ = false;
+};
+
+/* see async_spawn() */
+class SpawnAwaiter {
+public:
+	SpawnAwaiter(Reactor &reactor, const Args &args, const char *type, const struct popen_noshell_options *opts) : reactor_(&reactor) {
+		process_ = Process::spawn(args, type, opts, ec_);
+	}
+
+	bool await_ready() const noexcept { return true; }
+	void await_suspend(std::coroutine_handle<>) noexcept {}
+	AsyncProcess await_resume() {
+		if (ec_) throw std::system_error(ec_, "popen_noshell_ex()");
+		return AsyncProcess(*reactor_, std::move(process_));
+	}
+
+private:
+	Reactor *reactor_;
+	Process process_;
+	std::error_code ec_;
+};
+
+/*
+ * "co_await async_spawn()" returns an AsyncProcess; throws std::system_error on failures.
+ * GCC 12 fails on a braced list inside a co_await expression ("array used as initializer"); call async_spawn() in a
+ * separate statement there and co_await its result.
+ */
+inline SpawnAwaiter async_spawn(Reactor &reactor, std::initializer_list<std::string_view> args, const char *type = "r",
+	const struct popen_noshell_options *opts = NULL
+) {
+	return SpawnAwaiter(reactor, Args(args), type, opts);
+}
+
+template <class Range>
+SpawnAwaiter async_spawn(Reactor &reactor, const Range &args, const char *type = "r", const struct popen_noshell_options *opts = NULL) {
+	return SpawnAwaiter(reactor, Args(args), type, opts);
+}
+
+} // namespace popen_noshell_cpp
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+#include "popen_noshell.h"
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Prints the library-wide counters of a process which called popen_noshell_stats_publish(name).
+ * With an interval, it keeps printing the rates per second, like vmstat does.
+ *
+ * Compile and run via:
+ *	gcc -Wall popen_noshell_stat.c -o popen_noshell_stat && ./popen_noshell_stat NAME [interval_sec]
+ */
+
+const char *mode_names[] = {"clone", "fork", "posix_spawn", "vfork", "trampoline"};
+
+const struct popen_noshell_stats *map_stats(const char *name) {
+	const struct popen_noshell_stats *stats;
+	char path[256];
+	struct stat st;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "/dev/shm/%s", name) >= (int)sizeof(path)) {
+		errx(EXIT_FAILURE, "The name is too long: %s", name);
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err(EXIT_FAILURE, "open(%s)", path);
+	}
+	if (fstat(fd, &st) != 0) {
+		err(EXIT_FAILURE, "fstat(%s)", path);
+	}
+	if (st.st_size < (off_t)sizeof(struct popen_noshell_stats)) {
+		errx(EXIT_FAILURE, "%s: Too small to be published by popen_noshell_stats_publish()", path);
+	}
+	stats = (const struct popen_noshell_stats *)mmap(NULL, sizeof(struct popen_noshell_stats), PROT_READ, MAP_SHARED, fd, 0);
+	if (stats == MAP_FAILED) {
+		err(EXIT_FAILURE, "mmap(%s)", path);
+	}
+	close(fd);
+
+	if (stats->magic != POPEN_NOSHELL_STATS_MAGIC) {
+		errx(EXIT_FAILURE, "%s: Not published by popen_noshell_stats_publish()", path);
+	}
+	if (stats->version != POPEN_NOSHELL_STATS_VERSION) {
+		errx(EXIT_FAILURE, "%s: Version %u, but we know only version %d", path, stats->version, POPEN_NOSHELL_STATS_VERSION);
+	}
+	if (kill(stats->pid, 0) != 0 && errno == ESRCH) {
+		warnx("%s: Process %d is gone, the counters are stale", path, stats->pid);
+	}
+
+	return stats;
+}
+
+// like popen_noshell_stats_snapshot(), but of another process
+void snapshot(const struct popen_noshell_stats *shm, struct popen_noshell_stats *out) {
+	int mode, stage;
+
+	*out = *shm;
+	for (mode = 0; mode < POPEN_NOSHELL_MODES; ++mode) { // the single fields must not be torn
+		out->modes[mode].spawns = __atomic_load_n(&shm->modes[mode].spawns, __ATOMIC_RELAXED);
+		for (stage = 0; stage < POPEN_NOSHELL_STAGES; ++stage) {
+			out->modes[mode].failures[stage] = __atomic_load_n(&shm->modes[mode].failures[stage], __ATOMIC_RELAXED);
+		}
+		out->modes[mode].exec_failures = __atomic_load_n(&shm->modes[mode].exec_failures, __ATOMIC_RELAXED);
+		out->modes[mode].spawn_ns = __atomic_load_n(&shm->modes[mode].spawn_ns, __ATOMIC_RELAXED);
+		out->modes[mode].bytes_read = __atomic_load_n(&shm->modes[mode].bytes_read, __ATOMIC_RELAXED);
+		out->modes[mode].bytes_written = __atomic_load_n(&shm->modes[mode].bytes_written, __ATOMIC_RELAXED);
+		out->modes[mode].live_children = __atomic_load_n(&shm->modes[mode].live_children, __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t total_failures(const struct popen_noshell_mode_stats *m) {
+	uint64_t sum = 0;
+	int stage;
+
+	for (stage = 0; stage < POPEN_NOSHELL_STAGES; ++stage) {
+		sum += m->failures[stage];
+	}
+	return sum;
+}
+
+void print_totals(const struct popen_noshell_stats *stats) {
+	const struct popen_noshell_mode_stats *m;
+	int mode;
+
+	printf("pid %d\n", stats->pid);
+	printf("%-12s %12s %8s %8s %8s %8s %8s %10s %14s %14s %6s\n", "mode", "spawns", "f_args", "f_pipe", "f_spawn",
+		"f_fdopen", "f_exec", "avg_us", "bytes_read", "bytes_written", "live");
+	for (mode = 0; mode < POPEN_NOSHELL_MODES; ++mode) {
+		m = &stats->modes[mode];
+		printf("%-12s %12llu %8llu %8llu %8llu %8llu %8llu %10.1f %14llu %14llu %6lld\n", mode_names[mode],
+			(unsigned long long)m->spawns,
+			(unsigned long long)m->failures[POPEN_NOSHELL_STAGE_ARGS],
+			(unsigned long long)m->failures[POPEN_NOSHELL_STAGE_PIPE],
+			(unsigned long long)m->failures[POPEN_NOSHELL_STAGE_SPAWN],
+			(unsigned long long)m->failures[POPEN_NOSHELL_STAGE_FDOPEN],
+			(unsigned long long)m->exec_failures,
+			(m->spawns ? m->spawn_ns / 1000.0 / m->spawns : 0.0),
+			(unsigned long long)m->bytes_read, (unsigned long long)m->bytes_written, (long long)m->live_children);
+	}
+}
+
+void print_rates(const struct popen_noshell_stats *prev, const struct popen_noshell_stats *cur, int interval) {
+	const struct popen_noshell_mode_stats *p, *c;
+	uint64_t spawns;
+	int mode;
+
+	for (mode = 0; mode < POPEN_NOSHELL_MODES; ++mode) {
+		p = &prev->modes[mode];
+		c = &cur->modes[mode];
+		spawns = c->spawns - p->spawns;
+		printf("%-12s %10.1f spawns/s %8.1f fails/s %10.1f avg_us %12.0f rd_B/s %12.0f wr_B/s %6lld live\n", mode_names[mode],
+			(double)spawns / interval,
+			(double)(total_failures(c) + c->exec_failures - total_failures(p) - p->exec_failures) / interval,
+			(spawns ? (c->spawn_ns - p->spawn_ns) / 1000.0 / spawns : 0.0),
+			(double)(c->bytes_read - p->bytes_read) / interval,
+			(double)(c->bytes_written - p->bytes_written) / interval,
+			(long long)c->live_children);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	const struct popen_noshell_stats *shm;
+	struct popen_noshell_stats prev, cur;
+	int interval = 0;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s NAME [interval_sec]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc == 3) {
+		interval = atoi(argv[2]);
+		if (interval < 1) {
+			errx(EXIT_FAILURE, "The interval must be a positive number of seconds");
+		}
+	}
+
+	shm = map_stats(argv[1]);
+	snapshot(shm, &cur);
+	print_totals(&cur);
+	if (!interval) return 0;
+
+	printf("\n");
+	while (1) {
+		prev = cur;
+		sleep(interval);
+		snapshot(shm, &cur);
+		print_rates(&prev, &cur, interval);
+	}
+}
@@ -16,6 +16,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses>.
  */
 
+// _GNU_SOURCE must be defined as early as possible
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "popen_noshell.h"
 #include <err.h>
 #include <stdio.h>
@@ -26,12 +31,21 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <limits.h>
+#include <sched.h>
 
 /***************************************************
  * popen_noshell C unit test and use-case examples *
  ***************************************************
  *
  * Compile and test via:
+ * 	gcc -Wall -O2 -static popen_noshell_trampoline.c -o popen_noshell_trampoline # else POPEN_NOSHELL_MODE_TRAMPOLINE is skipped
  * 	gcc -Wall popen_noshell.c popen_noshell_tests.c -o popen_noshell_tests && ./popen_noshell_tests
  *	# XXX: also run the examples in "popen_noshell_examples.c"
  *
@@ -90,6 +104,12 @@ FILE *safe_popen_noshell(const char *file, const char * const *argv, const char
 	return fp;
 }
 
+FILE *safe_popen_noshell_ex(const char *file, const char * const *argv, const char *type, struct popen_noshell_pass_to_pclose *pclose_arg, const struct popen_noshell_options *opts) {
+	FILE *fp = popen_noshell_ex(file, argv, type, pclose_arg, opts);
+	if (!fp) err(EXIT_FAILURE, "popen_noshell_ex");
+	return fp;
+}
+
 void safe_pclose_noshell(struct popen_noshell_pass_to_pclose *arg) {
 	int status;
 
@@ -97,6 +117,28 @@ void safe_pclose_noshell(struct popen_noshell_pass_to_pclose *arg) {
 	assert_status_exit_code(0, status);
 }
 
+int have_trampoline;
+
+// POPEN_NOSHELL_MODE_TRAMPOLINE uses the trampoline next to us, as it was compiled above; its tests are skipped without it
+void use_local_trampoline() {
+	static char path[PATH_MAX];
+	ssize_t len;
+	char *slash;
+
+	len = readlink("/proc/self/exe", path, sizeof(path) - sizeof("/popen_noshell_trampoline"));
+	if (len <= 0) err(EXIT_FAILURE, "readlink(/proc/self/exe)");
+	path[len] = '\0';
+	slash = strrchr(path, '/');
+	strcpy(slash, "/popen_noshell_trampoline");
+	popen_noshell_set_trampoline(path);
+	have_trampoline = (access(path, X_OK) == 0);
+}
+
+// the modes which the tests cannot run here
+int skip_mode(int mode) {
+	return (mode == POPEN_NOSHELL_MODE_TRAMPOLINE && !have_trampoline);
+}
+
 void unit_test(int reading, char *argv[], char *expected_string, int expected_signal, int expected_exit_code) {
 	FILE *fp;
 	char buf[256];
@@ -135,10 +177,24 @@ void unit_test(int reading, char *argv[], char *expected_string, int expected_si
 	//free(received); // memory allocated by alloca() cannot be free()'d
 }
 
+// the child cannot exec() "argv[0]", which popen_noshell() reports at once
+void unit_test_exec_failure(char *argv[], int expected_errno) {
+	struct popen_noshell_pass_to_pclose pclose_arg;
+	int stderr_mode = (do_unit_tests_ignore_stderr ? 1 : 0);
+
+	if (popen_noshell(argv[0], (const char * const *)argv, "r", &pclose_arg, stderr_mode) != NULL) {
+		errx(EXIT_FAILURE, "unit_test_exec_failure(): popen_noshell(%s) must have returned NULL", argv[0]);
+	}
+	assert_int(expected_errno, errno, "unit_test_exec_failure(): errno");
+	if (popen_noshell_get_fork_mode() != POPEN_NOSHELL_MODE_POSIX_SPAWN) {
+		assert_int(POPEN_NOSHELL_CHILD_EXEC, pclose_arg.child_stage, "unit_test_exec_failure(): child stage");
+	}
+	assert_int(-1, waitpid(-1, NULL, WNOHANG), "unit_test_exec_failure(): the child is reaped");
+}
+
 void do_unit_tests() {
 	int test_num = 0;
 	int more_to_test = 1;
-	int ec;
 
 	do {
 		++test_num;
@@ -146,12 +202,7 @@ void do_unit_tests() {
 		switch (test_num) {
 			case 1: {
 				char *argv[] = {"/", NULL};
-				if (popen_noshell_get_fork_mode() == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
-					ec = 127;
-				} else {
-					ec = 255;
-				}
-				unit_test(1, argv, "", 0, ec); // failed to execute binary (status code is -1, STDOUT is empty, STDERR text)
+				unit_test_exec_failure(argv, EACCES); // failed to execute binary (popen_noshell() returns NULL, STDERR text)
 				break;
 			}
 			case 2: {
@@ -294,11 +345,10 @@ int _issue_8_call_popen(int stderr_mode) {
 }
 
 void issue_8_stderr_mode_test_invalid_mode() {
-	int last_valid_mode = 2;
+	int last_valid_mode = 3;
 	int stderr_mode;
 	int status;
 	pid_t pid, ret;
-	int saved_stderr_fd;
 	int got_err;
 
 	for (stderr_mode = 0; stderr_mode <= last_valid_mode; ++stderr_mode) { /* no errors expected */
@@ -313,19 +363,14 @@ void issue_8_stderr_mode_test_invalid_mode() {
 	}
 
 	if (pid == 0) { // forked process
-		saved_stderr_fd = _issue_8_mute_stderr(); // temporarily
+		(void) _issue_8_mute_stderr(); // until the exit below
 		// XXX: When the popen_noshell() call fails before its exec() phase,
 		// XXX: the opened "saved_stderr_fd" is detected as leaked by Valgrind,
 		// XXX: but this is unavoidable.
 		status = _issue_8_call_popen(stderr_mode /* invalid */);
-		if (popen_noshell_get_fork_mode() == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
-			// this must never be reached
-			// since safe_popen_noshell() already died
-			exit(201);
-		}
-		_issue_8_restore_stderr(saved_stderr_fd);
-		assert_status_exit_code(254, status);
-		satisfy_open_FDs_leak_detection_and_exit();
+		// this must never be reached
+		// since safe_popen_noshell() already died
+		exit(201);
 	}
 	
 	/* parent continues here */
@@ -335,14 +380,10 @@ void issue_8_stderr_mode_test_invalid_mode() {
 		errx(EXIT_FAILURE, "waitpid() failed");
 	}
 
-	if (popen_noshell_get_fork_mode() == POPEN_NOSHELL_MODE_POSIX_SPAWN) {
-		// posix_spawn() detects the error before it executes a child process
-		// and therefore, popen_noshell() returns NULL
-		// which is caught early by safe_popen_noshell() which dies with exit code 1
-		got_err = (status >> 8 != 1);
-	} else {
-		got_err = (status != 0);
-	}
+	// posix_spawn() detects the error before it executes a child process, and the other modes get it
+	// from the child through the error channel; either way popen_noshell() returns NULL
+	// which is caught early by safe_popen_noshell() which dies with exit code 1
+	got_err = (status >> 8 != 1);
 	if (got_err) {
 		errx(EXIT_FAILURE,
 			"issue_8_stderr_mode_test_invalid_mode(): failed for %d (exit code=%d, status=%d)",
@@ -396,6 +437,1212 @@ void issue_8_stderr_mode_test_option_2() {
 	}
 }
 
+void feature_deadlines() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc, pcs[3];
+	struct popen_noshell_timers timers;
+	struct pollfd pfd;
+	const char *cmd_sleep[] = {bin_bash, "-c", "sleep 30", NULL};
+	const char *cmd_trap[] = {bin_bash, "-c", "trap '' TERM; while true; do sleep 1; done", NULL};
+	const char *cmd_idle[] = {bin_bash, "-c", "echo hello; sleep 30", NULL};
+	char buf[256];
+	ssize_t n;
+	int i, signalled;
+
+	popen_noshell_options_init(&opts);
+	opts.stderr_mode = 1;
+
+	// total deadline
+	opts.timeout_ms = 100;
+	safe_popen_noshell_ex(cmd_sleep[0], cmd_sleep, "r", &pc, &opts);
+	assert_status_signal(SIGTERM, pclose_noshell(&pc));
+	assert_int(1, pc.timed_out, "feature_deadlines(): timed_out");
+
+	// SIGTERM is ignored by the whole process group, so SIGKILL must follow
+	opts.new_process_group = 1;
+	opts.kill_grace_ms = 100;
+	safe_popen_noshell_ex(cmd_trap[0], cmd_trap, "r", &pc, &opts);
+	assert_status_signal(SIGKILL, pclose_noshell(&pc));
+
+	// inactivity timeout
+	opts.timeout_ms = 0;
+	opts.idle_timeout_ms = 200;
+	opts.kill_grace_ms = 5000;
+	safe_popen_noshell_ex(cmd_idle[0], cmd_idle, "r", &pc, &opts);
+	n = popen_noshell_read(&pc, buf, sizeof(buf) - 1);
+	assert_int(6, (int)n, "feature_deadlines(): popen_noshell_read() length");
+	n = popen_noshell_read(&pc, buf, sizeof(buf) - 1);
+	assert_int(-1, (int)n, "feature_deadlines(): popen_noshell_read() after the idle timeout");
+	assert_int(ETIMEDOUT, errno, "feature_deadlines(): errno");
+	assert_status_signal(SIGTERM, pclose_noshell(&pc));
+
+	// many children, one timerfd
+	if (popen_noshell_timers_init(&timers) != 0) err(EXIT_FAILURE, "popen_noshell_timers_init()");
+	opts.idle_timeout_ms = 0;
+	for (i = 0; i < 3; ++i) {
+		opts.timeout_ms = 300 - i * 100; // in reverse order of the spawns
+		safe_popen_noshell_ex(cmd_sleep[0], cmd_sleep, "r", &pcs[i], &opts);
+		if (popen_noshell_timers_add(&timers, &pcs[i]) != 0) err(EXIT_FAILURE, "popen_noshell_timers_add()");
+	}
+	pfd.fd = timers.fd;
+	pfd.events = POLLIN;
+	for (signalled = 0; signalled < 3; signalled += popen_noshell_timers_expire(&timers)) {
+		if (poll(&pfd, 1, 5000) != 1) errx(EXIT_FAILURE, "feature_deadlines(): the timerfd never fired");
+	}
+	for (i = 0; i < 3; ++i) {
+		assert_status_signal(SIGTERM, pclose_noshell(&pcs[i]));
+	}
+	assert_int(0, timers.count, "feature_deadlines(): timers left");
+	popen_noshell_timers_destroy(&timers);
+}
+
+void feature_per_call_options() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {bin_bash, "-c", "echo \"$POPEN_NOSHELL_TEST\"", NULL};
+	char *envp[] = {"POPEN_NOSHELL_TEST=per-call env", NULL};
+	int default_mode = popen_noshell_get_fork_mode();
+	char buf[256];
+	FILE *fp;
+	int mode;
+
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		popen_noshell_options_init(&opts);
+		assert_int(default_mode, opts.mode, "feature_per_call_options(): default mode");
+		opts.mode = mode;
+		opts.envp = envp;
+		opts.pipe_size = 256 * 1024;
+		opts.stack_size = 64 * 1024;
+
+		fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		assert_int(opts.pipe_size, fcntl(fileno(fp), F_GETPIPE_SZ), "feature_per_call_options(): pipe size");
+		if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_per_call_options(): no output");
+		assert_string("per-call env\n", buf, "feature_per_call_options(): environment");
+		safe_pclose_noshell(&pc);
+	}
+	assert_int(default_mode, popen_noshell_get_fork_mode(), "feature_per_call_options(): global mode untouched");
+}
+
+int _lowest_free_fd() {
+	int fd = open("/dev/null", O_RDONLY);
+
+	if (fd < 0) err(EXIT_FAILURE, "open(/dev/null)");
+	close(fd);
+	return fd;
+}
+
+void feature_argv_stable() {
+	struct popen_noshell_ctx ctx;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	char arg[] = "in place";
+	const char *cmd[] = {"echo", arg, NULL};
+	const char *cmd_missing[] = {"/non-existent", NULL};
+	char buf[256];
+	FILE *fp;
+	int i, free_fd;
+
+	free_fd = _lowest_free_fd();
+	if (popen_noshell_ctx_init(&ctx) != 0) err(EXIT_FAILURE, "popen_noshell_ctx_init()");
+	for (i = 0; i < 3; ++i) {
+		popen_noshell_options_init(&opts);
+		opts.mode = (i < 2 ? POPEN_NOSHELL_MODE_CLONE : POPEN_NOSHELL_MODE_VFORK);
+		opts.argv_stable = 1;
+		opts.ctx = (i == 1 ? &ctx : NULL);
+
+		fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		assert_int(1, pc.func_args == NULL, "feature_argv_stable(): nothing copied");
+		arg[0] = 'X'; // the child did its exec() already
+		if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_argv_stable(): no output");
+		assert_string("in place\n", buf, "feature_argv_stable(): argv");
+		safe_pclose_noshell(&pc);
+		arg[0] = 'i';
+
+		if (popen_noshell_ex(cmd_missing[0], cmd_missing, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_argv_stable(): exec() succeeded");
+		assert_int(ENOENT, errno, "feature_argv_stable(): errno");
+	}
+	popen_noshell_ctx_destroy(&ctx);
+	assert_int(free_fd, _lowest_free_fd(), "feature_argv_stable(): no fds leaked");
+}
+
+void feature_reader() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	struct popen_noshell_reader reader;
+	// a record longer than the buffer, an empty one, and a last one without its delimiter
+	const char *cmd[] = {bin_bash, "-c", "printf 'short\\nrecord two\\n%0100d\\n\\nlast' 0", NULL};
+	const char *cmd_nul[] = {bin_bash, "-c", "printf 'a\\0b c\\0'", NULL};
+	const char *expected[] = {"short", "record two", NULL, "", "last"};
+	char zeros[101];
+	const char *record;
+	size_t len;
+	int simd, i;
+
+	memset(zeros, '0', 100);
+	zeros[100] = '\0';
+	expected[2] = zeros;
+	popen_noshell_options_init(&opts);
+
+	for (simd = POPEN_NOSHELL_SIMD_SCALAR; simd <= POPEN_NOSHELL_SIMD_AVX2; ++simd) {
+		safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		if (popen_noshell_reader_init(&reader, &pc, 16, '\n') != 0) err(EXIT_FAILURE, "popen_noshell_reader_init()");
+		if (simd > reader.simd) { // the CPU lacks it
+			popen_noshell_reader_destroy(&reader);
+			safe_pclose_noshell(&pc);
+			break;
+		}
+		reader.simd = simd;
+		for (i = 0; i < 5; ++i) {
+			if (popen_noshell_reader_next(&reader, &record, &len) != 1) errx(EXIT_FAILURE, "feature_reader(): record %d is missing", i);
+			assert_int((int)strlen(expected[i]), (int)len, "feature_reader(): record length");
+			assert_int(0, memcmp(expected[i], record, len), "feature_reader(): record");
+		}
+		assert_int(0, popen_noshell_reader_next(&reader, &record, &len), "feature_reader(): EOF");
+		assert_int(0, popen_noshell_reader_next(&reader, &record, &len), "feature_reader(): EOF again");
+		popen_noshell_reader_destroy(&reader);
+		safe_pclose_noshell(&pc);
+	}
+
+	safe_popen_noshell_ex(cmd_nul[0], cmd_nul, "r", &pc, &opts);
+	if (popen_noshell_reader_init(&reader, &pc, 0, '\0') != 0) err(EXIT_FAILURE, "popen_noshell_reader_init()");
+	assert_int(1, popen_noshell_reader_next(&reader, &record, &len), "feature_reader(): NUL-delimited");
+	assert_int(1, len == 1 && record[0] == 'a', "feature_reader(): NUL-delimited record");
+	assert_int(1, popen_noshell_reader_next(&reader, &record, &len), "feature_reader(): NUL-delimited");
+	assert_int(1, len == 3 && memcmp(record, "b c", 3) == 0, "feature_reader(): NUL-delimited record");
+	assert_int(0, popen_noshell_reader_next(&reader, &record, &len), "feature_reader(): NUL-delimited EOF");
+	popen_noshell_reader_destroy(&reader);
+	safe_pclose_noshell(&pc);
+}
+
+void feature_capture() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	struct popen_noshell_capture out, errs;
+	// STDERR fills up its pipe before STDOUT starts, then both are interleaved
+	const char *cmd[] = {bin_bash, "-c",
+		"head -c 300000 /dev/zero | tr '\\0' e >&2; for i in $(seq 1 1000); do printf '%0499d\\n' 0; printf 'e%0498d\\n' 0 >&2; done; echo end", NULL};
+	const char *cmd_w[] = {bin_bash, "-c", "head -c 200000 /dev/zero >&2; read x; echo \"got $x\" >&2", NULL};
+	const char *cmd_sleep[] = {bin_bash, "-c", "exec sleep 10", NULL};
+	const char *cmd_true[] = {"true", NULL};
+	FILE *fp;
+	int modes[] = {POPEN_NOSHELL_MODE_CLONE, POPEN_NOSHELL_MODE_POSIX_SPAWN, POPEN_NOSHELL_MODE_FORK, POPEN_NOSHELL_MODE_VFORK, POPEN_NOSHELL_MODE_TRAMPOLINE};
+	int i, free_fd;
+
+	free_fd = _lowest_free_fd();
+	for (i = 0; i < (int)(sizeof(modes)/sizeof(modes[0])); ++i) {
+		if (skip_mode(modes[i])) continue;
+		popen_noshell_options_init(&opts);
+		opts.mode = modes[i];
+		opts.stderr_mode = 3;
+
+		safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		assert_int(1, pc.stderr_fd >= 0, "feature_capture(): STDERR pipe");
+		out.max = 0;
+		errs.max = 1000;
+		if (popen_noshell_capture(&pc, &out, &errs) != 0) err(EXIT_FAILURE, "popen_noshell_capture()");
+		assert_int(500004, (int)out.len, "feature_capture(): STDOUT length");
+		assert_int(0, (int)out.dropped, "feature_capture(): STDOUT dropped");
+		assert_string("end\n", out.data + out.len - 4, "feature_capture(): STDOUT tail");
+		assert_int(1000, (int)errs.len, "feature_capture(): STDERR bounded");
+		assert_int(800000 - 1000, (int)errs.dropped, "feature_capture(): STDERR dropped");
+		assert_int(1000, (int)strlen(errs.data), "feature_capture(): STDERR terminated");
+		assert_int(1, strchr(errs.data, '0') == NULL, "feature_capture(): STDERR content");
+		safe_pclose_noshell(&pc);
+		free(out.data);
+		free(errs.data);
+
+		fp = safe_popen_noshell_ex(cmd_w[0], cmd_w, "w", &pc, &opts);
+		fprintf(fp, "input\n");
+		fflush(fp);
+		out.max = 0;
+		if (popen_noshell_capture(&pc, &out, NULL) == 0 || errno != EINVAL) errx(EXIT_FAILURE, "feature_capture(): STDOUT in \"w\" mode");
+		free(out.data);
+		errs.max = 0;
+		if (popen_noshell_capture(&pc, NULL, &errs) != 0) err(EXIT_FAILURE, "popen_noshell_capture()");
+		assert_int(200010, (int)errs.len, "feature_capture(): STDERR length in \"w\" mode");
+		assert_string("got input\n", errs.data + 200000, "feature_capture(): STDERR in \"w\" mode");
+		safe_pclose_noshell(&pc);
+		free(errs.data);
+
+		opts.timeout_ms = 100;
+		opts.kill_grace_ms = 100;
+		safe_popen_noshell_ex(cmd_sleep[0], cmd_sleep, "r", &pc, &opts);
+		out.max = errs.max = 0;
+		if (popen_noshell_capture(&pc, &out, &errs) == 0 || errno != ETIMEDOUT) errx(EXIT_FAILURE, "feature_capture(): no timeout");
+		pclose_noshell(&pc);
+		assert_int(1, pc.timed_out, "feature_capture(): timed out");
+		free(out.data);
+		free(errs.data);
+
+		opts.timeout_ms = 0;
+		opts.stderr_mode = 0;
+		safe_popen_noshell_ex(cmd_true[0], cmd_true, "r", &pc, &opts);
+		assert_int(-1, pc.stderr_fd, "feature_capture(): no STDERR pipe");
+		if (popen_noshell_capture(&pc, NULL, &errs) == 0 || errno != EINVAL) errx(EXIT_FAILURE, "feature_capture(): STDERR without its pipe");
+		safe_pclose_noshell(&pc);
+	}
+	assert_int(free_fd, _lowest_free_fd(), "feature_capture(): no fds leaked");
+}
+
+void feature_spawn_ctx() {
+	struct popen_noshell_ctx ctx;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd_echo[] = {"echo", "from", "ctx", NULL}; // resolved through PATH
+	const char *cmd_cat[] = {bin_cat, NULL};
+	char buf[256];
+	FILE *fp;
+	int mode, i, modes_run = 0;
+
+	if (popen_noshell_ctx_init(&ctx) != 0) err(EXIT_FAILURE, "popen_noshell_ctx_init()");
+
+	popen_noshell_options_init(&opts);
+	opts.ctx = &ctx;
+	opts.stderr_mode = 1; // uses the /dev/null of the context
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		++modes_run;
+		opts.mode = mode;
+		for (i = 0; i < 3; ++i) {
+			fp = safe_popen_noshell_ex(cmd_echo[0], cmd_echo, "r", &pc, &opts);
+			if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_spawn_ctx(): no output");
+			assert_string("from ctx\n", buf, "feature_spawn_ctx(): output");
+			safe_pclose_noshell(&pc);
+		}
+		fp = safe_popen_noshell_ex(cmd_cat[0], cmd_cat, "w", &pc, &opts); // STDOUT goes to /dev/null
+		fprintf(fp, "ignored\n");
+		safe_pclose_noshell(&pc);
+	}
+
+	assert_int(4 * modes_run, (int)ctx.stats.spawns, "feature_spawn_ctx(): spawns");
+	assert_int(0, (int)ctx.stats.failures, "feature_spawn_ctx(): failures");
+	assert_int(1, (int)ctx.stats.path_cache_misses, "feature_spawn_ctx(): PATH cache misses");
+	assert_int(3 * modes_run - 1, (int)ctx.stats.path_cache_hits, "feature_spawn_ctx(): PATH cache hits");
+
+	popen_noshell_ctx_destroy(&ctx);
+}
+
+void _feature_signal_handler(int sig) {
+	(void) sig;
+}
+
+void feature_signal_mask() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {"grep", "SigBlk", "/proc/self/status", NULL};
+	struct sigaction sa, old_sa;
+	sigset_t usr2, old_mask, mask;
+	char buf[256];
+	FILE *fp;
+	int mode;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _feature_signal_handler;
+	if (sigaction(SIGUSR1, &sa, &old_sa) != 0) err(EXIT_FAILURE, "sigaction()");
+	sigemptyset(&usr2);
+	sigaddset(&usr2, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &usr2, &old_mask) != 0) err(EXIT_FAILURE, "sigprocmask()");
+
+	popen_noshell_options_init(&opts);
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		opts.mode = mode;
+		fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_signal_mask(): no output");
+		// the child gets our own mask, not the fully blocked one which was used during the spawn
+		assert_string("SigBlk:\t0000000000000800\n", buf, "feature_signal_mask(): signal mask of the child");
+		safe_pclose_noshell(&pc);
+
+		if (sigprocmask(SIG_SETMASK, NULL, &mask) != 0) err(EXIT_FAILURE, "sigprocmask()");
+		assert_int(1, sigismember(&mask, SIGUSR2), "feature_signal_mask(): SIGUSR2 blocked in the parent");
+		assert_int(0, sigismember(&mask, SIGUSR1), "feature_signal_mask(): SIGUSR1 unblocked in the parent");
+	}
+
+	if (sigprocmask(SIG_SETMASK, &old_mask, NULL) != 0) err(EXIT_FAILURE, "sigprocmask()");
+	if (sigaction(SIGUSR1, &old_sa, NULL) != 0) err(EXIT_FAILURE, "sigaction()");
+}
+
+struct feature_signal_storm {
+	pthread_t target;
+	volatile int stop;
+};
+
+void *_feature_signal_storm_thread(void *data) {
+	struct feature_signal_storm *storm = (struct feature_signal_storm *)data;
+	struct timespec ts = {0, 20 * 1000000};
+
+	while (!storm->stop) {
+		nanosleep(&ts, NULL);
+		pthread_kill(storm->target, SIGUSR1);
+	}
+	return NULL;
+}
+
+// a signal handler without SA_RESTART interrupts the waits of pclose_noshell(), which must not fail
+void feature_signal_during_pclose() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd_exit[] = {bin_bash, "-c", "sleep 0.3; exit 3", NULL};
+	const char *cmd_trap[] = {bin_bash, "-c", "trap '' TERM; while true; do sleep 1; done", NULL};
+	struct feature_signal_storm storm;
+	struct sigaction sa, old_sa;
+	pthread_t thread;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _feature_signal_handler;
+	if (sigaction(SIGUSR1, &sa, &old_sa) != 0) err(EXIT_FAILURE, "sigaction()");
+	storm.target = pthread_self();
+	storm.stop = 0;
+	if (pthread_create(&thread, NULL, _feature_signal_storm_thread, &storm) != 0) errx(EXIT_FAILURE, "pthread_create()");
+
+	popen_noshell_options_init(&opts);
+	safe_popen_noshell_ex(cmd_exit[0], cmd_exit, "r", &pc, &opts);
+	assert_status_exit_code(3, pclose_noshell(&pc));
+
+	// the blocking wait after SIGKILL
+	opts.new_process_group = 1;
+	opts.timeout_ms = 100;
+	opts.kill_grace_ms = 100;
+	safe_popen_noshell_ex(cmd_trap[0], cmd_trap, "r", &pc, &opts);
+	assert_status_signal(SIGKILL, pclose_noshell(&pc));
+
+	storm.stop = 1;
+	pthread_join(thread, NULL);
+	if (sigaction(SIGUSR1, &old_sa, NULL) != 0) err(EXIT_FAILURE, "sigaction()");
+}
+
+void feature_close_fds() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {"ls", "-1", "/proc/self/fd/100", "/proc/self/fd/101", NULL};
+	int keep_fds[] = {101};
+	char buf[256];
+	FILE *fp;
+	int mode, fd;
+
+	// both without O_CLOEXEC, like the ones which issue #7 was about
+	fd = open("/dev/null", O_RDONLY);
+	if (fd < 0) err(EXIT_FAILURE, "open(/dev/null)");
+	if (dup2(fd, 100) != 100 || dup2(fd, 101) != 101) err(EXIT_FAILURE, "dup2()");
+	if (close(fd) != 0) err(EXIT_FAILURE, "close()");
+
+	popen_noshell_options_init(&opts);
+	opts.stderr_mode = 1;
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		opts.mode = mode;
+
+		opts.close_fds = 0;
+		fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_close_fds(): no output");
+		assert_string("/proc/self/fd/100\n", buf, "feature_close_fds(): fd 100 is inherited");
+		if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_close_fds(): no output");
+		assert_string("/proc/self/fd/101\n", buf, "feature_close_fds(): fd 101 is inherited");
+		safe_pclose_noshell(&pc);
+
+		opts.close_fds = 1;
+		opts.keep_fds = keep_fds;
+		opts.keep_fds_count = 1;
+		fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_close_fds(): no output");
+		assert_string("/proc/self/fd/101\n", buf, "feature_close_fds(): fd 101 is kept");
+		assert_int(1, fgets(buf, sizeof(buf) - 1, fp) == NULL, "feature_close_fds(): fd 100 is closed");
+		assert_status_exit_code(2, pclose_noshell(&pc)); // ls could not find fd 100
+
+		opts.keep_fds_count = 0;
+		fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		assert_int(1, fgets(buf, sizeof(buf) - 1, fp) == NULL, "feature_close_fds(): all fds are closed");
+		assert_status_exit_code(2, pclose_noshell(&pc));
+	}
+
+	if (close(100) != 0 || close(101) != 0) err(EXIT_FAILURE, "close()");
+}
+
+struct feature_trace_log {
+	int count;
+	int phases[16];
+	int64_t ns[16];
+};
+
+void _feature_trace_hook(const struct popen_noshell_tracer *tracer, int phase, const struct popen_noshell_pass_to_pclose *arg, int64_t ns) {
+	struct feature_trace_log *log = (struct feature_trace_log *)tracer->user_data;
+
+	(void) arg;
+	if (log->count == 16) errx(EXIT_FAILURE, "feature_trace(): too many phases");
+	log->phases[log->count] = phase;
+	log->ns[log->count] = ns;
+	++log->count;
+}
+
+void feature_trace() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {"echo", "traced", NULL};
+	const char *cmd_true[] = {"true", NULL};
+	struct feature_trace_log log;
+	struct popen_noshell_tracer tracer;
+	char buf[64];
+	int mode, phase, shared, i;
+
+	tracer.hook = _feature_trace_hook;
+	tracer.user_data = &log;
+	popen_noshell_set_tracer(&tracer);
+
+	popen_noshell_options_init(&opts);
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		memset(&log, 0, sizeof(log));
+		opts.mode = mode;
+		safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		if (popen_noshell_read(&pc, buf, sizeof(buf)) <= 0) errx(EXIT_FAILURE, "feature_trace(): no output");
+		safe_pclose_noshell(&pc);
+
+		// all phases in their order, but the child ones are seen only if the child shares our memory
+		shared = (mode == POPEN_NOSHELL_MODE_CLONE || mode == POPEN_NOSHELL_MODE_VFORK);
+#ifdef POPEN_NOSHELL_VALGRIND_DEBUG
+		shared = 0; // Valgrind gets fork() instead of clone() and vfork()
+#endif
+		i = 0;
+		for (phase = POPEN_NOSHELL_PHASE_START; phase <= POPEN_NOSHELL_PHASE_EXIT; ++phase) {
+			if (!shared && phase >= POPEN_NOSHELL_PHASE_CHILD_START && phase <= POPEN_NOSHELL_PHASE_CHILD_EXEC) {
+				continue;
+			}
+			if (i == log.count) errx(EXIT_FAILURE, "feature_trace(): phase %d is missing in mode %d", phase, mode);
+			assert_int(phase, log.phases[i], "feature_trace(): phase");
+			if (i > 0 && log.ns[i] < log.ns[i - 1]) errx(EXIT_FAILURE, "feature_trace(): time goes backwards at phase %d", phase);
+			++i;
+		}
+		assert_int(i, log.count, "feature_trace(): number of phases");
+	}
+
+	popen_noshell_set_tracer(NULL);
+	memset(&log, 0, sizeof(log));
+	safe_popen_noshell_ex(cmd_true[0], cmd_true, "r", &pc, &opts);
+	safe_pclose_noshell(&pc);
+	assert_int(0, log.count, "feature_trace(): no phases without a tracer");
+}
+
+void feature_stats() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {"echo", "12345", NULL};
+	const char *cmd_missing[] = {"/non-existent", NULL};
+	const char *cmd_true[] = {"true", NULL};
+	struct popen_noshell_stats before, after, published;
+	struct popen_noshell_mode_stats *b, *a;
+	char buf[64], name[64], path[128];
+	int fd;
+
+	popen_noshell_options_init(&opts);
+	opts.mode = POPEN_NOSHELL_MODE_CLONE;
+	popen_noshell_stats_snapshot(&before);
+
+	safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+	if (popen_noshell_read(&pc, buf, sizeof(buf)) != 6) errx(EXIT_FAILURE, "feature_stats(): short read");
+	popen_noshell_stats_snapshot(&after);
+	assert_int(1, (int)(after.modes[POPEN_NOSHELL_MODE_CLONE].live_children - before.modes[POPEN_NOSHELL_MODE_CLONE].live_children),
+		"feature_stats(): a live child");
+	safe_pclose_noshell(&pc);
+
+	opts.stderr_mode = 1;
+	if (popen_noshell_ex(cmd_missing[0], cmd_missing, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_stats(): exec() succeeded");
+
+	if (popen_noshell_ex(cmd[0], cmd, "x", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_stats(): bad type accepted");
+
+	popen_noshell_stats_snapshot(&after);
+	b = &before.modes[POPEN_NOSHELL_MODE_CLONE];
+	a = &after.modes[POPEN_NOSHELL_MODE_CLONE];
+	assert_int(1, (int)(a->spawns - b->spawns), "feature_stats(): spawns");
+	assert_int(1, (int)(a->exec_failures - b->exec_failures), "feature_stats(): exec failures");
+	assert_int(1, (int)(a->failures[POPEN_NOSHELL_STAGE_SPAWN] - b->failures[POPEN_NOSHELL_STAGE_SPAWN]), "feature_stats(): spawn failures");
+	assert_int(1, (int)(a->failures[POPEN_NOSHELL_STAGE_ARGS] - b->failures[POPEN_NOSHELL_STAGE_ARGS]), "feature_stats(): bad arguments");
+	assert_int(6, (int)(a->bytes_read - b->bytes_read), "feature_stats(): bytes read");
+	assert_int(0, (int)(a->live_children - b->live_children), "feature_stats(): no live children");
+	assert_int(1, a->spawn_ns > b->spawn_ns, "feature_stats(): spawn time");
+
+	// the shared memory segment is live and has the same counters
+	snprintf(name, sizeof(name), "popen_noshell_tests.%d", (int)getpid());
+	snprintf(path, sizeof(path), "/dev/shm/%s", name);
+	if (popen_noshell_stats_publish(name) != 0) err(EXIT_FAILURE, "popen_noshell_stats_publish()");
+	safe_popen_noshell_ex(cmd_true[0], cmd_true, "r", &pc, &opts);
+	safe_pclose_noshell(&pc);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) err(EXIT_FAILURE, "open(%s)", path);
+	if (read(fd, &published, sizeof(published)) != sizeof(published)) err(EXIT_FAILURE, "read(%s)", path);
+	close(fd);
+	assert_int(1, published.magic == POPEN_NOSHELL_STATS_MAGIC, "feature_stats(): magic");
+	assert_int(getpid(), published.pid, "feature_stats(): pid");
+	assert_int(2, (int)(published.modes[POPEN_NOSHELL_MODE_CLONE].spawns - b->spawns), "feature_stats(): published spawns");
+
+	if (popen_noshell_stats_unpublish() != 0) err(EXIT_FAILURE, "popen_noshell_stats_unpublish()");
+	assert_int(-1, access(path, F_OK), "feature_stats(): the segment is removed");
+	popen_noshell_stats_snapshot(&after);
+	assert_int(2, (int)(after.modes[POPEN_NOSHELL_MODE_CLONE].spawns - b->spawns), "feature_stats(): unpublished spawns");
+}
+
+// a failing child which shares our memory must not flush our STDOUT into its own, see _CHILD_WARN()
+void _feature_child_errors_keep_stdout() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd_missing[] = {"/non-existent", NULL};
+	char buf[256], expected[256];
+	FILE *out;
+	size_t len;
+	pid_t pid;
+	int mode, status;
+
+	out = tmpfile();
+	if (!out) err(EXIT_FAILURE, "tmpfile()");
+	fflush(stdout);
+	pid = fork(); // the STDOUT of a child of ours, so that ours stays as it is
+	if (pid == -1) err(EXIT_FAILURE, "fork()");
+	if (pid == 0) {
+		if (dup2(fileno(out), STDOUT_FILENO) == -1) _exit(2);
+		setvbuf(stdout, NULL, _IOFBF, BUFSIZ); // nothing gets out until the exit()
+		popen_noshell_options_init(&opts);
+		opts.stderr_mode = 1;
+		for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+			if (skip_mode(mode)) continue;
+			opts.mode = mode;
+			printf("%d ", mode);
+			if (popen_noshell_ex(cmd_missing[0], cmd_missing, "r", &pc, &opts) != NULL) _exit(3);
+		}
+		exit(0);
+	}
+	if (waitpid(pid, &status, 0) != pid) err(EXIT_FAILURE, "waitpid()");
+	assert_status_exit_code(0, status);
+
+	expected[0] = '\0';
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		snprintf(expected + strlen(expected), sizeof(expected) - strlen(expected), "%d ", mode);
+	}
+	rewind(out);
+	len = fread(buf, 1, sizeof(buf) - 1, out);
+	buf[len] = '\0';
+	fclose(out);
+	assert_string(expected, buf, "feature_child_errors(): our buffered STDOUT survives the failed spawns");
+}
+
+// the lowest free fd, which changes if a failed spawn leaks any
+void feature_child_errors() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd_missing[] = {"/non-existent", NULL};
+	const char *cmd_path[] = {"popen-noshell-no-such-command", NULL};
+	const char *cmd_true[] = {"true", NULL};
+	int mode, close_fds, free_fd;
+
+	popen_noshell_options_init(&opts);
+	opts.stderr_mode = 1;
+	free_fd = _lowest_free_fd();
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		for (close_fds = 0; close_fds <= 1; ++close_fds) {
+			opts.mode = mode;
+			opts.close_fds = close_fds;
+
+			if (popen_noshell_ex(cmd_missing[0], cmd_missing, "r", &pc, &opts) != NULL) {
+				errx(EXIT_FAILURE, "feature_child_errors(): exec(%s) succeeded in mode %d", cmd_missing[0], mode);
+			}
+			assert_int(ENOENT, errno, "feature_child_errors(): errno");
+			assert_int((mode == POPEN_NOSHELL_MODE_POSIX_SPAWN ? POPEN_NOSHELL_CHILD_OK : POPEN_NOSHELL_CHILD_EXEC), pc.child_stage,
+				"feature_child_errors(): child stage");
+
+			if (popen_noshell_ex(cmd_path[0], cmd_path, "w", &pc, &opts) != NULL) { // searched in PATH
+				errx(EXIT_FAILURE, "feature_child_errors(): exec(%s) succeeded in mode %d", cmd_path[0], mode);
+			}
+			assert_int(ENOENT, errno, "feature_child_errors(): errno of a PATH search");
+
+			// the channel is gone after a successful exec()
+			safe_popen_noshell_ex(cmd_true[0], cmd_true, "r", &pc, &opts);
+			assert_int(POPEN_NOSHELL_CHILD_OK, pc.child_stage, "feature_child_errors(): no error");
+			safe_pclose_noshell(&pc);
+		}
+	}
+	assert_int(free_fd, _lowest_free_fd(), "feature_child_errors(): no fds leaked");
+	assert_int(-1, waitpid(-1, NULL, WNOHANG), "feature_child_errors(): all children are reaped");
+
+	_feature_child_errors_keep_stdout();
+}
+
+// bad arguments of the trampoline are reported on its error channel, or the library would take them for a successful exec()
+void _feature_trampoline_bad_args(const char *bad) {
+	int errpipe[2], msg[2];
+	char fd[16];
+	pid_t pid;
+
+	if (pipe(errpipe) != 0) err(EXIT_FAILURE, "pipe()");
+	snprintf(fd, sizeof(fd), "%d", errpipe[1]);
+	pid = fork();
+	if (pid < 0) err(EXIT_FAILURE, "fork()");
+	if (pid == 0) {
+		execl(popen_noshell_get_trampoline(), "popen_noshell_trampoline", "-e", fd, bad, "--", "true", "true", (char *)NULL);
+		_exit(255);
+	}
+	close(errpipe[1]);
+	assert_int((int)sizeof(msg), (int)read(errpipe[0], msg, sizeof(msg)), "_feature_trampoline_bad_args(): reported");
+	assert_int(POPEN_NOSHELL_CHILD_EXEC, msg[0], "_feature_trampoline_bad_args(): stage");
+	assert_int(EINVAL, msg[1], "_feature_trampoline_bad_args(): errno");
+	close(errpipe[0]);
+	if (waitpid(pid, NULL, 0) != pid) err(EXIT_FAILURE, "waitpid()");
+}
+
+void feature_child_setup() {
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	struct popen_noshell_rlimit limits[1];
+	const char *cmd[] = {bin_bash, "-c",
+		"pwd; ulimit -Sn; read -a s < /proc/$$/stat; echo $(( s[5] == $$ )); grep ^Cpus_allowed_list: /proc/self/status", NULL};
+	const char *cmd_true[] = {"true", NULL};
+	char buf[256], expected[256];
+	cpu_set_t allowed, one;
+	unsigned char big_mask[2 * sizeof(cpu_set_t)];
+	size_t len;
+	FILE *fp;
+	int mode, cpu, free_fd;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) err(EXIT_FAILURE, "sched_getaffinity()");
+	for (cpu = 0; !CPU_ISSET(cpu, &allowed); ++cpu);
+	CPU_ZERO(&one);
+	CPU_SET(cpu, &one);
+	limits[0].resource = RLIMIT_NOFILE;
+	if (getrlimit(RLIMIT_NOFILE, &limits[0].limit) != 0) err(EXIT_FAILURE, "getrlimit()");
+	limits[0].limit.rlim_cur = 64;
+	snprintf(expected, sizeof(expected), "/\n64\n1\nCpus_allowed_list:\t%d\n", cpu);
+
+	popen_noshell_options_init(&opts);
+	opts.cwd = "/";
+	opts.new_session = 1;
+	opts.rlimits = limits;
+	opts.rlimits_count = 1;
+	opts.cpu_affinity = &one;
+	opts.cpu_affinity_size = sizeof(one);
+	free_fd = _lowest_free_fd();
+	for (mode = POPEN_NOSHELL_MODE_CLONE; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (skip_mode(mode)) continue;
+		opts.mode = mode;
+		opts.cwd = "/";
+		if (mode == POPEN_NOSHELL_MODE_POSIX_SPAWN) { // it cannot do any of these
+			if (popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_child_setup(): posix_spawn() mode succeeded");
+			assert_int(ENOTSUP, errno, "feature_child_setup(): errno of posix_spawn() mode");
+			continue;
+		}
+
+		fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		len = fread(buf, 1, sizeof(buf) - 1, fp);
+		buf[len] = '\0';
+		assert_string(expected, buf, "feature_child_setup(): cwd, rlimit, session and affinity of the child");
+		assert_int(0, pclose_noshell(&pc), "feature_child_setup(): exit status");
+
+		opts.cwd = "/non-existent";
+		if (popen_noshell_ex(cmd_true[0], cmd_true, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_child_setup(): chdir() succeeded in mode %d", mode);
+		assert_int(ENOENT, errno, "feature_child_setup(): errno of chdir()");
+		assert_int(POPEN_NOSHELL_CHILD_CWD, pc.child_stage, "feature_child_setup(): child stage of chdir()");
+	}
+	assert_int(free_fd, _lowest_free_fd(), "feature_child_setup(): no fds leaked");
+
+	opts.mode = POPEN_NOSHELL_MODE_TRAMPOLINE;
+	opts.cwd = NULL;
+	popen_noshell_set_trampoline("/non-existent");
+	if (popen_noshell_ex(cmd_true[0], cmd_true, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_child_setup(): a missing trampoline worked");
+	assert_int(ENOENT, errno, "feature_child_setup(): errno of a missing trampoline");
+	use_local_trampoline();
+	assert_int(free_fd, _lowest_free_fd(), "feature_child_setup(): no fds leaked by a missing trampoline");
+
+	if (!have_trampoline) return;
+	// a mask larger than a cpu_set_t
+	memset(big_mask, 0, sizeof(big_mask));
+	memcpy(big_mask, &one, sizeof(one));
+	opts.cpu_affinity = (cpu_set_t *)big_mask;
+	opts.cpu_affinity_size = sizeof(big_mask);
+	opts.cwd = "/";
+	fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+	len = fread(buf, 1, sizeof(buf) - 1, fp);
+	buf[len] = '\0';
+	assert_string(expected, buf, "feature_child_setup(): a large affinity mask through the trampoline");
+	assert_int(0, pclose_noshell(&pc), "feature_child_setup(): exit status of a large affinity mask");
+
+	_feature_trampoline_bad_args("-");
+	_feature_trampoline_bad_args("-x");
+	_feature_trampoline_bad_args("--no-such-option");
+}
+
+void feature_admission_leaks() {
+	struct popen_noshell_admission adm;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {"true", NULL};
+	struct rlimit saved, rl;
+	int free_fd;
+
+	popen_noshell_options_init(&opts);
+	free_fd = _lowest_free_fd();
+	if (getrlimit(RLIMIT_NOFILE, &saved) != 0) err(EXIT_FAILURE, "getrlimit()");
+	rl = saved;
+
+	// no room for the pipe
+	rl.rlim_cur = free_fd + 1;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0) err(EXIT_FAILURE, "setrlimit()");
+	if (popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_admission_leaks(): pipe() succeeded");
+	assert_int(EMFILE, errno, "feature_admission_leaks(): errno of pipe()");
+	assert_int(free_fd, _lowest_free_fd(), "feature_admission_leaks(): no fds leaked by pipe()");
+
+	// room for the pipe but not for the error channel of fork()
+	rl.rlim_cur = free_fd + 2;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0) err(EXIT_FAILURE, "setrlimit()");
+	opts.mode = POPEN_NOSHELL_MODE_FORK;
+	if (popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_admission_leaks(): the error channel succeeded");
+	assert_int(EMFILE, errno, "feature_admission_leaks(): errno of the error channel");
+	assert_int(free_fd, _lowest_free_fd(), "feature_admission_leaks(): no fds leaked by the error channel");
+
+	// the admission control retries until its deadline and then reports the last error
+	if (popen_noshell_admission_init(&adm) != 0) err(EXIT_FAILURE, "popen_noshell_admission_init()");
+	adm.max_wait_ms = 20;
+	opts.admission = &adm;
+	if (popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts) != NULL) errx(EXIT_FAILURE, "feature_admission_leaks(): the retries succeeded");
+	assert_int(EMFILE, errno, "feature_admission_leaks(): errno of the retries");
+	assert_int(1, adm.retried > 0, "feature_admission_leaks(): retried");
+	assert_int(0, adm.in_flight, "feature_admission_leaks(): no slots held");
+
+	if (setrlimit(RLIMIT_NOFILE, &saved) != 0) err(EXIT_FAILURE, "setrlimit()");
+	popen_noshell_admission_destroy(&adm);
+	assert_int(free_fd, _lowest_free_fd(), "feature_admission_leaks(): no fds leaked by the retries");
+	assert_int(-1, waitpid(-1, NULL, WNOHANG), "feature_admission_leaks(): all children are reaped");
+}
+
+struct feature_admission_storm {
+	struct popen_noshell_admission *adm;
+	int running;
+	int max_running;
+	int64_t max_wait_ns;
+};
+
+void *_feature_admission_storm_thread(void *data) {
+	struct feature_admission_storm *storm = (struct feature_admission_storm *)data;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {"echo", "storm", NULL};
+	struct timespec start, end;
+	char buf[16];
+	int64_t ns, max_ns;
+	int i, running, max_running;
+
+	popen_noshell_options_init(&opts);
+	opts.admission = storm->adm;
+	for (i = 0; i < 10; ++i) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		running = __atomic_add_fetch(&storm->running, 1, __ATOMIC_SEQ_CST);
+		max_running = __atomic_load_n(&storm->max_running, __ATOMIC_SEQ_CST);
+		while (running > max_running &&
+			!__atomic_compare_exchange_n(&storm->max_running, &max_running, running, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+		ns = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+		max_ns = __atomic_load_n(&storm->max_wait_ns, __ATOMIC_SEQ_CST);
+		while (ns > max_ns &&
+			!__atomic_compare_exchange_n(&storm->max_wait_ns, &max_ns, ns, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+		if (popen_noshell_read(&pc, buf, sizeof(buf)) != 6) errx(EXIT_FAILURE, "feature_admission(): short read");
+		__atomic_sub_fetch(&storm->running, 1, __ATOMIC_SEQ_CST); // before the slot is released
+		safe_pclose_noshell(&pc);
+	}
+
+	return NULL;
+}
+
+void feature_admission() {
+	struct popen_noshell_admission adm;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc[3];
+	struct feature_admission_storm storm;
+	const char *cmd[] = {"cat", NULL};
+	pthread_t threads[4];
+	int i, free_fd;
+
+	free_fd = _lowest_free_fd();
+	if (popen_noshell_admission_init(&adm) != 0) err(EXIT_FAILURE, "popen_noshell_admission_init()");
+	popen_noshell_options_init(&opts);
+	opts.admission = &adm;
+
+	// "cat" waits for us, so it holds its slot
+	adm.max_in_flight = 2;
+	adm.max_wait_ms = 50;
+	safe_popen_noshell_ex(cmd[0], cmd, "w", &pc[0], &opts);
+	safe_popen_noshell_ex(cmd[0], cmd, "w", &pc[1], &opts);
+	if (popen_noshell_ex(cmd[0], cmd, "w", &pc[2], &opts) != NULL) errx(EXIT_FAILURE, "feature_admission(): a third child was admitted");
+	assert_int(EAGAIN, errno, "feature_admission(): errno when rejected");
+	assert_int(1, (int)adm.rejected, "feature_admission(): rejected");
+
+	safe_pclose_noshell(&pc[0]);
+	safe_popen_noshell_ex(cmd[0], cmd, "w", &pc[2], &opts);
+	safe_pclose_noshell(&pc[1]);
+	safe_pclose_noshell(&pc[2]);
+	assert_int(3, (int)adm.admitted, "feature_admission(): admitted");
+	assert_int(0, adm.in_flight, "feature_admission(): no slots held");
+
+	// a pclose_noshell() which cannot wait for its child still gives back the slot
+	safe_popen_noshell_ex(cmd[0], cmd, "w", &pc[0], &opts);
+	if (fclose(pc[0].fp) != 0) err(EXIT_FAILURE, "fclose()");
+	pc[0].fp = fopen("/dev/null", "w");
+	if (waitpid(pc[0].pid, NULL, __WALL) != pc[0].pid) err(EXIT_FAILURE, "waitpid()");
+	assert_int(-1, pclose_noshell(&pc[0]), "feature_admission(): pclose_noshell() of a reaped child");
+	assert_int(ECHILD, errno, "feature_admission(): errno of pclose_noshell() of a reaped child");
+	assert_int(0, adm.in_flight, "feature_admission(): the slot is given back after a failed pclose_noshell()");
+	popen_noshell_admission_destroy(&adm);
+
+	// short of fds, the spawn backs off until its deadline
+	if (popen_noshell_admission_init(&adm) != 0) err(EXIT_FAILURE, "popen_noshell_admission_init()");
+	adm.min_free_fds = 1 << 30;
+	adm.max_wait_ms = 20;
+	if (popen_noshell_ex(cmd[0], cmd, "w", &pc[0], &opts) != NULL) errx(EXIT_FAILURE, "feature_admission(): admitted without free fds");
+	assert_int(EAGAIN, errno, "feature_admission(): errno when short of fds");
+	assert_int(1, (int)adm.rejected, "feature_admission(): rejected when short of fds");
+	popen_noshell_admission_destroy(&adm);
+
+	// a storm of threads never has more children than allowed, and every spawn gets its turn
+	if (popen_noshell_admission_init(&adm) != 0) err(EXIT_FAILURE, "popen_noshell_admission_init()");
+	adm.max_in_flight = 2;
+	memset(&storm, 0, sizeof(storm));
+	storm.adm = &adm;
+	for (i = 0; i < 4; ++i) {
+		if (pthread_create(&threads[i], NULL, _feature_admission_storm_thread, &storm) != 0) errx(EXIT_FAILURE, "pthread_create()");
+	}
+	for (i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	assert_int(40, (int)adm.admitted, "feature_admission(): admitted in the storm");
+	assert_int(0, (int)adm.rejected, "feature_admission(): rejected in the storm");
+	assert_int(0, adm.in_flight, "feature_admission(): no slots held after the storm");
+	assert_int(1, storm.max_running <= 2, "feature_admission(): children in flight");
+	assert_int(1, storm.max_wait_ns < 10 * (int64_t)1000000000, "feature_admission(): bounded wait");
+	popen_noshell_admission_destroy(&adm);
+
+	assert_int(free_fd, _lowest_free_fd(), "feature_admission(): no fds leaked");
+	assert_int(-1, waitpid(-1, NULL, WNOHANG), "feature_admission(): all children are reaped");
+}
+
+int _process_exists(pid_t pid) {
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/%d", (int)pid);
+	return access(path, F_OK) == 0;
+}
+
+// waits up to 5 seconds for the process to be gone, zombie included
+void _assert_process_gone(pid_t pid, const char *what) {
+	int i;
+
+	for (i = 0; i < 500 && _process_exists(pid); ++i) usleep(10000);
+	if (_process_exists(pid)) errx(EXIT_FAILURE, "%s: PID %d was not reaped", what, (int)pid);
+}
+
+void *_feature_reaper_pclose_thread(void *data) {
+	return (void *)(intptr_t)pclose_noshell((struct popen_noshell_pass_to_pclose *)data);
+}
+
+void feature_reaper() {
+	struct popen_noshell_reaper reaper;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc[50];
+	const char *cmd_exit[] = {bin_bash, "-c", "exit 3", NULL};
+	const char *cmd_orphan[] = {bin_bash, "-c", "sleep 0.2 >/dev/null & echo $!", NULL};
+	const char *cmd_sleep[] = {"sleep", "10", NULL};
+	const char *cmd_late[] = {bin_bash, "-c", "sleep 0.3; exit 4", NULL};
+	pthread_t thread;
+	void *ret;
+	char buf[64];
+	FILE *fp;
+	pid_t orphan;
+	int modes[] = {POPEN_NOSHELL_MODE_CLONE, POPEN_NOSHELL_MODE_POSIX_SPAWN, POPEN_NOSHELL_MODE_FORK, POPEN_NOSHELL_MODE_VFORK, POPEN_NOSHELL_MODE_TRAMPOLINE};
+	int i, status, prev, free_fd;
+
+	free_fd = _lowest_free_fd();
+	if (popen_noshell_reaper_start(&reaper, 1) != 0) err(EXIT_FAILURE, "popen_noshell_reaper_start()");
+	popen_noshell_options_init(&opts);
+	opts.reaper = &reaper;
+
+	// the table grows past its initial size, and the statuses wait there for pclose_noshell()
+	for (i = 0; i < 50; ++i) {
+		opts.mode = modes[i % 3];
+		fp = safe_popen_noshell_ex(cmd_exit[0], cmd_exit, "r", &pc[i], &opts);
+	}
+	for (i = 0; i < 50; ++i) {
+		assert_status_exit_code(3, pclose_noshell(&pc[i]));
+	}
+	pthread_mutex_lock(&reaper.lock);
+	assert_int(0, reaper.table_count, "feature_reaper(): the statuses are taken");
+	assert_int(1, reaper.batches >= 1 && reaper.batches <= reaper.reaped, "feature_reaper(): batches");
+	pthread_mutex_unlock(&reaper.lock);
+
+	// a dropped handle leaves no zombie
+	fp = safe_popen_noshell_ex(cmd_exit[0], cmd_exit, "r", &pc[0], &opts);
+	fclose(fp);
+	_assert_process_gone(pc[0].pid, "feature_reaper(): dropped handle");
+
+	// an orphaned grandchild is re-parented to us and reaped by a periodic sweep
+	fp = safe_popen_noshell_ex(cmd_orphan[0], cmd_orphan, "r", &pc[0], &opts);
+	if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_reaper(): no PID of the grandchild");
+	orphan = atoi(buf);
+	safe_pclose_noshell(&pc[0]);
+	_assert_process_gone(orphan, "feature_reaper(): orphaned grandchild");
+	pthread_mutex_lock(&reaper.lock);
+	assert_int(1, reaper.orphans >= 1, "feature_reaper(): orphans");
+	pthread_mutex_unlock(&reaper.lock);
+
+	// deadlines work as without a reaper
+	opts.timeout_ms = 100;
+	opts.kill_grace_ms = 100;
+	fp = safe_popen_noshell_ex(cmd_sleep[0], cmd_sleep, "r", &pc[0], &opts);
+	status = pclose_noshell(&pc[0]);
+	assert_int(1, pc[0].timed_out, "feature_reaper(): timed out");
+	assert_int(1, WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM, "feature_reaper(): killed");
+
+	// a reaped child is not signalled, as its PID may be reused already
+	opts.timeout_ms = 0;
+	fp = safe_popen_noshell_ex(cmd_exit[0], cmd_exit, "r", &pc[0], &opts);
+	for (i = 0; i < 500 && popen_noshell_kill(&pc[0], 0) == 0; ++i) {
+		usleep(10000);
+	}
+	assert_int(-1, popen_noshell_kill(&pc[0], SIGTERM), "feature_reaper(): popen_noshell_kill() of a reaped child");
+	assert_int(ESRCH, errno, "feature_reaper(): errno of popen_noshell_kill() of a reaped child");
+	assert_status_exit_code(3, pclose_noshell(&pc[0]));
+
+	// a pclose_noshell() which waits while the reaper stops gets the status all the same
+	fp = safe_popen_noshell_ex(cmd_late[0], cmd_late, "r", &pc[0], &opts);
+	if (pthread_create(&thread, NULL, _feature_reaper_pclose_thread, &pc[0]) != 0) errx(EXIT_FAILURE, "pthread_create()");
+	usleep(100 * 1000);
+	popen_noshell_reaper_stop(&reaper);
+	if (pthread_join(thread, &ret) != 0) errx(EXIT_FAILURE, "pthread_join()");
+	assert_status_exit_code(4, (int)(intptr_t)ret);
+
+	if (prctl(PR_GET_CHILD_SUBREAPER, &prev) != 0) err(EXIT_FAILURE, "prctl()");
+	assert_int(0, prev, "feature_reaper(): not a subreaper any more");
+	assert_int(free_fd, _lowest_free_fd(), "feature_reaper(): no fds leaked");
+	assert_int(-1, waitpid(-1, NULL, WNOHANG), "feature_reaper(): all children are reaped");
+}
+
+// the parent PID of "pid", or 0 if it is gone
+pid_t _parent_of(pid_t pid) {
+	char path[64], buf[512], *p;
+	int fd;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0) return 0;
+	buf[len] = '\0';
+	p = strrchr(buf, ')'); // the name of the command may contain anything
+	if (!p) return 0;
+	return (pid_t)atoi(p + 4); // ") S 1234"
+}
+
+void feature_detached() {
+	struct popen_noshell_options opts;
+	struct sigaction before, after;
+	char path[] = "/tmp/popen_noshell_detached.XXXXXX";
+	const char *cmd_touch[] = {bin_bash, "-c", "echo detached > \"$0\"", path, NULL};
+	const char *cmd_sleep[] = {"sleep", "0.3", NULL};
+	const char *cmd_missing[] = {"/non-existent", NULL};
+	struct popen_noshell_admission adm;
+	struct popen_noshell_reaper reaper;
+	char buf[64];
+	int modes[] = {POPEN_NOSHELL_MODE_CLONE, POPEN_NOSHELL_MODE_POSIX_SPAWN, POPEN_NOSHELL_MODE_VFORK};
+	int i, j, fd, free_fd;
+	ssize_t len;
+	pid_t pid;
+
+	free_fd = _lowest_free_fd();
+	if (sigaction(SIGCHLD, NULL, &before) != 0) err(EXIT_FAILURE, "sigaction()");
+	fd = mkstemp(path);
+	if (fd < 0) err(EXIT_FAILURE, "mkstemp()");
+	close(fd);
+
+	for (i = 0; i < (int)(sizeof(modes)/sizeof(modes[0])); ++i) {
+		if (skip_mode(modes[i])) continue;
+		popen_noshell_options_init(&opts);
+		opts.mode = modes[i];
+		opts.stderr_mode = 1;
+
+		if (truncate(path, 0) != 0) err(EXIT_FAILURE, "truncate()");
+		if (popen_noshell_spawn_detached(cmd_touch[0], cmd_touch, &opts, &pid) != 0) err(EXIT_FAILURE, "popen_noshell_spawn_detached()");
+		assert_int(1, pid > 0, "feature_detached(): PID");
+		for (j = 0, len = 0; j < 500 && len == 0; ++j) { // the command runs on its own
+			fd = open(path, O_RDONLY);
+			if (fd < 0) err(EXIT_FAILURE, "open()");
+			len = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			if (len == 0) usleep(10000);
+		}
+		assert_int(9, (int)len, "feature_detached(): output length");
+		buf[len] = '\0';
+		assert_string("detached\n", buf, "feature_detached(): output");
+
+		// not our child, so there is nothing to reap
+		if (popen_noshell_spawn_detached(cmd_sleep[0], cmd_sleep, &opts, &pid) != 0) err(EXIT_FAILURE, "popen_noshell_spawn_detached()");
+		assert_int(1, _parent_of(pid) != getpid(), "feature_detached(): re-parented");
+		assert_int(-1, waitpid(-1, NULL, WNOHANG), "feature_detached(): no children");
+		assert_int(ECHILD, errno, "feature_detached(): no children");
+
+		if (popen_noshell_spawn_detached(cmd_missing[0], cmd_missing, &opts, NULL) == 0) errx(EXIT_FAILURE, "feature_detached(): exec() succeeded");
+		assert_int(ENOENT, errno, "feature_detached(): errno");
+	}
+
+	opts.stderr_mode = 3;
+	if (popen_noshell_spawn_detached(cmd_sleep[0], cmd_sleep, &opts, NULL) == 0 || errno != EINVAL) errx(EXIT_FAILURE, "feature_detached(): stderr_mode 3");
+
+	// what the intermediate cannot do
+	popen_noshell_options_init(&opts);
+	opts.mode = POPEN_NOSHELL_MODE_FORK;
+	if (popen_noshell_spawn_detached(cmd_sleep[0], cmd_sleep, &opts, NULL) == 0 || errno != EINVAL) errx(EXIT_FAILURE, "feature_detached(): fork() mode");
+	opts.mode = POPEN_NOSHELL_MODE_TRAMPOLINE;
+	if (popen_noshell_spawn_detached(cmd_sleep[0], cmd_sleep, &opts, NULL) == 0 || errno != EINVAL) errx(EXIT_FAILURE, "feature_detached(): trampoline mode");
+	opts.mode = POPEN_NOSHELL_MODE_CLONE;
+	if (popen_noshell_admission_init(&adm) != 0) err(EXIT_FAILURE, "popen_noshell_admission_init()");
+	opts.admission = &adm;
+	if (popen_noshell_spawn_detached(cmd_sleep[0], cmd_sleep, &opts, NULL) == 0 || errno != EINVAL) errx(EXIT_FAILURE, "feature_detached(): admission");
+	opts.admission = NULL;
+	popen_noshell_admission_destroy(&adm);
+	opts.reaper = &reaper; // never started, it is not looked at
+	if (popen_noshell_spawn_detached(cmd_sleep[0], cmd_sleep, &opts, NULL) == 0 || errno != EINVAL) errx(EXIT_FAILURE, "feature_detached(): reaper");
+
+	if (sigaction(SIGCHLD, NULL, &after) != 0) err(EXIT_FAILURE, "sigaction()");
+	assert_int(1, before.sa_handler == after.sa_handler && before.sa_flags == after.sa_flags, "feature_detached(): SIGCHLD untouched");
+	unlink(path);
+	assert_int(free_fd, _lowest_free_fd(), "feature_detached(): no fds leaked");
+}
+
+void feature_handles() {
+	struct popen_noshell_handles table;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose *pc;
+	popen_noshell_handle handles[100], old;
+	const char *cmd[] = {"echo", "handle", NULL};
+	const char *cmd_missing[] = {"/non-existent", NULL};
+	char buf[64];
+	int modes[] = {POPEN_NOSHELL_MODE_CLONE, POPEN_NOSHELL_MODE_POSIX_SPAWN, POPEN_NOSHELL_MODE_FORK, POPEN_NOSHELL_MODE_VFORK, POPEN_NOSHELL_MODE_TRAMPOLINE};
+	int i, free_fd;
+
+	free_fd = _lowest_free_fd();
+	if (popen_noshell_handles_init(&table) != 0) err(EXIT_FAILURE, "popen_noshell_handles_init()");
+	popen_noshell_options_init(&opts);
+
+	// no pooled contexts unless asked for
+	opts.mode = POPEN_NOSHELL_MODE_CLONE;
+	handles[0] = popen_noshell_handle_open(&table, cmd[0], cmd, "r", &opts);
+	if (!handles[0]) err(EXIT_FAILURE, "popen_noshell_handle_open()");
+	pc = popen_noshell_handle_get(&table, handles[0]);
+	if (!pc || !fgets(buf, sizeof(buf) - 1, pc->fp)) errx(EXIT_FAILURE, "feature_handles(): no output");
+	assert_status_exit_code(0, popen_noshell_handle_close(&table, handles[0]));
+	assert_int(0, table.ctx_pool_count, "feature_handles(): no pooled context by default");
+	table.pool_ctx = 1;
+
+	// more than one chunk of records
+	for (i = 0; i < 100; ++i) {
+		opts.mode = modes[i % 3];
+		handles[i] = popen_noshell_handle_open(&table, cmd[0], cmd, "r", &opts);
+		if (!handles[i]) err(EXIT_FAILURE, "popen_noshell_handle_open()");
+	}
+	assert_int(100, table.live, "feature_handles(): live");
+	assert_int(2, table.chunks_count, "feature_handles(): chunks");
+	for (i = 0; i < 100; ++i) {
+		pc = popen_noshell_handle_get(&table, handles[i]);
+		if (!pc) err(EXIT_FAILURE, "popen_noshell_handle_get()");
+		if (!fgets(buf, sizeof(buf) - 1, pc->fp)) errx(EXIT_FAILURE, "feature_handles(): no output");
+		assert_string("handle\n", buf, "feature_handles(): output");
+		assert_status_exit_code(0, popen_noshell_handle_close(&table, handles[i]));
+	}
+	assert_int(0, table.live, "feature_handles(): all closed");
+	assert_int(1, table.ctx_pool_count, "feature_handles(): one pooled context served all the clone() spawns");
+
+	// a stale handle is detected, even after its record was reused; the last one freed is the first one reused
+	old = handles[99];
+	assert_int(-1, popen_noshell_handle_close(&table, old), "feature_handles(): double close");
+	assert_int(EBADF, errno, "feature_handles(): double close errno");
+	opts.mode = POPEN_NOSHELL_MODE_CLONE;
+	handles[0] = popen_noshell_handle_open(&table, cmd[0], cmd, "r", &opts);
+	if (!handles[0]) err(EXIT_FAILURE, "popen_noshell_handle_open()");
+	assert_int(1, (uint32_t)handles[0] == (uint32_t)old && handles[0] != old, "feature_handles(): record reused, new generation");
+	assert_int(1, popen_noshell_handle_get(&table, old) == NULL && errno == EBADF, "feature_handles(): stale get");
+	assert_int(-1, popen_noshell_handle_close(&table, old), "feature_handles(): stale close");
+	assert_int(1, popen_noshell_handle_get(&table, 0) == NULL, "feature_handles(): handle 0");
+	assert_int(1, popen_noshell_handle_get(&table, ((popen_noshell_handle)1 << 32) | 1000000) == NULL, "feature_handles(): bad index");
+	pc = popen_noshell_handle_get(&table, handles[0]);
+	if (!pc || !fgets(buf, sizeof(buf) - 1, pc->fp)) errx(EXIT_FAILURE, "feature_handles(): no output");
+	assert_status_exit_code(0, popen_noshell_handle_close(&table, handles[0]));
+
+	// a failed spawn gives its record back
+	assert_int(0, (int)popen_noshell_handle_open(&table, cmd_missing[0], cmd_missing, "r", &opts), "feature_handles(): exec() failed");
+	assert_int(ENOENT, errno, "feature_handles(): errno");
+	assert_int(0, table.live, "feature_handles(): nothing open");
+
+	popen_noshell_handles_destroy(&table);
+	assert_int(free_fd, _lowest_free_fd(), "feature_handles(): no fds leaked");
+}
+
+void feature_auto_mode() {
+	struct popen_noshell_auto_decision decision;
+	struct popen_noshell_options opts;
+	struct popen_noshell_pass_to_pclose pc;
+	const char *cmd[] = {"echo", "auto", NULL};
+	const char *cmd_true[] = {"true", NULL};
+	const char *cmd_missing[] = {"/non-existent", NULL};
+	int default_mode = popen_noshell_get_fork_mode();
+	char buf[64];
+	FILE *fp;
+	int mode;
+
+	// nothing asked for POPEN_NOSHELL_MODE_AUTO yet, so the environment still counts
+	if (setenv("POPEN_NOSHELL_MODE", "vfork", 1) != 0) err(EXIT_FAILURE, "setenv()");
+	popen_noshell_auto_decision(&decision);
+	unsetenv("POPEN_NOSHELL_MODE");
+	assert_int(POPEN_NOSHELL_MODE_VFORK, decision.mode, "feature_auto_mode(): mode of the environment");
+	assert_int(POPEN_NOSHELL_AUTO_ENV, decision.source, "feature_auto_mode(): source");
+#ifdef __GLIBC__
+	assert_int(__GLIBC__, decision.glibc_major, "feature_auto_mode(): glibc version");
+#endif
+
+	popen_noshell_options_init(&opts);
+	opts.mode = POPEN_NOSHELL_MODE_AUTO;
+	fp = safe_popen_noshell_ex(cmd[0], cmd, "r", &pc, &opts);
+	assert_int(POPEN_NOSHELL_MODE_VFORK, pc.mode, "feature_auto_mode(): resolved by popen_noshell_ex()");
+	if (!fgets(buf, sizeof(buf) - 1, fp)) errx(EXIT_FAILURE, "feature_auto_mode(): no output");
+	assert_string("auto\n", buf, "feature_auto_mode(): output");
+	safe_pclose_noshell(&pc);
+
+	popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_AUTO);
+	assert_int(POPEN_NOSHELL_MODE_AUTO, popen_noshell_get_fork_mode(), "feature_auto_mode(): global mode");
+	popen_noshell_options_init(&opts);
+	assert_int(POPEN_NOSHELL_MODE_VFORK, opts.mode, "feature_auto_mode(): resolved by popen_noshell_options_init()");
+	popen_noshell_set_fork_mode(default_mode);
+
+	mode = popen_noshell_auto_calibrate(cmd_true[0], cmd_true, 5);
+	assert_int(1, mode >= 0 && mode < POPEN_NOSHELL_MODES, "feature_auto_mode(): calibrated mode");
+	popen_noshell_auto_decision(&decision);
+	assert_int(mode, decision.mode, "feature_auto_mode(): decision");
+	assert_int(POPEN_NOSHELL_AUTO_CALIBRATED, decision.source, "feature_auto_mode(): source");
+	assert_int(1, decision.calibrated_ns[mode] > 0, "feature_auto_mode(): measured");
+	// posix_spawn() cannot do every option, so it must not become the mode of every spawn
+	assert_int(0, (int)decision.calibrated_ns[POPEN_NOSHELL_MODE_POSIX_SPAWN], "feature_auto_mode(): posix_spawn() is no candidate");
+	for (mode = 0; mode < POPEN_NOSHELL_MODES; ++mode) {
+		if (!decision.calibrated_ns[mode]) continue;
+		assert_int(1, decision.calibrated_ns[decision.mode] <= decision.calibrated_ns[mode], "feature_auto_mode(): the fastest");
+	}
+
+	assert_int(-1, popen_noshell_auto_calibrate(cmd_true[0], cmd_true, -1), "feature_auto_mode(): negative rounds");
+	assert_int(EINVAL, errno, "feature_auto_mode(): errno");
+	assert_int(-1, popen_noshell_auto_calibrate(cmd_missing[0], cmd_missing, 5), "feature_auto_mode(): failed probe");
+	assert_int(ENOENT, errno, "feature_auto_mode(): errno");
+	mode = decision.mode;
+	popen_noshell_auto_decision(&decision);
+	assert_int(mode, decision.mode, "feature_auto_mode(): previous choice kept");
+}
+
 void proceed_to_standard_unit_tests() {
 	do_unit_tests_ignore_stderr = 1; /* do we ignore STDERR from the executed commands? */
 
@@ -403,6 +1650,12 @@ void proceed_to_standard_unit_tests() {
 	do_unit_tests();
 	popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_POSIX_SPAWN);
 	do_unit_tests();
+	popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_VFORK);
+	do_unit_tests();
+	if (!skip_mode(POPEN_NOSHELL_MODE_TRAMPOLINE)) {
+		popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_TRAMPOLINE);
+		do_unit_tests();
+	}
 	popen_noshell_set_fork_mode(POPEN_NOSHELL_MODE_FORK);
 	do_unit_tests();
 }
@@ -414,9 +1667,43 @@ void proceed_to_issues_tests() {
 	issue_8_stderr_mode_test_option_2();
 }
 
+void proceed_to_feature_tests() {
+	int modes[] = {POPEN_NOSHELL_MODE_CLONE, POPEN_NOSHELL_MODE_POSIX_SPAWN, POPEN_NOSHELL_MODE_FORK, POPEN_NOSHELL_MODE_VFORK, POPEN_NOSHELL_MODE_TRAMPOLINE};
+	int i;
+
+	for (i = 0; i < (int)(sizeof(modes)/sizeof(modes[0])); ++i) {
+		if (skip_mode(modes[i])) continue;
+		popen_noshell_set_fork_mode(modes[i]);
+		feature_deadlines();
+	}
+	feature_per_call_options();
+	feature_argv_stable();
+	feature_reader();
+	feature_capture();
+	feature_spawn_ctx();
+	feature_signal_mask();
+	feature_signal_during_pclose();
+	feature_close_fds();
+	feature_trace();
+	feature_stats();
+	feature_child_errors();
+	feature_child_setup();
+	feature_admission_leaks();
+	feature_admission();
+	feature_reaper();
+	feature_detached();
+	feature_handles();
+	feature_auto_mode();
+}
+
 int main() {
+	use_local_trampoline();
+	if (!have_trampoline) {
+		warnx("no executable %s, so POPEN_NOSHELL_MODE_TRAMPOLINE is not tested; build it as described above", popen_noshell_get_trampoline());
+	}
 	proceed_to_standard_unit_tests();
 	proceed_to_issues_tests();
+	proceed_to_feature_tests();
 
 	printf("Tests passed OK.\n");
 
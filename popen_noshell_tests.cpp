@@ -18,11 +18,19 @@
  */
 
 #include "popen_noshell.h"
+#include "popen_noshell.hpp"
+#if __cplusplus >= 202002L
+#include "popen_noshell_coro.hpp"
+#endif
 #include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <alloca.h>
+#include <errno.h>
+#include <signal.h>
+#include <string>
+#include <vector>
 
 /*****************************************************
  * popen_noshell C++ unit test and use-case examples *
@@ -30,6 +38,7 @@
  *
  * Compile and test via:
  *	g++ -Wall popen_noshell.c popen_noshell_tests.cpp -o popen_noshell_tests_cpp && ./popen_noshell_tests_cpp
+ * Add -std=c++20 to test the coroutines too.
  */
 
 #define DUMMY_SIZE 10000
@@ -50,6 +59,156 @@ struct Dummy {
 
 static Dummy dummy;
 
+// The RAII wrapper of popen_noshell.hpp.
+static void test_process_wrapper() {
+  using popen_noshell_cpp::Args;
+  using popen_noshell_cpp::Process;
+  using popen_noshell_cpp::Result;
+  std::string dir = "/proc/self";
+  std::vector<std::string> long_args(100, std::string(20, 'x'));
+  std::error_code ec;
+  Result res;
+
+  // the arguments may be string literals, std::string's or std::string_view's
+  Process child = Process::spawn({"echo", dir, std::string_view("fd", 2)}, "r");
+  if (child.read_all() != "/proc/self fd\n") errx(EXIT_FAILURE, "Process::read_all(): unexpected output");
+  res = child.wait();
+  if (child || !res.exited() || res.exit_code() != 0) errx(EXIT_FAILURE, "Process::wait(): unexpected status %d", res.status);
+
+  // too long for the inline buffer of Args
+  long_args.insert(long_args.begin(), "true");
+  res = Process::spawn(Args(long_args)).wait();
+  if (res.exit_code() != 0) errx(EXIT_FAILURE, "Args: long lists don't work");
+
+  // the rusage of the child
+  res = Process::spawn({"sh", "-c", "i=0; while [ $i -lt 20000 ]; do i=$((i+1)); done"}).wait();
+  if (res.usage.ru_utime.tv_sec == 0 && res.usage.ru_utime.tv_usec == 0) errx(EXIT_FAILURE, "Result: no rusage");
+
+  // the argv of the variadic spawn() is an array on our stack
+  res = popen_noshell_cpp::spawn("test", "-d", dir).wait();
+  if (res.exit_code() != 0) errx(EXIT_FAILURE, "spawn(): variadic arguments");
+  Process echo = popen_noshell_cpp::spawn_ex("r", NULL, std::string("echo"), "variadic", dir);
+  if (echo.read_all() != "variadic /proc/self\n") errx(EXIT_FAILURE, "spawn_ex(): unexpected output");
+  echo.wait();
+
+  // a moved-to Process owns the child, and "cat" gets EOF when the pipe is closed
+  Process writer = Process::spawn({"cat"}, "w");
+  Process other(std::move(writer));
+  if (writer || !other) errx(EXIT_FAILURE, "Process: move");
+  if (other.write("") != 0) errx(EXIT_FAILURE, "Process::write()");
+  if (other.wait().exit_code() != 0) errx(EXIT_FAILURE, "Process: cat failed");
+
+  // failures, with and without exceptions
+  Process missing = Process::spawn({"/non-existent"}, "r", NULL, ec);
+  if (missing || ec.value() != ENOENT) errx(EXIT_FAILURE, "Process::spawn(): expected ENOENT");
+  try {
+    Process::spawn({"/non-existent"});
+    errx(EXIT_FAILURE, "Process::spawn(): no exception");
+  } catch (const std::system_error &e) {
+    if (e.code().value() != ENOENT) errx(EXIT_FAILURE, "Process::spawn(): expected ENOENT");
+  }
+
+  // a killed child, and the destructor reaps a child which was not waited for
+  {
+    Process sleeper = Process::spawn({"sleep", "10"});
+    sleeper.kill(SIGKILL);
+    res = sleeper.wait();
+    if (!res.signaled() || res.signal() != SIGKILL) errx(EXIT_FAILURE, "Process::kill(): unexpected status %d", res.status);
+    Process quick = Process::spawn({"true"});
+  }
+
+  // a detached child is ours to pclose_noshell(), and it is the very handle which the timers know
+  struct popen_noshell_options opts;
+  struct popen_noshell_timers timers;
+  popen_noshell_options_init(&opts);
+  opts.timeout_ms = 10000;
+  if (popen_noshell_timers_init(&timers) != 0) err(EXIT_FAILURE, "popen_noshell_timers_init()");
+  Process timed = Process::spawn({"true"}, "r", &opts);
+  if (popen_noshell_timers_add(&timers, timed.native_handle()) != 0) err(EXIT_FAILURE, "popen_noshell_timers_add()");
+  std::unique_ptr<struct popen_noshell_pass_to_pclose> raw = timed.detach();
+  if (timed || timers.heap[0] != raw.get()) errx(EXIT_FAILURE, "Process::detach(): not the same handle");
+  if (pclose_noshell(raw.get()) != 0) errx(EXIT_FAILURE, "Process::detach(): pclose_noshell()");
+  if (timers.count != 0) errx(EXIT_FAILURE, "Process::detach(): the timers entry was not removed");
+  popen_noshell_timers_destroy(&timers);
+
+  if (waitpid(-1, NULL, WNOHANG) != -1) errx(EXIT_FAILURE, "Process: a child was not reaped");
+  printf("The C++ wrapper works.\n");
+}
+
+#if __cplusplus >= 202002L
+// The coroutines of popen_noshell_coro.hpp.
+using popen_noshell_cpp::AsyncProcess;
+using popen_noshell_cpp::EpollReactor;
+using popen_noshell_cpp::Reactor;
+using popen_noshell_cpp::Task;
+using popen_noshell_cpp::async_spawn;
+
+static Task<int> sum_lines(Reactor &reactor, int n) {
+  std::string count = std::to_string(n), line;
+  auto spawn = async_spawn(reactor, {"seq", "1", count});
+  AsyncProcess child = co_await spawn;
+  int sum = 0;
+
+  while (co_await child.next_line(line)) sum += atoi(line.c_str());
+  if ((co_await child.wait()).exit_code() != 0) errx(EXIT_FAILURE, "coroutines: seq failed");
+  co_return sum;
+}
+
+static Task<size_t> count_bytes(Reactor &reactor) {
+  std::vector<std::string> cmd = {"head", "-c", "1000000", "/dev/zero"};
+  AsyncProcess child = co_await async_spawn(reactor, cmd);
+  size_t bytes = 0, len;
+
+  while ((len = (co_await child.next_chunk()).size()) > 0) bytes += len;
+  co_await child.wait();
+  co_return bytes;
+}
+
+static Task<> many_children(Reactor &reactor, int *done) {
+  int sum = co_await sum_lines(reactor, 100);
+
+  if (sum != 5050) errx(EXIT_FAILURE, "coroutines: wrong sum");
+  ++*done;
+}
+
+static Task<bool> timed_out(Reactor &reactor) {
+  struct popen_noshell_options opts;
+  bool got_error = false;
+
+  popen_noshell_options_init(&opts);
+  opts.timeout_ms = 100;
+  auto spawn = async_spawn(reactor, {"sleep", "10"}, "r", &opts);
+  AsyncProcess child = co_await spawn;
+  try {
+    co_await child.next_chunk();
+  } catch (const std::system_error &e) {
+    got_error = (e.code().value() == ETIMEDOUT);
+  }
+  co_return (got_error && (co_await child.wait()).timed_out);
+}
+
+static void test_coroutines() {
+  EpollReactor reactor;
+  std::vector<Task<>> tasks;
+  int i, done = 0;
+
+  if (reactor.run(sum_lines(reactor, 10000)) != 50005000) errx(EXIT_FAILURE, "coroutines: wrong sum of lines");
+  if (reactor.run(count_bytes(reactor)) != 1000000) errx(EXIT_FAILURE, "coroutines: wrong number of bytes");
+  if (!reactor.run(timed_out(reactor))) errx(EXIT_FAILURE, "coroutines: the deadline did not fire");
+
+  // one thread drives all children at once
+  for (i = 0; i < 200; ++i) {
+    tasks.push_back(many_children(reactor, &done));
+    tasks.back().start();
+  }
+  reactor.run();
+  if (done != 200) errx(EXIT_FAILURE, "coroutines: %d of 200 tasks completed", done);
+
+  if (waitpid(-1, NULL, WNOHANG) != -1) errx(EXIT_FAILURE, "coroutines: a child was not reaped");
+  printf("The coroutines work.\n");
+}
+#endif
+
 int main() {
   FILE *fp;
   char buf[256];
@@ -71,21 +230,23 @@ int main() {
   char *arg3 = (char *) NULL; /* last element */
   char *argv[] = {exec_file, arg1, arg2, arg3}; /* NOTE! The first argv[] must be the executed *exec_file itself */
 
+  // The child reports the failed exec() before it exits, so popen_noshell() returns NULL right away.
   fp = popen_noshell(argv[0], (const char * const *)argv, "r", &pclose_arg, 0);
-  if (!fp) {
-    err(EXIT_FAILURE, "popen_noshell()");
-  }
+  if (fp) {
+    while (fgets(buf, sizeof(buf)-1, fp)) {
+      printf("Got line: %s", buf);
+    }
 
-  while (fgets(buf, sizeof(buf)-1, fp)) {
-    printf("Got line: %s", buf);
+    status = pclose_noshell(&pclose_arg);
+    if (status == -1) {
+      err(EXIT_FAILURE, "pclose_noshell()");
+    }
+    errx(EXIT_FAILURE, "popen_noshell() must have failed, but the child exited with status %d", status);
   }
-
-  status = pclose_noshell(&pclose_arg);
-  if (status == -1) {
-    err(EXIT_FAILURE, "pclose_noshell()");
-  } else {
-    printf("The status of the child is %d. Note that this is not only the exit code. See man waitpid().\n", status);
+  if (errno != ENOENT) {
+    err(EXIT_FAILURE, "popen_noshell()");
   }
+  printf("popen_noshell() failed with ENOENT, as expected.\n");
 
   // Trying to access our global variable stuff.
   // If exit() is used in the child process, dummy.val = 0 and we have a crash.
@@ -93,6 +254,11 @@ int main() {
 
   // printf("Accessing dummy stuff. dummy.val=%p\n", dummy.val);
   memset(dummy.val, 42, DUMMY_SIZE);
+  test_process_wrapper();
+#if __cplusplus >= 202002L
+  test_coroutines();
+#endif
+
   printf("\nTests passed OK.\n");
 
   return 0;
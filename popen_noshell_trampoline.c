@@ -0,0 +1,170 @@
+/*
+ * popen_noshell: A faster implementation of popen() and system() for Linux.
+ * Copyright (c) 2009 Ivan Zahariev (famzah)
+ * Version: 1.0
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; under version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "popen_noshell.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * The trampoline of POPEN_NOSHELL_MODE_TRAMPOLINE: popen_noshell_ex() spawns this tiny program by posix_spawn(),
+ * which is as fast as vfork(), and it does what posix_spawn() cannot do before it exec()'s the command:
+ *
+ *	popen_noshell_trampoline -e ERRFD [-s] [-d DIR] [-r RES:CUR:MAX]... [-a HEXMASK] [-c [-k FD]...] -- FILE ARGV0 ARGV1...
+ *
+ *	-e	the error channel of the library; a failure is written there as int[2] {POPEN_NOSHELL_CHILD_*, errno}
+ *	-s	setsid()
+ *	-d	chdir()
+ *	-r	setrlimit(), the limits in decimal
+ *	-a	sched_setaffinity(), the bytes of the cpu_set_t in hex
+ *	-c	close all fds above STDERR, except the -k ones
+ *
+ * STDIN, STDOUT and STDERR are set up by posix_spawn() already. FILE is searched in PATH as by execvp().
+ * The options come from popen_noshell_ex() only, so they are parsed without much ceremony.
+ *
+ * Compile via:
+ *	gcc -Wall -O2 -static popen_noshell_trampoline.c -o popen_noshell_trampoline
+ * and install it as POPEN_NOSHELL_TRAMPOLINE_PATH, or tell the library where it is by popen_noshell_set_trampoline().
+ */
+
+int err_fd = -1;
+
+void fail(int stage) {
+	int msg[2] = {stage, errno};
+	ssize_t ret;
+
+	if (err_fd >= 0) {
+		do {
+			ret = write(err_fd, msg, sizeof(msg));
+		} while (ret < 0 && errno == EINTR);
+	}
+	_exit(127);
+}
+
+// the library sees EOF on "err_fd" as a successful exec(), so bad arguments must be reported like the failures
+void bad_args() {
+	errno = EINVAL;
+	fail(POPEN_NOSHELL_CHILD_EXEC);
+}
+
+// FD_CLOEXEC on all fds above STDERR, so that exec() closes them; the kept ones lose it
+int close_fds(const int *keep_fds, int keep_fds_count) {
+	struct dirent *de;
+	DIR *dir;
+	int fd, i;
+
+#if defined(SYS_close_range) && defined(CLOSE_RANGE_CLOEXEC)
+	if (syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC) != 0)
+#endif
+	{
+		dir = opendir("/proc/self/fd");
+		if (!dir) return -1;
+		while ((de = readdir(dir))) {
+			if (de->d_name[0] < '0' || de->d_name[0] > '9') continue;
+			fd = atoi(de->d_name);
+			if (fd > STDERR_FILENO && fd != dirfd(dir)) fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+		closedir(dir);
+	}
+	for (i = 0; i < keep_fds_count; ++i) {
+		if (keep_fds[i] > STDERR_FILENO && keep_fds[i] != err_fd && fcntl(keep_fds[i], F_SETFD, 0) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// the mask may be larger than a cpu_set_t, as "cpu_affinity_size" of the library allows
+int set_affinity(const char *hex) {
+	unsigned char *mask;
+	size_t size = 0;
+	char byte[3] = {0, 0, 0};
+	int ret;
+
+	mask = (unsigned char *)calloc(strlen(hex) / 2 + 1, 1);
+	if (!mask) return -1;
+	while (hex[0] && hex[1]) {
+		byte[0] = hex[0];
+		byte[1] = hex[1];
+		mask[size++] = (unsigned char)strtoul(byte, NULL, 16);
+		hex += 2;
+	}
+	ret = sched_setaffinity(0, size, (const cpu_set_t *)mask);
+	free(mask);
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	int keep_fds[argc];
+	const char *rlimits[argc];
+	int keep_fds_count = 0, rlimits_count = 0, new_session = 0, close_all = 0;
+	const char *cwd = NULL, *affinity = NULL;
+	struct rlimit limit;
+	char *p;
+	int i, j;
+
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--") == 0) break;
+		if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0') bad_args();
+		switch (argv[i][1]) {
+			case 's': new_session = 1; continue;
+			case 'c': close_all = 1; continue;
+		}
+		if (i + 1 >= argc) bad_args();
+		switch (argv[i][1]) {
+			case 'e':
+				err_fd = atoi(argv[i + 1]);
+				fcntl(err_fd, F_SETFD, FD_CLOEXEC); // so that the library sees EOF after a successful exec()
+				break;
+			case 'd': cwd = argv[i + 1]; break;
+			case 'a': affinity = argv[i + 1]; break;
+			case 'r': rlimits[rlimits_count++] = argv[i + 1]; break;
+			case 'k': keep_fds[keep_fds_count++] = atoi(argv[i + 1]); break;
+			default: bad_args();
+		}
+		++i;
+	}
+	if (i + 2 > argc) bad_args(); // no "--", or no FILE after it
+
+	// the same order as _popen_noshell_child_process() and _popen_noshell_child_setup()
+	if (new_session && setsid() < 0) fail(POPEN_NOSHELL_CHILD_PGROUP);
+	if (close_all && close_fds(keep_fds, keep_fds_count) != 0) fail(POPEN_NOSHELL_CHILD_CLOSE_FDS);
+	if (cwd && chdir(cwd) != 0) fail(POPEN_NOSHELL_CHILD_CWD);
+	for (j = 0; j < rlimits_count; ++j) { // RES:CUR:MAX
+		p = (char *)strchr(rlimits[j], ':');
+		if (!p) bad_args();
+		limit.rlim_cur = strtoull(p + 1, &p, 10);
+		limit.rlim_max = strtoull(p + 1, NULL, 10);
+		if (setrlimit((__rlimit_resource_t)atoi(rlimits[j]), &limit) != 0) fail(POPEN_NOSHELL_CHILD_RLIMIT);
+	}
+	if (affinity && set_affinity(affinity) != 0) fail(POPEN_NOSHELL_CHILD_AFFINITY);
+
+	execvp(argv[i + 1], &argv[i + 2]);
+	fail(POPEN_NOSHELL_CHILD_EXEC);
+	return 127;
+}